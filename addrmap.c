@@ -0,0 +1,146 @@
+/*
+ * addrmap.c
+ *
+ * implementation of the address index: linear probing over a power-of-two
+ * table of ids, with backward-shift deletion so no tombstones accumulate
+ */
+
+#include "addrmap.h"
+#include <stdlib.h>
+
+#define DEFAULT_CAPACITY 1024L
+
+struct addrmap {
+    long size;
+    long mask;			/* number of slots - 1 */
+    uint32_t *slots;		/* id + 1; 0 marks an empty slot */
+    struct sockaddr_in **column;
+};
+
+uint64_t am_key(const struct sockaddr_in *addr) {
+    return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+/*
+ * generate slot index from key (Fibonacci hashing)
+ */
+static long slotOf(AddrMap *am, uint64_t key) {
+    return (long)((key * 0x9E3779B97F4A7C15ULL) >> 32) & am->mask;
+}
+
+static uint64_t keyOf(AddrMap *am, uint32_t slot) {
+    return am_key(&(*am->column)[slot - 1]);
+}
+
+AddrMap *am_create(long capacity, struct sockaddr_in **column) {
+    AddrMap *am;
+    long N = 16L;
+
+    if (capacity <= 0L)
+        capacity = DEFAULT_CAPACITY;
+    while (N < 2 * capacity)
+        N *= 2;
+    am = (AddrMap *)malloc(sizeof(AddrMap));
+    if (am != NULL) {
+        am->slots = (uint32_t *)calloc(N, sizeof(uint32_t));
+        if (am->slots == NULL) {
+            free(am);
+            return NULL;
+        }
+        am->size = 0L;
+        am->mask = N - 1;
+        am->column = column;
+    }
+    return am;
+}
+
+void am_destroy(AddrMap *am) {
+    free(am->slots);
+    free(am);
+}
+
+/*
+ * local function to locate the slot holding `key', or the empty slot where
+ * it would be inserted
+ */
+static long findSlot(AddrMap *am, uint64_t key) {
+    long i = slotOf(am, key);
+
+    while (am->slots[i] != 0 && keyOf(am, am->slots[i]) != key)
+        i = (i + 1) & am->mask;
+    return i;
+}
+
+int am_get(AddrMap *am, const struct sockaddr_in *addr) {
+    long i = findSlot(am, am_key(addr));
+
+    return (int)am->slots[i] - 1;
+}
+
+void am_prefetch(AddrMap *am, const struct sockaddr_in *addr) {
+    __builtin_prefetch(&am->slots[slotOf(am, am_key(addr))]);
+}
+
+/*
+ * routine that doubles the table
+ */
+static int resize(AddrMap *am) {
+    uint32_t *old = am->slots;
+    long n = am->mask + 1, i;
+
+    am->slots = (uint32_t *)calloc(2 * n, sizeof(uint32_t));
+    if (am->slots == NULL) {
+        am->slots = old;
+        return 0;
+    }
+    am->mask = 2 * n - 1;
+    for (i = 0L; i < n; i++)
+        if (old[i] != 0)
+            am->slots[findSlot(am, keyOf(am, old[i]))] = old[i];
+    free(old);
+    return 1;
+}
+
+int am_put(AddrMap *am, int id) {
+    long i;
+
+    if (2 * (am->size + 1) > am->mask + 1 && !resize(am))
+        return 0;
+    i = findSlot(am, am_key(&(*am->column)[id]));
+    if (am->slots[i] == 0)
+        am->size++;
+    am->slots[i] = (uint32_t)id + 1;
+    return 1;
+}
+
+int am_remove(AddrMap *am, const struct sockaddr_in *addr) {
+    long i = findSlot(am, am_key(addr)), j;
+    int id = (int)am->slots[i] - 1;
+
+    if (id < 0)
+        return -1;
+    /* shift later members of the probe run back over the hole */
+    j = i;
+    for (;;) {
+        long k;
+        j = (j + 1) & am->mask;
+        if (am->slots[j] == 0)
+            break;
+        k = slotOf(am, keyOf(am, am->slots[j]));
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            am->slots[i] = am->slots[j];
+            i = j;
+        }
+    }
+    am->slots[i] = 0;
+    am->size--;
+    return id;
+}
+
+long am_size(AddrMap *am) {
+    return am->size;
+}
+
+size_t am_footprint(AddrMap *am) {
+    return sizeof(AddrMap) + (am->mask + 1) * sizeof(uint32_t);
+}
@@ -0,0 +1,82 @@
+#ifndef _ADDRMAP_H_
+#define _ADDRMAP_H_
+
+/*
+ * interface definition for an index of session ids by IPv4 socket address
+ *
+ * the server identifies a session by the ip:port it sends from, and keeps
+ * every session's address in a column indexed by a dense session id; this
+ * index maps an address back to its id
+ *
+ * the table is open-addressed and holds nothing but ids (4 bytes a slot):
+ * the addresses themselves are read from the caller's column, so the index
+ * costs 8-16 bytes per session and an insertion never allocates (the table
+ * only grows, by doubling, when it passes half full)
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct addrmap AddrMap;		/* opaque type definition */
+
+/*
+ * packs the address and port of `addr' into a single integer; two
+ * addresses are the same session iff their keys are equal
+ */
+uint64_t am_key(const struct sockaddr_in *addr);
+
+/*
+ * create an index whose ids refer to entries of `*column'; the column may
+ * be reallocated by the caller, as long as `*column' is kept up to date
+ * and the entry of every indexed id is not changed while it is indexed
+ *
+ * room is made for `capacity' ids before the first resize; if
+ * capacity == 0, a default (1024) is used
+ *
+ * returns a pointer to the index, or NULL if there are malloc() errors
+ */
+AddrMap *am_create(long capacity, struct sockaddr_in **column);
+
+/*
+ * destroys the index; the column is not touched
+ */
+void am_destroy(AddrMap *am);
+
+/*
+ * returns the id whose column entry matches `addr', or -1 if none does
+ */
+int am_get(AddrMap *am, const struct sockaddr_in *addr);
+
+/*
+ * starts loading the slot `addr' hashes to into the cache, for a get, put
+ * or remove of it a few operations later
+ */
+void am_prefetch(AddrMap *am, const struct sockaddr_in *addr);
+
+/*
+ * indexes `id' under the address currently in its column entry; no other
+ * indexed id may have the same address
+ *
+ * returns 1 if successful, 0 if not (malloc failure while growing)
+ */
+int am_put(AddrMap *am, int id);
+
+/*
+ * removes the id indexed under `addr', if any
+ *
+ * returns the id removed, or -1 if there was no id for `addr'
+ */
+int am_remove(AddrMap *am, const struct sockaddr_in *addr);
+
+/*
+ * returns the number of ids in the index
+ */
+long am_size(AddrMap *am);
+
+/*
+ * returns the number of bytes of heap held by the index
+ */
+size_t am_footprint(AddrMap *am);
+
+#endif /* _ADDRMAP_H_ */
@@ -0,0 +1,184 @@
+/*
+ * arraylist.c
+ *
+ * array-backed implementation of the generic linked list interface
+ *
+ * elements are kept contiguously in a growable array, so that walking the
+ * list (ll_get() with increasing index, ll_toArray()) touches consecutive
+ * memory instead of chasing one heap node per element; removal from the
+ * middle shifts the tail down with memmove(), which preserves the ordering
+ * guarantees of linkedlist.h
+ *
+ * the server keeps its member lists in slab records and links neither
+ * implementation; this one is built only for bench_fanout_array, which
+ * times it against linkedlist.c
+ */
+
+#include "linkedlist.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CAPACITY 8	/* initial number of slots */
+
+struct linkedlist {
+    long size;
+    long capacity;
+    void **elements;
+};
+
+LinkedList *ll_create(void) {
+    LinkedList *ll;
+
+    ll = (LinkedList *)malloc(sizeof(LinkedList));
+    if (ll != NULL) {
+        ll->size = 0L;
+        ll->capacity = 0L;
+        ll->elements = NULL;
+    }
+    return ll;
+}
+
+/*
+ * calls userFunction on each element, first to last
+ */
+static void purge(LinkedList *ll, void (*userFunction)(void *element)) {
+    long i;
+
+    if (userFunction != NULL)
+        for (i = 0L; i < ll->size; i++)
+            (*userFunction)(ll->elements[i]);
+}
+
+void ll_destroy(LinkedList *ll, void (*userFunction)(void *element)) {
+    purge(ll, userFunction);
+    free(ll->elements);
+    free(ll);
+}
+
+/*
+ * makes room for at least one more element, doubling the array
+ *
+ * returns 1 if successful, 0 if not (realloc failure)
+ */
+static int ensureRoom(LinkedList *ll) {
+    long N;
+    void **tmp;
+
+    if (ll->size < ll->capacity)
+        return 1;
+    N = (ll->capacity > 0L) ? 2 * ll->capacity : DEFAULT_CAPACITY;
+    tmp = (void **)realloc(ll->elements, N * sizeof(void *));
+    if (tmp == NULL)
+        return 0;
+    ll->elements = tmp;
+    ll->capacity = N;
+    return 1;
+}
+
+int ll_add(LinkedList *ll, void *element) {
+    return ll_addLast(ll, element);
+}
+
+int ll_insert(LinkedList *ll, long index, void *element) {
+    int status = 0;
+
+    if (index >= 0L && index <= ll->size && ensureRoom(ll)) {
+        memmove(&ll->elements[index + 1], &ll->elements[index],
+                (ll->size - index) * sizeof(void *));
+        ll->elements[index] = element;
+        ll->size++;
+        status = 1;
+    }
+    return status;
+}
+
+int ll_addFirst(LinkedList *ll, void *element) {
+    return ll_insert(ll, 0L, element);
+}
+
+int ll_addLast(LinkedList *ll, void *element) {
+    int status = 0;
+
+    if (ensureRoom(ll)) {
+        ll->elements[ll->size++] = element;
+        status = 1;
+    }
+    return status;
+}
+
+void ll_clear(LinkedList *ll, void (*userFunction)(void *element)) {
+    purge(ll, userFunction);
+    ll->size = 0L;
+}
+
+int ll_get(LinkedList *ll, long index, void **element) {
+    int status = 0;
+
+    if (index >= 0L && index < ll->size) {
+        *element = ll->elements[index];
+        status = 1;
+    }
+    return status;
+}
+
+int ll_getFirst(LinkedList *ll, void **element) {
+    return ll_get(ll, 0L, element);
+}
+
+int ll_getLast(LinkedList *ll, void **element) {
+    return ll_get(ll, ll->size - 1, element);
+}
+
+int ll_remove(LinkedList *ll, long index, void **element) {
+    int status = 0;
+
+    if (index >= 0L && index < ll->size) {
+        *element = ll->elements[index];
+        ll->size--;
+        memmove(&ll->elements[index], &ll->elements[index + 1],
+                (ll->size - index) * sizeof(void *));
+        status = 1;
+    }
+    return status;
+}
+
+int ll_removeFirst(LinkedList *ll, void **element) {
+    return ll_remove(ll, 0L, element);
+}
+
+int ll_removeLast(LinkedList *ll, void **element) {
+    return ll_remove(ll, ll->size - 1, element);
+}
+
+int ll_set(LinkedList *ll, long index, void *element, void **previous) {
+    int status = 0;
+
+    if (index >= 0L && index < ll->size) {
+        *previous = ll->elements[index];
+        ll->elements[index] = element;
+        status = 1;
+    }
+    return status;
+}
+
+long ll_size(LinkedList *ll) {
+    return ll->size;
+}
+
+int ll_isEmpty(LinkedList *ll) {
+    return (ll->size == 0L);
+}
+
+void **ll_toArray(LinkedList *ll, long *len) {
+    void **tmp = NULL;
+
+    if (ll->size > 0L) {
+        size_t nbytes = ll->size * sizeof(void *);
+        tmp = (void **)malloc(nbytes);
+        if (tmp != NULL) {
+            memcpy(tmp, ll->elements, nbytes);
+            *len = ll->size;
+        }
+    }
+    return tmp;
+}
@@ -0,0 +1,100 @@
+/*
+ * bench_fanout.c
+ *
+ * Fan-out iteration benchmark for the ll_* member lists.
+ *
+ * Builds channels of 10k members, churns them with joins and leaves so the
+ * list storage is as scattered as it gets on a long-running server, then
+ * times the two access patterns server.c uses on a member list: the
+ * ll_toArray() walk done for every say, and the ll_get() index walk done
+ * on join and leave.  Link against linkedlist.o or arraylist.o to compare
+ * the two implementations (make bench builds both).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "linkedlist.h"
+
+#define MEMBERS 10000L
+#define CHANNELS 4
+#define SAYS 2000
+#define CHURN 50000L
+#define INDEX_WALKS 5
+
+typedef struct {
+    struct sockaddr_in *addr;
+    char *username;
+} Member;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Member *make_member(long i) {
+    Member *m = malloc(sizeof(Member));
+    m->addr = malloc(sizeof(struct sockaddr_in));
+    m->username = malloc(16);
+    memset(m->addr, 0, sizeof(*m->addr));
+    m->addr->sin_port = htons((unsigned short)i);
+    snprintf(m->username, 16, "user%ld", i);
+    return m;
+}
+
+int main(void) {
+    LinkedList *lists[CHANNELS];
+    Member **members;
+    long i, c, len;
+    unsigned long sum = 0UL;
+    double start, elapsed;
+
+    srand(432);
+    members = malloc(MEMBERS * CHANNELS * sizeof(Member *));
+    for (i = 0L; i < MEMBERS * CHANNELS; i++)
+        members[i] = make_member(i);
+
+    /* interleave the channels so list storage is not allocated in order */
+    for (c = 0; c < CHANNELS; c++)
+        lists[c] = ll_create();
+    for (i = 0L; i < MEMBERS; i++)
+        for (c = 0; c < CHANNELS; c++)
+            ll_add(lists[c], members[c * MEMBERS + i]);
+
+    /* leave from a random position, rejoin at the tail */
+    for (i = 0L; i < CHURN; i++) {
+        void *m;
+        c = rand() % CHANNELS;
+        if (ll_remove(lists[c], rand() % MEMBERS, &m))
+            ll_add(lists[c], m);
+    }
+
+    start = now();
+    for (i = 0L; i < SAYS; i++) {
+        Member **listeners = (Member **)ll_toArray(lists[i % CHANNELS], &len);
+        for (long j = 0L; j < len; j++)
+            sum += listeners[j]->addr->sin_port;
+        free(listeners);
+    }
+    elapsed = now() - start;
+    printf("toArray fan-out: %d says x %ld members: %.3f s, %.1f M recipients/s\n",
+           SAYS, MEMBERS, elapsed, SAYS * MEMBERS / elapsed / 1e6);
+
+    start = now();
+    for (i = 0L; i < INDEX_WALKS; i++) {
+        void *m;
+        for (long j = 0L; j < ll_size(lists[i % CHANNELS]); j++) {
+            (void)ll_get(lists[i % CHANNELS], j, &m);
+            sum += ((Member *)m)->addr->sin_port;
+        }
+    }
+    elapsed = now() - start;
+    printf("ll_get index walk: %d walks x %ld members: %.3f s\n",
+           INDEX_WALKS, MEMBERS, elapsed);
+
+    printf("(checksum %lu)\n", sum);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * bench_fanpool.c
+ *
+ * Parallel fan-out benchmark.  Logs in RECIPIENTS sessions on loopback
+ * addresses through the real handlers, joins them all to one channel, and
+ * times SAYS says to it with the fan-out pool at each thread count (0 is
+ * inline fan-out on the dispatch thread).  Reports the recipients sent to
+ * per second, and how long each say kept the dispatch thread busy.  Each
+ * thread count runs in its own child process, from fresh server state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define RECIPIENTS 100000
+#define SAYS 20
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// loopback addresses nobody listens on, so each send runs the whole stack
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f010000 | (i >> 4));
+    addr->sin_port = htons(9000 + (i & 0xf));
+}
+
+static void run(int threads) {
+    struct request_login login;
+    struct request_join join;
+    struct request_say say;
+    struct sockaddr_in addr;
+    double start, handed, busy = 0.0, total = 0.0;
+    int i;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    fanout_policy.threads = threads;
+    fanout_policy.threshold = 1L;
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    if (server_init_state() < 0)
+        exit(EXIT_FAILURE);
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    strcpy(join.req_channel, "big");
+    for (i = 0; i < RECIPIENTS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        server_login_request((char *)&login, sizeof(login), &addr);
+        server_join_request((char *)&join, &addr);
+    }
+
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_channel, "big");
+    strcpy(say.req_text, "hello, everyone");
+    make_addr(&addr, 0);
+    for (i = 0; i < SAYS; i++) {
+        start = now();
+        server_say_request((char *)&say, &addr);
+        handed = now();
+        server_fanout_wait();
+        busy += handed - start;
+        total += now() - start;
+    }
+    fprintf(stderr, "%7d  %14.0f  %18.1f\n", threads,
+            (double)RECIPIENTS * SAYS / total, busy / SAYS * 1e3);
+    exit(EXIT_SUCCESS);
+}
+
+int main(void) {
+    static const int threads[] = { 0, 1, 2, 4, 8 };
+    unsigned i;
+
+    fprintf(stderr, "%d recipients, %d says, %ld CPUs\n", RECIPIENTS, SAYS, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(stderr, "threads  recipients/s  dispatch busy(ms)\n");
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        if (fork() == 0)
+            run(threads[i]);
+        wait(NULL);
+    }
+    return 0;
+}
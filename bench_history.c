@@ -0,0 +1,150 @@
+/*
+ * bench_history.c
+ *
+ * Channel history benchmark.  Logs in CHANNELS sessions that take batches,
+ * each the only member of its own channel, and times SAYS says spread over
+ * the channels, then a REQ_HISTORY from every session for its channel.  Runs
+ * with no history and with each depth, each in its own child process from
+ * fresh server state, and reports the time per say in the fastest of ROUNDS
+ * rounds, the resident memory the says added per channel next to the ring's
+ * fixed size, and the time per replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define CHANNELS 100000
+#define SAYS 1000000
+#define ROUNDS 5 /* the says are timed in rounds, and the fastest counts */
+#define RECORD_BYTES (USERNAME_MAX + SAY_MAX)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long resident(void) {
+    long pages = 0L, rss = 0L;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+            rss = 0L;
+        fclose(f);
+    }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f010000 | (i >> 4));
+    addr->sin_port = htons(9000 + (i & 0xf));
+}
+
+// out[0]: seconds per say, out[1]: bytes per channel, out[2]: seconds per replay
+static void run(int depth, double *out) {
+    struct request_login_caps login;
+    struct request_join join;
+    struct request_say say;
+    struct request_history history;
+    struct sockaddr_in addr;
+    double start;
+    long before;
+    int i, r;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+    history_policy.depth = depth;
+    fanout_policy.threads = 0;
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        exit(EXIT_FAILURE);
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    login.req_caps = CAP_BATCH;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    for (i = 0; i < CHANNELS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        snprintf(join.req_channel, CHANNEL_MAX, "channel-%d", i);
+        server_login_request((char *)&login, sizeof(login), &addr);
+        server_join_request((char *)&join, &addr);
+    }
+
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_text, "hello there, this is a fairly ordinary chat message");
+    before = resident();
+    out[0] = 1.0;
+    for (r = 0; r < ROUNDS; r++) {
+        start = now();
+        for (i = r * (SAYS / ROUNDS); i < (r + 1) * (SAYS / ROUNDS); i++) {
+            int c = i % CHANNELS;
+            make_addr(&addr, c);
+            snprintf(say.req_channel, CHANNEL_MAX, "channel-%d", c);
+            server_say_request((char *)&say, &addr);
+        }
+        if ((now() - start) / (SAYS / ROUNDS) < out[0])
+            out[0] = (now() - start) / (SAYS / ROUNDS);
+    }
+    out[1] = (double)(resident() - before) / CHANNELS;
+
+    memset(&history, 0, sizeof(history));
+    history.req_type = REQ_HISTORY;
+    start = now();
+    for (i = 0; i < CHANNELS; i++) {
+        make_addr(&addr, i);
+        snprintf(history.req_channel, CHANNEL_MAX, "channel-%d", i);
+        server_history_request((char *)&history, &addr);
+    }
+    out[2] = (now() - start) / CHANNELS;
+}
+
+int main(void) {
+    static const int depths[] = { 0, 16, 64 };
+    double base = 0.0;
+    unsigned i;
+
+    fprintf(stderr, "%d channels of 1 member, %d says (%d per channel)\n", CHANNELS, SAYS, SAYS / CHANNELS);
+    fprintf(stderr, "depth  ns/say  added  bytes/channel  ring bytes  us/replay\n");
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        double out[3];
+        int fds[2], status;
+        pid_t pid;
+
+        if (pipe(fds) < 0)
+            return 1;
+        if ((pid = fork()) == 0) {
+            run(depths[i], out);
+            if (write(fds[1], out, sizeof(out)) != sizeof(out))
+                _exit(EXIT_FAILURE);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        if (read(fds[0], out, sizeof(out)) != sizeof(out) || waitpid(pid, &status, 0) < 0) {
+            fprintf(stderr, "%5d  failed\n", depths[i]);
+            close(fds[0]);
+            continue;
+        }
+        close(fds[0]);
+        if (depths[i] == 0)
+            base = out[0];
+        fprintf(stderr, "%5d  %6.0f  %5.0f  %13.0f  %10d  %9.2f\n", depths[i], out[0] * 1e9,
+                (out[0] - base) * 1e9, out[1], depths[i] * RECORD_BYTES, out[2] * 1e6);
+    }
+    return 0;
+}
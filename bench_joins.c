@@ -0,0 +1,145 @@
+/*
+ * bench_joins.c
+ *
+ * Subscription benchmark.  Drives the real server handlers with SESSIONS
+ * sessions that each join, and then leave, CHANNELS of NCHANNELS channels,
+ * three ways: a REQ_JOIN or REQ_LEAVE per channel; v1 REQ_JOIN_MANY and
+ * REQ_LEAVE_MANY requests, as many as the channels need at PAGE_BYTES_MAX
+ * each; and a single v2 datagram.  Each way starts from the same state, the
+ * sessions logged in and in no channel, and they are logged out after.
+ * Reports the datagrams and the handler time per session for the joins and
+ * the leaves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+#include "wire.h"
+
+#define SESSIONS 20000
+#define CHANNELS 50 /* channels per session */
+#define NCHANNELS 1000
+#define V1_MANY ((PAGE_BYTES_MAX - sizeof(struct request_channels)) / sizeof(struct channel_info))
+
+static char all_names[NCHANNELS][CHANNEL_MAX];
+static char names[CHANNELS][CHANNEL_MAX];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000 | (i >> 14));
+    addr->sin_port = htons(1024 + (i & 0x3fff));
+}
+
+static void pick_channels(int i) {
+    for (int c = 0; c < CHANNELS; c++)
+        memcpy(names[c], all_names[(i * 7 + c * 19) % NCHANNELS], CHANNEL_MAX);
+}
+
+// sends the session's joins (or leaves) the chosen way; returns the datagrams it took
+static int subscribe(int way, int leave, struct sockaddr_in *addr) {
+    static union {
+        struct request_join join;
+        struct request_leave leave;
+        struct {
+            struct request_channels header;
+            struct channel_info names[V1_MANY];
+        } many;
+        unsigned char v2[PAGE_BYTES_MAX];
+    } packet;
+    int c, k, sent = 0;
+
+    memset(&packet, 0, sizeof(packet));
+    if (way == 0) {
+        for (c = 0; c < CHANNELS; c++, sent++) {
+            packet.join.req_type = leave ? REQ_LEAVE : REQ_JOIN;
+            strcpy(packet.join.req_channel, names[c]);
+            server_dispatch((char *)&packet, sizeof(packet.join), addr);
+        }
+    } else if (way == 1) {
+        for (c = 0; c < CHANNELS; c += k, sent++) {
+            packet.many.header.req_type = leave ? REQ_LEAVE_MANY : REQ_JOIN_MANY;
+            for (k = 0; k < (int)V1_MANY && c + k < CHANNELS; k++)
+                strcpy(packet.many.names[k].ch_channel, names[c + k]);
+            packet.many.header.req_nchannels = k;
+            server_dispatch((char *)&packet, sizeof(packet.many.header) + k * sizeof(struct channel_info), addr);
+        }
+    } else {
+        WireWriter w;
+        wire_writer_init(&w, packet.v2, sizeof(packet.v2));
+        if (!wire_put_names(&w, leave ? REQ_LEAVE_MANY : REQ_JOIN_MANY, names[0], CHANNEL_MAX, CHANNELS))
+            return 0;
+        server_dispatch((char *)packet.v2, wire_len(&w), addr);
+        sent++;
+    }
+    return sent;
+}
+
+int main(void) {
+    static const char *ways[] = { "REQ_JOIN/REQ_LEAVE", "v1 bulk", "v2 bulk" };
+    struct request_login login;
+    struct sockaddr_in addr;
+    double start, t_join, t_leave;
+    long datagrams;
+    int way, i;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    fanout_policy.threads = 0;
+    if (server_init_state() < 0)
+        return 1;
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(all_names, 0, sizeof(all_names));
+    for (i = 0; i < NCHANNELS; i++)
+        snprintf(all_names[i], CHANNEL_MAX, "channel%d", i);
+
+    fprintf(stderr, "%d sessions, each joining and leaving %d of %d channels\n", SESSIONS, CHANNELS, NCHANNELS);
+    fprintf(stderr, "way                 datagrams  join(us)  leave(us)\n");
+    for (way = 0; way < 3; way++) {
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+            server_login_request((char *)&login, sizeof(login), &addr);
+        }
+
+        datagrams = 0L;
+        start = now();
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            pick_channels(i);
+            datagrams += subscribe(way, 0, &addr);
+        }
+        t_join = now() - start;
+
+        start = now();
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            pick_channels(i);
+            (void)subscribe(way, 1, &addr);
+        }
+        t_leave = now() - start;
+
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            server_logout_request(&addr);
+        }
+        fprintf(stderr, "%-18s  %9.1f  %8.3f  %9.3f\n", ways[way], (double)datagrams / SESSIONS,
+                t_join / SESSIONS * 1e6, t_leave / SESSIONS * 1e6);
+    }
+    return 0;
+}
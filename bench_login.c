@@ -0,0 +1,84 @@
+/*
+ * bench_login.c
+ *
+ * Login-storm benchmark.  Drives the real server handlers with bursts of
+ * 100k logins (each joining the default channel) followed by 100k logouts,
+ * and reports the time per operation and the heap statistics after every
+ * round.  With session records coming from slabs, the heap in use and the
+ * free heap should stay the same from the second round on: the storm
+ * reuses the records the previous one freed instead of fragmenting the
+ * heap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define SESSIONS 100000
+#define ROUNDS 5
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000 | (i >> 14));
+    addr->sin_port = htons(1024 + (i & 0x3fff));
+}
+
+int main(void) {
+    struct request_login login;
+    struct request_join join;
+    struct sockaddr_in addr;
+    double start, t_login, t_logout;
+    struct mallinfo2 mi;
+    int i, r;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        return 1;
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    strcpy(join.req_channel, "Common");
+
+    fprintf(stderr, "round  login(us)  logout(us)  heap-in-use(KB)  heap-free(KB)\n");
+    for (r = 0; r < ROUNDS; r++) {
+        start = now();
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+            server_login_request((char *)&login, sizeof(login), &addr);
+            server_join_request((char *)&join, &addr);
+        }
+        t_login = now() - start;
+
+        start = now();
+        for (i = 0; i < SESSIONS; i++) {
+            make_addr(&addr, i);
+            server_logout_request(&addr);
+        }
+        t_logout = now() - start;
+
+        mi = mallinfo2();
+        fprintf(stderr, "%5d  %9.3f  %10.3f  %15zu  %13zu\n", r,
+                t_login / SESSIONS * 1e6, t_logout / SESSIONS * 1e6,
+                mi.uordblks / 1024, mi.fordblks / 1024);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * bench_memory.c
+ *
+ * Session memory footprint benchmark.  Logs in 1M simulated sessions
+ * through the real handlers, then has each join one of 10k channels, and
+ * reports the growth in resident set size per session and per membership
+ * (see the budget next to the User record in server.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define SESSIONS 1000000
+#define CHANNELS 10000
+
+static long rss_bytes(void) {
+    long pages = 0L, resident = 0L;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL)
+        return 0L;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0L;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000 | (i >> 14));
+    addr->sin_port = htons(1024 + (i & 0x3fff));
+}
+
+int main(void) {
+    struct request_login login;
+    struct request_join join;
+    struct sockaddr_in addr;
+    long base, logged_in, joined;
+    int i;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        return 1;
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+
+    base = rss_bytes();
+    for (i = 0; i < SESSIONS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        server_login_request((char *)&login, sizeof(login), &addr);
+    }
+    logged_in = rss_bytes();
+
+    for (i = 0; i < SESSIONS; i++) {
+        make_addr(&addr, i);
+        snprintf(join.req_channel, CHANNEL_MAX, "channel-%d", i % CHANNELS);
+        server_join_request((char *)&join, &addr);
+    }
+    joined = rss_bytes();
+
+    fprintf(stderr, "%d sessions, %d channels\n", SESSIONS, CHANNELS);
+    fprintf(stderr, "RSS after login: %.1f MB, %.1f bytes/session\n",
+            (logged_in - base) / 1048576.0, (double)(logged_in - base) / SESSIONS);
+    fprintf(stderr, "RSS after join:  %.1f MB, %.1f bytes/membership (channels included)\n",
+            (joined - logged_in) / 1048576.0, (double)(joined - logged_in) / SESSIONS);
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * bench_overload.c
+ *
+ * Overload benchmark for ingress scheduling.  A server child runs the real
+ * event loop on a socket with a small SO_RCVBUF, a channel of MEMBERS
+ * sessions makes every say expensive, and a flooder child sends says to it
+ * at many times the rate the server can fan them out.  Meanwhile a probe
+ * logs in a fresh session every PROBE_GAP_MS and times the round trip of
+ * the WHO page asked right after the login.  Run idle, with arrival-order ingress and with priority
+ * ingress: with priority the probe latency should stay near the idle
+ * figure while says are shed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define MEMBERS 512
+#define RCVBUF_BYTES 65536
+#define RUN_MS 3000
+#define PROBE_GAP_MS 10
+#define PROBE_TIMEOUT_MS 1000
+#define FLOOD_BATCH 64
+#define FLOOD_RATE 20000 /* says per second, many times what MEMBERS allows */
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void send_login(int fd, struct sockaddr_in *to, const char *name) {
+    struct request_login login;
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    strncpy(login.req_username, name, USERNAME_MAX - 1);
+    sendto(fd, &login, sizeof(login), 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+static void send_join(int fd, struct sockaddr_in *to, const char *channel) {
+    struct request_join join;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    strncpy(join.req_channel, channel, CHANNEL_MAX - 1);
+    sendto(fd, &join, sizeof(join), 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+static int udp_socket(void) {
+    struct sockaddr_in any;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *)&any, sizeof(any));
+    return fd;
+}
+
+// runs the server loop on socket_fd until told to stop, then reports
+static void run_server(void) {
+    signal(SIGTERM, on_stop);
+    if (freopen("/dev/null", "w", stdout) == NULL || server_init_state() < 0)
+        exit(EXIT_FAILURE);
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    while (!stop)
+        server_poll();
+    fprintf(stderr, "    server: %lu says shed, %lu control requests dropped\n",
+            server_stats.says_shed, server_stats.control_dropped);
+    exit(EXIT_SUCCESS);
+}
+
+static void run_flooder(struct sockaddr_in *to) {
+    struct request_say say;
+    struct mmsghdr msgs[FLOOD_BATCH];
+    struct iovec iov;
+    struct timespec next;
+    int fd = udp_socket(), i;
+
+    signal(SIGTERM, on_stop);
+    send_login(fd, to, "flooder");
+    send_join(fd, to, "flood");
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_channel, "flood");
+    strcpy(say.req_text, "spam");
+    iov.iov_base = &say;
+    iov.iov_len = sizeof(say);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < FLOOD_BATCH; i++) {
+        msgs[i].msg_hdr.msg_name = to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // paced by sleeping, not spinning, so the flooder leaves the CPU to others
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!stop) {
+        sendmmsg(fd, msgs, FLOOD_BATCH, 0);
+        next.tv_nsec += 1000000000L / FLOOD_RATE * FLOOD_BATCH;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static void scenario(const char *label, int priority, int flood) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    int rcvbuf = RCVBUF_BYTES, members[MEMBERS], i, n = 0, lost = 0;
+    double lat[RUN_MS / PROBE_GAP_MS + 1], end;
+    pid_t server_pid, flood_pid = -1;
+    char name[USERNAME_MAX];
+
+    socket_fd = udp_socket();
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    getsockname(socket_fd, (struct sockaddr *)&addr, &alen);
+    ingress_policy.priority = priority;
+    if ((server_pid = fork()) == 0)
+        run_server();
+    close(socket_fd);
+
+    for (i = 0; i < MEMBERS; i++) {
+        members[i] = udp_socket();
+        snprintf(name, sizeof(name), "member%d", i);
+        send_login(members[i], &addr, name);
+        send_join(members[i], &addr, "flood");
+        if (i % 64 == 63)
+            usleep(2000);
+    }
+    usleep(100000);
+    if (flood && (flood_pid = fork()) == 0)
+        run_flooder(&addr);
+    usleep(200000);
+
+    end = now_ms() + RUN_MS;
+    while (now_ms() < end) {
+        struct request_who_page who;
+        struct pollfd pfd;
+        char reply[2 * PAGE_BYTES_MAX];
+        double start;
+        int fd = udp_socket(), got = 0;
+
+        snprintf(name, sizeof(name), "probe%d", n + lost);
+        memset(&who, 0, sizeof(who));
+        who.req_type = REQ_WHO_PAGE;
+        strcpy(who.req_channel, "Common");
+        start = now_ms();
+        send_login(fd, &addr, name);
+        sendto(fd, &who, sizeof(who), 0, (struct sockaddr *)&addr, sizeof(addr));
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (!got && poll(&pfd, 1, (int)(start + PROBE_TIMEOUT_MS - now_ms())) > 0) {
+            if (recv(fd, reply, sizeof(reply), 0) >= (ssize_t)sizeof(int) &&
+                ((struct text *)reply)->txt_type == TXT_WHO_PAGE)
+                got = 1;
+        }
+        if (got)
+            lat[n++] = now_ms() - start;
+        else
+            lost++;
+        ((struct request *)reply)->req_type = REQ_LOGOUT;
+        sendto(fd, reply, sizeof(struct request_logout), 0, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+        usleep(PROBE_GAP_MS * 1000);
+    }
+
+    if (flood_pid > 0) {
+        kill(flood_pid, SIGTERM);
+        waitpid(flood_pid, NULL, 0);
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+    fprintf(stderr, "%-10s %7d %5d %9.3f %9.3f %9.3f\n", label, n + lost, lost,
+            n ? lat[n / 2] : 0.0, n ? lat[(n * 99) / 100] : 0.0, n ? lat[n - 1] : 0.0);
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+    for (i = 0; i < MEMBERS; i++)
+        close(members[i]);
+}
+
+int main(void) {
+    fprintf(stderr, "%d-member channel, SO_RCVBUF %d, login+WHO probe every %d ms for %d ms\n",
+            MEMBERS, RCVBUF_BYTES, PROBE_GAP_MS, RUN_MS);
+    fprintf(stderr, "mode        probes  lost  p50(ms)   p99(ms)   max(ms)\n");
+    scenario("idle", 1, 0);
+    scenario("fifo", 0, 1);
+    scenario("priority", 1, 1);
+    return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * bench_reliable.c
+ *
+ * Reliable delivery benchmark.  A server runs in a child process on a
+ * loopback socket, with channels named "rel-..." reliable, and a client
+ * talks to it through a loss shim: a thread relaying datagrams between the
+ * two sockets that drops each one, either way, with probability LOSS.  The
+ * client logs in and joins a channel of which it is the only member, with
+ * the shim not yet dropping anything, then says SAYS numbered says there and
+ * counts the echoes the server fans back to it, with never more than a
+ * window's worth of says unechoed.  Reliably, the says go through the
+ * client's channel end and the run ends when every echo has been delivered
+ * in order.  Best-effort, the says are plain datagrams, and any not echoed
+ * within IDLE_USEC are written off.
+ * Reports goodput, as echoes delivered per second, the share of says lost,
+ * and the client's retransmissions and round-trip estimate, at each loss
+ * rate.  Each run uses a fresh server; the shim's random numbers are seeded
+ * the same for every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+#include "reliable.h"
+
+#define SAYS 20000
+#define IDLE_USEC 20000LL /* best-effort: silence after which says in flight are lost */
+#define RUN_USEC 60000000LL /* a run that has not finished by now is cut short */
+#define CHANNEL "rel-bench"
+
+typedef struct {
+    int front; /* the client sends here */
+    int back; /* connected to the server */
+    struct sockaddr_in client;
+    int known; /* client is set */
+    volatile double loss;
+    volatile int stop;
+    unsigned int seed;
+    unsigned long dropped;
+} Shim;
+
+static long long now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int loopback_socket(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) < 0)
+        return -1;
+    return fd;
+}
+
+static int shim_drops(Shim *s) {
+    if (s->loss > 0.0 && rand_r(&s->seed) < s->loss * ((double)RAND_MAX + 1.0)) {
+        s->dropped++;
+        return 1;
+    }
+    return 0;
+}
+
+static void *shim_main(void *arg) {
+    Shim *s = (Shim *)arg;
+    struct pollfd pfd[2] = { { s->front, POLLIN, 0 }, { s->back, POLLIN, 0 } };
+    struct sockaddr_in from;
+    char buf[65536];
+    socklen_t len;
+    ssize_t n;
+
+    while (!s->stop) {
+        if (poll(pfd, 2, 100) <= 0)
+            continue;
+        len = sizeof(from);
+        while ((n = recvfrom(s->front, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &len)) >= 0) {
+            s->client = from;
+            s->known = 1;
+            if (!shim_drops(s))
+                (void)send(s->back, buf, (size_t)n, 0);
+            len = sizeof(from);
+        }
+        while ((n = recv(s->back, buf, sizeof(buf), MSG_DONTWAIT)) >= 0)
+            if (s->known && !shim_drops(s))
+                (void)sendto(s->front, buf, (size_t)n, 0, (struct sockaddr *)&s->client, sizeof(s->client));
+    }
+    return NULL;
+}
+
+static pid_t start_server(struct sockaddr_in *addr) {
+    int fd = loopback_socket(addr);
+    pid_t pid;
+
+    if (fd < 0 || (pid = fork()) < 0)
+        return -1;
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            _exit(EXIT_FAILURE);
+        socket_fd = fd;
+        reliable_policy.prefix = "rel-";
+        fanout_policy.threads = 0;
+        say_limits.session_rate = say_limits.channel_rate = 0;
+        if (server_init_state() < 0)
+            _exit(EXIT_FAILURE);
+        for (;;)
+            server_poll();
+    }
+    close(fd);
+    return pid;
+}
+
+typedef struct {
+    Reliable *rl;
+    int fd;
+    long next; /* number of the next echo in order */
+    long got; /* echoes delivered */
+    long misordered;
+} Client;
+
+static Client client;
+
+static void client_output(const void *datagram, size_t len, void *arg) {
+    (void)arg;
+    (void)send(client.fd, datagram, len, 0);
+}
+
+static void client_send(const void *payload, size_t len) {
+    if (client.rl != NULL)
+        (void)rl_send(client.rl, payload, len, now_usec(), client_output, NULL);
+    else
+        client_output(payload, len, NULL);
+}
+
+static void client_echo(const void *payload, size_t len, void *arg) {
+    const struct text_say *say = (const struct text_say *)payload;
+    (void)arg;
+    if (len < sizeof(*say) || say->txt_type != TXT_SAY || strncmp(say->txt_channel, CHANNEL, CHANNEL_MAX))
+        return;
+    if (atol(say->txt_text) < client.next)
+        client.misordered++;
+    else
+        client.next = atol(say->txt_text) + 1;
+    client.got++;
+}
+
+// takes in whatever has arrived, waiting up to `wait' usec for it
+static long client_receive(long long wait) {
+    struct pollfd pfd = { client.fd, POLLIN, 0 };
+    char buf[65536];
+    ssize_t n;
+    long got = client.got;
+
+    if (client.rl != NULL) {
+        long long when = rl_deadline(client.rl);
+        if (when >= 0LL && when - now_usec() < wait)
+            wait = (when > now_usec()) ? when - now_usec() : 0LL;
+    }
+    if (poll(&pfd, 1, (int)((wait + 999) / 1000)) > 0) {
+        while ((n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            if (client.rl != NULL)
+                (void)rl_receive(client.rl, buf, (size_t)n, now_usec(), client_echo, NULL);
+            else
+                client_echo(buf, (size_t)n, NULL);
+        }
+    }
+    if (client.rl != NULL)
+        rl_tick(client.rl, now_usec(), client_output, NULL);
+    return client.got - got;
+}
+
+// out: goodput (echoes/s), lost share, retransmissions, srtt us, misordered
+static int run(int reliable, double loss, double *out) {
+    struct sockaddr_in server_addr, front_addr;
+    struct request_login login;
+    struct request_join join;
+    struct request_say say;
+    pthread_t thread;
+    Shim shim;
+    long long start, last, deadline;
+    long sent = 0L, written_off = 0L;
+    pid_t pid;
+
+    if ((pid = start_server(&server_addr)) < 0)
+        return 0;
+    memset(&shim, 0, sizeof(shim));
+    shim.seed = 1U;
+    shim.front = loopback_socket(&front_addr);
+    shim.back = socket(AF_INET, SOCK_DGRAM, 0);
+    if (shim.front < 0 || shim.back < 0 ||
+        connect(shim.back, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        pthread_create(&thread, NULL, shim_main, &shim) != 0)
+        return 0;
+
+    memset(&client, 0, sizeof(client));
+    client.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (connect(client.fd, (struct sockaddr *)&front_addr, sizeof(front_addr)) < 0)
+        return 0;
+    client.rl = reliable ? rl_create(RL_WINDOW) : NULL;
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    strcpy(login.req_username, "bench");
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    strcpy(join.req_channel, CHANNEL);
+    client_send(&login, sizeof(login));
+    client_send(&join, sizeof(join));
+    for (start = now_usec(); now_usec() - start < 100000LL; )
+        (void)client_receive(10000LL);
+
+    shim.loss = loss;
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_channel, CHANNEL);
+    start = last = now_usec();
+    deadline = start + RUN_USEC;
+    while (client.got + written_off < SAYS && now_usec() < deadline) {
+        while (sent < SAYS && sent - client.got - written_off < RL_WINDOW) {
+            snprintf(say.req_text, SAY_MAX, "%ld", sent++);
+            client_send(&say, sizeof(say));
+        }
+        if (client_receive(reliable ? 100000LL : IDLE_USEC) > 0)
+            last = now_usec();
+        else if (!reliable && now_usec() - last >= IDLE_USEC) {
+            written_off = sent - client.got;
+            last = now_usec();
+        }
+    }
+    out[0] = client.got / ((now_usec() - start) / 1e6);
+    out[1] = 1.0 - (double)client.got / SAYS;
+    out[2] = out[3] = 0.0;
+    if (client.rl != NULL) {
+        ReliableStats rs = rl_stats(client.rl);
+        out[2] = (double)rs.retransmitted;
+        out[3] = (double)rs.srttUsec;
+        rl_destroy(client.rl);
+    }
+    out[4] = (double)client.misordered;
+
+    shim.stop = 1;
+    pthread_join(thread, NULL);
+    close(shim.front);
+    close(shim.back);
+    close(client.fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return 1;
+}
+
+int main(void) {
+    static const double loss[] = { 0.0, 0.01, 0.05 };
+    unsigned i;
+    int reliable;
+
+    fprintf(stderr, "%d says echoed by a 1-member channel, loopback through a loss shim\n", SAYS);
+    fprintf(stderr, "loss  mode         echoes/s  lost %%  resent  srtt us  misordered\n");
+    for (i = 0; i < sizeof(loss) / sizeof(loss[0]); i++) {
+        for (reliable = 0; reliable < 2; reliable++) {
+            double out[5];
+            if (!run(reliable, loss[i], out)) {
+                fprintf(stderr, "%3.0f%%  %-11s  failed\n", loss[i] * 100, reliable ? "reliable" : "best-effort");
+                continue;
+            }
+            fprintf(stderr, "%3.0f%%  %-11s  %8.0f  %6.2f  %6.0f  %7.0f  %10.0f\n", loss[i] * 100,
+                    reliable ? "reliable" : "best-effort", out[0], out[1] * 100, out[2], out[3], out[4]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * bench_restore.c
+ *
+ * State snapshot benchmark.  Logs in SESSIONS sessions on loopback addresses
+ * through the real handlers and joins each to one of CHANNELS channels, which
+ * is the herd of requests every client replays after a restart without a
+ * snapshot; then saves the state and restores it into a fresh process.  Reports the herd's
+ * handling time (the server's side only: the clients' round trips and
+ * retries come on top), the save and restore times and the file size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define SESSIONS 1000000
+#define CHANNELS 10000
+#define SNAPSHOT "bench_restore.snap"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f000000 | (1 + (i >> 14)));
+    addr->sin_port = htons(10000 + (i & 0x3fff));
+}
+
+static void init(void) {
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+    fanout_policy.threads = 0;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        exit(EXIT_FAILURE);
+}
+
+// times[0]: herd, times[1]: save
+static void build(double *times) {
+    struct request_login login;
+    struct request_join join;
+    struct sockaddr_in addr;
+    double start;
+    int i;
+
+    init();
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    start = now();
+    for (i = 0; i < SESSIONS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        snprintf(join.req_channel, CHANNEL_MAX, "channel-%d", i % CHANNELS);
+        server_login_request((char *)&login, sizeof(login), &addr);
+        server_join_request((char *)&join, &addr);
+    }
+    times[0] = now() - start;
+    start = now();
+    if (server_save_state(SNAPSHOT) < 0)
+        exit(EXIT_FAILURE);
+    times[1] = now() - start;
+}
+
+// times[0]: restore, times[1]: sessions restored
+static void restore(double *times) {
+    double start;
+
+    init();
+    start = now();
+    times[1] = (double)server_restore_state(SNAPSHOT);
+    times[0] = now() - start;
+}
+
+// runs fn in a child, returns 1 if it reported back
+static int in_child(void (*fn)(double *), double *times) {
+    int fds[2], status, ok;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return 0;
+    if ((pid = fork()) == 0) {
+        fn(times);
+        if (write(fds[1], times, 2 * sizeof(double)) != 2 * sizeof(double))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    ok = read(fds[0], times, 2 * sizeof(double)) == 2 * sizeof(double);
+    close(fds[0]);
+    return waitpid(pid, &status, 0) == pid && ok;
+}
+
+int main(void) {
+    double built[2], restored[2];
+    struct stat st;
+
+    fprintf(stderr, "%d sessions, %d channels\n", SESSIONS, CHANNELS);
+    if (!in_child(build, built) || stat(SNAPSHOT, &st) < 0) {
+        fprintf(stderr, "setting up and saving failed\n");
+        return 1;
+    }
+    fprintf(stderr, "login and join herd: %8.1f ms\n", built[0] * 1e3);
+    fprintf(stderr, "save:                %8.1f ms (%.1f MB)\n", built[1] * 1e3, st.st_size / 1e6);
+    if (!in_child(restore, restored)) {
+        fprintf(stderr, "restoring failed\n");
+        unlink(SNAPSHOT);
+        return 1;
+    }
+    fprintf(stderr, "restore:             %8.1f ms (%.0f of %d sessions)\n",
+            restored[0] * 1e3, restored[1], SESSIONS);
+    unlink(SNAPSHOT);
+    return 0;
+}
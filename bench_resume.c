@@ -0,0 +1,158 @@
+/*
+ * bench_resume.c
+ *
+ * Reconnect-storm benchmark.  Drives the real server handlers with SESSIONS
+ * sessions, each logged in with CAP_RESUME and joined to CHANNELS of
+ * NCHANNELS channels, and then moves every one of them to a new address
+ * twice: once by resuming with the token it was sent, and once the way a
+ * client without tokens has to, by logging in again and joining each of its
+ * channels.  Reports the requests and the handler time per reconnect for
+ * each, and how many resumes were answered with the session's token.
+ *
+ * Session i is at 127.k.(i >> 8).(i & 255) for the k-th address it has,
+ * all on one port, so a single socket bound to that port on every local
+ * address takes in all the replies; ids are handed out in login order,
+ * which ties each token to its session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define SESSIONS 50000
+#define CHANNELS 20 /* channels per session */
+#define NCHANNELS 1000
+#define CHUNK 256 /* sessions between draining the replies */
+
+static struct session_token tokens[SESSIONS];
+static int rx_fd;
+static unsigned short rx_port;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_addr(struct sockaddr_in *addr, int k, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f000000 | (k << 16) | (i & 0xffff));
+    addr->sin_port = rx_port;
+}
+
+// takes in the replies so far; returns the tokens among them
+static long drain(void) {
+    char buf[2048];
+    ssize_t n;
+    long got = 0L;
+
+    while ((n = recv(rx_fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+        const struct text_token *t = (const struct text_token *)buf;
+        if ((size_t)n == sizeof(*t) && t->txt_type == TXT_TOKEN &&
+            t->txt_token.tok_id >= 0 && t->txt_token.tok_id < SESSIONS) {
+            tokens[t->txt_token.tok_id] = t->txt_token;
+            got++;
+        }
+    }
+    return got;
+}
+
+static void join_all(int i, struct sockaddr_in *addr) {
+    struct request_join join;
+    int c;
+
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    for (c = 0; c < CHANNELS; c++) {
+        snprintf(join.req_channel, CHANNEL_MAX, "channel%d", (i * 7 + c * 37) % NCHANNELS);
+        server_join_request((char *)&join, addr);
+    }
+}
+
+static void login(int i, struct sockaddr_in *addr) {
+    struct request_login_caps packet;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.req_type = REQ_LOGIN;
+    snprintf(packet.req_username, USERNAME_MAX, "user%d", i);
+    packet.req_caps = CAP_RESUME;
+    server_login_request((char *)&packet, sizeof(packet), addr);
+}
+
+int main(void) {
+    struct sockaddr_in addr;
+    struct request_resume resume;
+    socklen_t len = sizeof(addr);
+    double start, t_resume = 0.0, t_rejoin = 0.0;
+    long issued = 0L, resumed = 0L;
+    int i, j, size = 8 << 20;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((rx_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(rx_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(rx_fd, (struct sockaddr *)&addr, &len) < 0)
+        return 1;
+    (void)setsockopt(rx_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    rx_port = addr.sin_port;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    fanout_policy.threads = 0;
+    if (server_init_state() < 0)
+        return 1;
+
+    for (i = 0; i < SESSIONS; i += CHUNK) {
+        for (j = i; j < i + CHUNK && j < SESSIONS; j++) {
+            make_addr(&addr, 1, j);
+            login(j, &addr);
+            join_all(j, &addr);
+        }
+        issued += drain();
+    }
+
+    // every session resumes from a second address
+    memset(&resume, 0, sizeof(resume));
+    resume.req_type = REQ_RESUME;
+    for (i = 0; i < SESSIONS; i += CHUNK) {
+        start = now();
+        for (j = i; j < i + CHUNK && j < SESSIONS; j++) {
+            make_addr(&addr, 2, j);
+            resume.req_token = tokens[j];
+            server_resume_request((char *)&resume, &addr);
+        }
+        t_resume += now() - start;
+        resumed += drain();
+    }
+
+    // and then logs in afresh from a third, as a client without a token would
+    for (i = 0; i < SESSIONS; i += CHUNK) {
+        start = now();
+        for (j = i; j < i + CHUNK && j < SESSIONS; j++) {
+            make_addr(&addr, 3, j);
+            login(j, &addr);
+            join_all(j, &addr);
+        }
+        t_rejoin += now() - start;
+        (void)drain();
+    }
+
+    fprintf(stderr, "%d sessions in %d channels each, of %d; %ld tokens issued\n",
+            SESSIONS, CHANNELS, NCHANNELS, issued);
+    fprintf(stderr, "reconnect          requests  us/reconnect\n");
+    fprintf(stderr, "login and joins    %8d  %12.3f\n", 1 + CHANNELS, t_rejoin / SESSIONS * 1e6);
+    fprintf(stderr, "resume             %8d  %12.3f  (%ld of %d answered)\n", 1,
+            t_resume / SESSIONS * 1e6, resumed, SESSIONS);
+    close(rx_fd);
+    return 0;
+}
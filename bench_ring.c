@@ -0,0 +1,156 @@
+/*
+ * bench_ring.c
+ *
+ * Ring microbenchmark.  Producer threads push ITEMS elements of ELEM_BYTES
+ * through a ring of SLOTS to one consumer thread, in batches of each size,
+ * and the consumer reports the elements moved per second and the latency
+ * from push to pop (p50 and p99 over every SAMPLE_EVERY-th element).  Runs
+ * the SPSC ring, the MPSC ring with one and with several producers, and as
+ * a baseline the SPSC ring behind a mutex shared by several producers.  A
+ * side that finds the ring full or empty yields the CPU rather than spin,
+ * so on a machine with fewer cores than threads the figures are scheduling
+ * bound: they mean most with one core per thread.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ring.h"
+
+#define ITEMS 4000000L
+#define ELEM_BYTES 64
+#define SLOTS 4096
+#define SAMPLE_EVERY 64
+#define MAX_BATCH 64
+
+typedef struct {
+    long long stamp; /* push time, nsec */
+    long seq;
+    char payload[ELEM_BYTES - sizeof(long long) - sizeof(long)];
+} Elem;
+
+enum { SPSC, MPSC, LOCKED };
+
+static int kind, producers, batch;
+static Ring *ring;
+static MpscRing *mpsc;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static double lat[ITEMS / SAMPLE_EVERY + 1];
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long push(Elem *e, long n) {
+    long k;
+
+    switch (kind) {
+        case SPSC: return ring_push(ring, e, n);
+        case MPSC: return mpsc_push(mpsc, e, n);
+        default:
+            pthread_mutex_lock(&lock);
+            k = ring_push(ring, e, n);
+            pthread_mutex_unlock(&lock);
+            return k;
+    }
+}
+
+static long pop(Elem *e, long max) {
+    long k;
+
+    switch (kind) {
+        case SPSC: return ring_pop(ring, e, max);
+        case MPSC: return mpsc_pop(mpsc, e, max);
+        default:
+            pthread_mutex_lock(&lock);
+            k = ring_pop(ring, e, max);
+            pthread_mutex_unlock(&lock);
+            return k;
+    }
+}
+
+static void *producer(void *arg) {
+    Elem e[MAX_BATCH];
+    long share = ITEMS / producers, sent = 0L, i, k;
+
+    (void)arg;
+    memset(e, 0, sizeof(e));
+    while (sent < share) {
+        long n = (share - sent < batch) ? share - sent : batch;
+        long long t = now_ns();
+        for (i = 0; i < n; i++) {
+            e[i].stamp = t;
+            e[i].seq = sent + i;
+        }
+        for (i = 0; i < n; i += k)
+            if ((k = push(e + i, n - i)) == 0L)
+                sched_yield();
+        sent += n;
+    }
+    return NULL;
+}
+
+static void run(const char *label, int k, int nprod, int b) {
+    pthread_t threads[8];
+    Elem e[MAX_BATCH];
+    long got = 0L, nlat = 0L, total = ITEMS / nprod * nprod, i, n;
+    long long start, end;
+
+    kind = k;
+    producers = nprod;
+    batch = b;
+    start = now_ns();
+    for (i = 0; i < nprod; i++)
+        pthread_create(&threads[i], NULL, producer, NULL);
+    while (got < total) {
+        if ((n = pop(e, batch)) == 0L) {
+            sched_yield();
+            continue;
+        }
+        long long t = now_ns();
+        for (i = 0; i < n; i++)
+            if ((got + i) % SAMPLE_EVERY == 0)
+                lat[nlat++] = (t - e[i].stamp) / 1e3;
+        got += n;
+    }
+    end = now_ns();
+    for (i = 0; i < nprod; i++)
+        pthread_join(threads[i], NULL);
+
+    qsort(lat, nlat, sizeof(double), cmp_double);
+    fprintf(stderr, "%-8s %9d %5d %12.0f %9.2f %9.2f\n", label, nprod, b,
+            total / ((end - start) / 1e9), lat[nlat / 2], lat[(nlat * 99) / 100]);
+}
+
+int main(void) {
+    static const int batches[] = { 1, 16, 64 };
+    unsigned i;
+
+    ring = ring_create(sizeof(Elem), SLOTS);
+    mpsc = mpsc_create(sizeof(Elem), SLOTS);
+    if (ring == NULL || mpsc == NULL)
+        return 1;
+
+    fprintf(stderr, "%ld elements of %d bytes through %d slots\n", ITEMS, ELEM_BYTES, SLOTS);
+    fprintf(stderr, "ring     producers batch     elems/s   p50(us)   p99(us)\n");
+    for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+        run("spsc", SPSC, 1, batches[i]);
+        run("mpsc", MPSC, 1, batches[i]);
+        run("mpsc", MPSC, 4, batches[i]);
+        run("locked", LOCKED, 4, batches[i]);
+    }
+    ring_destroy(ring);
+    mpsc_destroy(mpsc);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * bench_saylog.c
+ *
+ * Say log benchmark.  First the log on its own: APPENDS appends as fast as
+ * one thread can make them, with the flusher syncing every 1, 10 and 100 ms,
+ * reporting the time per append, its tail, how many records each sync took
+ * and how long the longest sync ran, then a range read of a tenth of them.
+ * Then the server: SAYS says over CHANNELS single-member channels with no
+ * log and with one, each in its own child process from fresh server state,
+ * reporting the time per say in the fastest of ROUNDS rounds and the
+ * distribution of single say times.  Segments are SEGMENT_BYTES, so both
+ * roll over several times; the logs go in a scratch directory here, on the
+ * disk the server would use, and are removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+#include "saylog.h"
+
+#define APPENDS 1000000
+#define CHANNELS 10000
+#define SAYS 1000000
+#define ROUNDS 5 /* the says are timed in rounds, and the fastest counts */
+#define SEGMENT_BYTES (16L << 20)
+
+static long long now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int by_value(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts the samples; out: p50, p99, p99.9 and max, in ns
+static void percentiles(long long *t, long n, long long *out) {
+    qsort(t, n, sizeof(long long), by_value);
+    out[0] = t[n / 2];
+    out[1] = t[n - n / 100];
+    out[2] = t[n - n / 1000];
+    out[3] = t[n - 1];
+}
+
+static void remove_dir(const char *dir) {
+    char path[512];
+    struct dirent *e;
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void count_record(const SayLogRecord *rec, void *arg) {
+    (void)rec;
+    (*(long *)arg)++;
+}
+
+static void bench_log(int sync_ms) {
+    static long long t[APPENDS];
+    char dir[] = "bench_saylog.XXXXXX";
+    long long start, total, p[4], from = 0LL, to = 0LL;
+    struct timespec ts;
+    SayLogStats st;
+    SayLog *log;
+    long i, n = 0L, got;
+
+    if (mkdtemp(dir) == NULL || (log = sl_open(dir, SEGMENT_BYTES, sync_ms)) == NULL) {
+        fprintf(stderr, "%7d  failed\n", sync_ms);
+        return;
+    }
+    start = now_nsec();
+    for (i = 0; i < APPENDS; i++) {
+        long long t0 = now_nsec();
+        if (i == APPENDS * 4 / 10) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            from = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+        }
+        (void)sl_append(log, "Common", "someone", "hello there, this is a fairly ordinary chat message");
+        t[i] = now_nsec() - t0;
+        if (i == APPENDS / 2) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            to = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+        }
+    }
+    total = now_nsec() - start;
+    sl_sync(log);
+    st = sl_stats(log);
+    start = now_nsec();
+    got = sl_read(log, from, to, count_record, &n);
+    percentiles(t, APPENDS, p);
+    fprintf(stderr, "%7d  %9.0f  %5.0f  %6.0f  %7.1f  %8lld  %9.0f  %8.1f  %9.1f  %ld/%ld\n", sync_ms,
+            (double)total / APPENDS, (double)p[1], (double)p[2], p[3] / 1e3,
+            st.syncMaxUsec, (double)st.synced / (st.syncs ? st.syncs : 1), (double)st.segments,
+            (now_nsec() - start) / 1e6, got, n);
+    sl_close(log);
+    remove_dir(dir);
+}
+
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f010000 | (i >> 4));
+    addr->sin_port = htons(9000 + (i & 0xf));
+}
+
+// out[0]: seconds per say, out[1..4]: single say p50, p99, p99.9, max (ns)
+static void run(const char *dir, double *out) {
+    static long long t[SAYS / ROUNDS];
+    struct request_login_caps login;
+    struct request_join join;
+    struct request_say say;
+    struct sockaddr_in addr;
+    long long start, p[4];
+    int i, r;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+    saylog_policy.dir = dir;
+    saylog_policy.segment_bytes = SEGMENT_BYTES;
+    fanout_policy.threads = 0;
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        exit(EXIT_FAILURE);
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    login.req_caps = CAP_BATCH;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    for (i = 0; i < CHANNELS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        snprintf(join.req_channel, CHANNEL_MAX, "channel-%d", i);
+        server_login_request((char *)&login, sizeof(login), &addr);
+        server_join_request((char *)&join, &addr);
+    }
+
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_text, "hello there, this is a fairly ordinary chat message");
+    out[0] = 1.0;
+    for (r = 0; r < ROUNDS; r++) {
+        start = now_nsec();
+        for (i = r * (SAYS / ROUNDS); i < (r + 1) * (SAYS / ROUNDS); i++) {
+            int c = i % CHANNELS;
+            make_addr(&addr, c);
+            snprintf(say.req_channel, CHANNEL_MAX, "channel-%d", c);
+            server_say_request((char *)&say, &addr);
+        }
+        if ((now_nsec() - start) / 1e9 / (SAYS / ROUNDS) < out[0])
+            out[0] = (now_nsec() - start) / 1e9 / (SAYS / ROUNDS);
+    }
+    // the same says once more, each timed on its own
+    for (i = 0; i < SAYS / ROUNDS; i++) {
+        int c = i % CHANNELS;
+        make_addr(&addr, c);
+        snprintf(say.req_channel, CHANNEL_MAX, "channel-%d", c);
+        start = now_nsec();
+        server_say_request((char *)&say, &addr);
+        t[i] = now_nsec() - start;
+    }
+    server_saylog_sync();
+    percentiles(t, SAYS / ROUNDS, p);
+    for (i = 0; i < 4; i++)
+        out[1 + i] = (double)p[i];
+}
+
+int main(void) {
+    static const int sync_ms[] = { 1, 10, 100 };
+    char dir[] = "bench_saylog.XXXXXX";
+    double base = 0.0;
+    unsigned i;
+
+    fprintf(stderr, "%d appends of %zu-byte records, %ld MB segments\n", APPENDS, sizeof(SayLogRecord),
+            SEGMENT_BYTES >> 20);
+    fprintf(stderr, "sync ms  ns/append  p99ns  p99.9ns  max us  sync max us  recs/sync  segments  read ms  read\n");
+    for (i = 0; i < sizeof(sync_ms) / sizeof(sync_ms[0]); i++)
+        bench_log(sync_ms[i]);
+
+    fprintf(stderr, "\n%d channels of 1 member, %d says, log synced every %d ms\n", CHANNELS, SAYS,
+            saylog_policy.sync_ms);
+    fprintf(stderr, "log  ns/say  added  says/s    p50ns  p99ns  p99.9ns  max us\n");
+    for (i = 0; i < 2; i++) {
+        double out[5];
+        int fds[2], status;
+        pid_t pid;
+
+        if (i == 1 && mkdtemp(dir) == NULL)
+            return 1;
+        if (pipe(fds) < 0)
+            return 1;
+        if ((pid = fork()) == 0) {
+            run((i == 1) ? dir : NULL, out);
+            if (write(fds[1], out, sizeof(out)) != sizeof(out))
+                _exit(EXIT_FAILURE);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        if (read(fds[0], out, sizeof(out)) != sizeof(out) || waitpid(pid, &status, 0) < 0) {
+            fprintf(stderr, "%-3s  failed\n", (i == 1) ? "on" : "off");
+            close(fds[0]);
+            continue;
+        }
+        close(fds[0]);
+        if (i == 0)
+            base = out[0];
+        fprintf(stderr, "%-3s  %6.0f  %5.0f  %7.0f  %6.0f  %5.0f  %7.0f  %6.1f\n", (i == 1) ? "on" : "off",
+                out[0] * 1e9, (out[0] - base) * 1e9, 1.0 / out[0], out[1], out[2], out[3], out[4] / 1e3);
+    }
+    remove_dir(dir);
+    return 0;
+}
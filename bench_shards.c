@@ -0,0 +1,162 @@
+/*
+ * bench_shards.c
+ *
+ * Channel sharding benchmark.  Logs in CHANNELS * MEMBERS sessions on
+ * loopback addresses through the real handlers, joins MEMBERS of them to
+ * each of CHANNELS channels, and times SAYS says spread round-robin over the
+ * channels, each from one of the channel's own members, until every shard
+ * has sent them.  Runs with channels on the dispatch thread (0 shards) and
+ * with each shard count, each in its own child process from fresh server
+ * state, and reports the recipients sent to per second and the speed-up
+ * over one shard.  Scaling needs as many cores as shards plus one for the
+ * dispatch thread; the core count is printed alongside.
+ *
+ * Each run then checks that says to a channel that does not exist leave the
+ * sender's bucket alone: a session with a burst of REFUSED_BURST sends that
+ * many of them REFUSED_ROUNDS times over, and then one to its own channel.
+ * The "throttled" column counts the says its bucket turned down, which
+ * should be none with shards as without.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "duckchat.h"
+#include "server.h"
+
+#define CHANNELS 1000
+#define MEMBERS 100
+#define SAYS 10000
+#define REFUSED_BURST 10
+#define REFUSED_ROUNDS 3
+
+typedef struct {
+    double time;
+    unsigned long throttled; /* says of the refused-say check the session's bucket dropped */
+} Result;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// loopback addresses nobody listens on, so each send runs the whole stack
+static void make_addr(struct sockaddr_in *addr, int i) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7f010000 | (i >> 4));
+    addr->sin_port = htons(9000 + (i & 0xf));
+}
+
+// session i is member i / CHANNELS of channel i % CHANNELS
+static Result run(int nshards) {
+    struct request_login login;
+    struct request_join join;
+    struct request_say say;
+    struct sockaddr_in addr;
+    double start;
+    Result r;
+    int i;
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+    shard_policy.shards = nshards;
+    fanout_policy.threads = 0;
+    say_limits.session_rate = say_limits.channel_rate = 0;
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_init_state() < 0)
+        exit(EXIT_FAILURE);
+
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    memset(&join, 0, sizeof(join));
+    join.req_type = REQ_JOIN;
+    for (i = 0; i < CHANNELS * MEMBERS; i++) {
+        make_addr(&addr, i);
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        snprintf(join.req_channel, CHANNEL_MAX, "channel-%d", i % CHANNELS);
+        server_login_request((char *)&login, sizeof(login), &addr);
+        server_join_request((char *)&join, &addr);
+    }
+    server_shards_wait();
+
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    strcpy(say.req_text, "hello");
+    start = now();
+    for (i = 0; i < SAYS; i++) {
+        int c = i % CHANNELS;
+        make_addr(&addr, c + CHANNELS * ((i / CHANNELS) % MEMBERS));
+        snprintf(say.req_channel, CHANNEL_MAX, "channel-%d", c);
+        server_say_request((char *)&say, &addr);
+    }
+    server_shards_wait();
+    r.time = now() - start;
+
+    say_limits.session_rate = 1;
+    say_limits.session_burst = REFUSED_BURST;
+    make_addr(&addr, CHANNELS * MEMBERS);
+    strcpy(login.req_username, "refused");
+    strcpy(join.req_channel, "channel-0");
+    server_login_request((char *)&login, sizeof(login), &addr);
+    server_join_request((char *)&join, &addr);
+    strcpy(say.req_channel, "no-such-channel");
+    for (i = 0; i < REFUSED_BURST * REFUSED_ROUNDS; i++) {
+        server_say_request((char *)&say, &addr);
+        // the shards hand refused says back between rounds
+        if (i % REFUSED_BURST == REFUSED_BURST - 1)
+            server_shards_wait();
+    }
+    strcpy(say.req_channel, "channel-0");
+    server_say_request((char *)&say, &addr);
+    server_shards_wait();
+    r.throttled = server_stats.says_throttled_session;
+    return r;
+}
+
+int main(void) {
+    static const int counts[] = { 0, 1, 2, 4, 8 };
+    double base = 0.0;
+    unsigned i;
+
+    fprintf(stderr, "%d channels of %d members, %d says, %ld cores\n",
+            CHANNELS, MEMBERS, SAYS, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(stderr, "shards  time(s)  recipients/s  speed-up  throttled\n");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        int fds[2], status;
+        Result r;
+        pid_t pid;
+
+        if (pipe(fds) < 0)
+            return 1;
+        if ((pid = fork()) == 0) {
+            r = run(counts[i]);
+            if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+                _exit(EXIT_FAILURE);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        if (read(fds[0], &r, sizeof(r)) != sizeof(r) || waitpid(pid, &status, 0) < 0) {
+            fprintf(stderr, "%6d  failed\n", counts[i]);
+            close(fds[0]);
+            continue;
+        }
+        close(fds[0]);
+        if (counts[i] == 1)
+            base = r.time;
+        fprintf(stderr, "%6d  %7.3f  %12.0f  ", counts[i], r.time, (double)SAYS * MEMBERS / r.time);
+        if (counts[i] > 0 && base > 0.0)
+            fprintf(stderr, "%7.2fx", base / r.time);
+        else
+            fprintf(stderr, "%8s", "-");
+        fprintf(stderr, "  %9lu\n", r.throttled);
+    }
+    return 0;
+}
@@ -21,27 +21,199 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <time.h>
 #include "raw.h"
 #include "duckchat.h"
+#include "wire.h"
+#include "reliable.h"
 
 #define DEFAULT_CHANNEL "Common"
 #define MAX_CHANNELS 10
 #define UNUSED __attribute__((unused))
+#define LOGOUT_WAIT_USEC 1000000 // for the server to acknowledge a reliable logout
 
 struct sockaddr_in server;
 char username[USERNAME_MAX];
 char active_channel[CHANNEL_MAX];
 char subscribed[MAX_CHANNELS][CHANNEL_MAX];
+char list_prefix[CHANNEL_MAX]; // prefix of the /list in progress, if any
 int socket_fd;
+int server_v2 = 0; // set once the server has answered in the v2 encoding
+unsigned char wire_buf[PAGE_BYTES_MAX];
+Reliable *rel = NULL; // with -r, everything goes to the server in envelopes
+const char *rel_prefix = ""; // says in channels starting with this go reliably
+char rel_buff[2 * PAGE_BYTES_MAX]; // a reliable reply, padded as in_buff is
+struct session_token token; // from the server's last TXT_TOKEN
+int have_token = 0;
+int resuming = 0; // a REQ_RESUME is waiting for its answer
+
+long long monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void client_output(const void *datagram, size_t len, void *arg UNUSED)
+{
+    sendto(socket_fd, datagram, len, 0, (struct sockaddr *)&server, sizeof(server));
+}
+
+// Sends a request; with -r reliably, or if `reliable' is 0 as a best-effort
+// envelope that still acknowledges what the server sent
+void client_send(const void *buf, size_t len, int reliable)
+{
+    unsigned char envelope[sizeof(struct rel_header) + PAGE_BYTES_MAX];
+    size_t n;
+
+    if (rel == NULL)
+        client_output(buf, len, NULL);
+    else if (reliable)
+        rl_send(rel, buf, len, monotonic_usec(), client_output, NULL);
+    else if ((n = rl_wrap(rel, buf, len, envelope, sizeof(envelope))) > 0)
+        client_output(envelope, n, NULL);
+}
+
+// Returns 1 if says in the channel go reliably
+int client_say_reliable(const char *channel)
+{
+    return strncmp(channel, rel_prefix, strlen(rel_prefix)) == 0;
+}
+
+// Sends the v2 datagram built in wire_buf
+void client_send_wire(WireWriter *w)
+{
+    client_send(wire_buf, wire_len(w), 1);
+}
+
+void client_deliver_ignore(const void *payload UNUSED, size_t len UNUSED, void *arg UNUSED)
+{
+}
+
+// Gives the server up to LOGOUT_WAIT_USEC to acknowledge what is in flight
+void client_drain(void)
+{
+    long long start = monotonic_usec(), now, when;
+    char buf[2 * PAGE_BYTES_MAX];
+    struct timeval tv;
+    fd_set set;
+    ssize_t n;
+
+    while (rel != NULL && rl_backlog(rel) > 0 && (now = monotonic_usec()) - start < LOGOUT_WAIT_USEC)
+    {
+        when = rl_deadline(rel);
+        when = (when < 0 || when - now > LOGOUT_WAIT_USEC) ? LOGOUT_WAIT_USEC : ((when > now) ? when - now : 0);
+        tv.tv_sec = when / 1000000;
+        tv.tv_usec = when % 1000000;
+        FD_ZERO(&set);
+        FD_SET(socket_fd, &set);
+        if (select(socket_fd + 1, &set, NULL, NULL, &tv) > 0 &&
+            (n = recv(socket_fd, buf, sizeof(buf), 0)) > 0)
+            rl_receive(rel, buf, (size_t)n, monotonic_usec(), client_deliver_ignore, NULL);
+        rl_tick(rel, monotonic_usec(), client_output, NULL);
+    }
+}
 
 void client_logout_request(void)
 {
     struct request_logout logout_packet;
+    WireWriter w;
+
+    if (server_v2)
+    {
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_LOGOUT);
+        client_send_wire(&w);
+        client_drain();
+        exit(EXIT_SUCCESS);
+    }
     logout_packet.req_type = REQ_LOGOUT;
-    sendto(socket_fd, &logout_packet, sizeof(logout_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    client_send(&logout_packet, sizeof(logout_packet), 1);
+    client_drain();
     exit(EXIT_SUCCESS);
 }
 
+// Logs in and joins every subscribed channel
+void client_login(void)
+{
+    struct request_login_caps login_packet;
+    memset(&login_packet, 0, sizeof(login_packet));
+    login_packet.req_type = REQ_LOGIN;
+    strncpy(login_packet.req_username, username, (USERNAME_MAX - 1));
+    login_packet.req_caps = CAP_BATCH | CAP_V2 | CAP_RESUME;
+    client_send(&login_packet, sizeof(login_packet), 1);
+
+    // all of them in one request
+    struct
+    {
+        struct request_channels header;
+        struct channel_info names[MAX_CHANNELS];
+    } join_packet;
+    memset(&join_packet, 0, sizeof(join_packet));
+    join_packet.header.req_type = REQ_JOIN_MANY;
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if (strcmp(subscribed[i], "") != 0)
+            strncpy(join_packet.names[join_packet.header.req_nchannels++].ch_channel, subscribed[i], (CHANNEL_MAX - 1));
+    }
+    client_send(&join_packet, sizeof(join_packet.header) + join_packet.header.req_nchannels * sizeof(struct channel_info), 1);
+}
+
+// Moves to a new socket, as after a change of network, and takes the
+// session along with its token; if the server no longer has the session
+// we log in again instead
+void client_resume_request(void)
+{
+    int fd;
+
+    if (!have_token)
+    {
+        printf("Error: The server has not sent a token to resume with\n");
+        return;
+    }
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        printf("Failed to create a socket.\n");
+        return;
+    }
+    close(socket_fd);
+    socket_fd = fd;
+    resuming = 1;
+
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_RESUME, (unsigned long)token.tok_id,
+                 (unsigned long)token.tok_generation, (unsigned long)token.tok_mac);
+        client_send_wire(&w);
+        return;
+    }
+    struct request_resume resume_packet;
+    resume_packet.req_type = REQ_RESUME;
+    resume_packet.req_token = token;
+    client_send(&resume_packet, sizeof(resume_packet), 1);
+}
+
+// Keeps the token, which also answers a resume
+void client_token_reply(const struct session_token *tok)
+{
+    token = *tok;
+    have_token = 1;
+    if (resuming)
+        printf("Resumed the session\n");
+    resuming = 0;
+}
+
+// A resume the server turned down leaves us logged out
+void client_resume_failed(void)
+{
+    if (!resuming)
+        return;
+    resuming = 0;
+    client_login();
+}
+
 void client_join_request(char *channel_name)
 {
 
@@ -65,10 +237,27 @@ void client_join_request(char *channel_name)
         }
     }
 
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_JOIN, channel_name, (size_t)CHANNEL_MAX);
+        wire_put(&w, WIRE_REQUEST, REQ_HISTORY, channel_name, (size_t)CHANNEL_MAX);
+        client_send_wire(&w);
+        return;
+    }
+
     struct request_join join_packet;
     join_packet.req_type = REQ_JOIN;
     strncpy(join_packet.req_channel, channel_name, (CHANNEL_MAX - 1));
-    sendto(socket_fd, &join_packet, sizeof(join_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    client_send(&join_packet, sizeof(join_packet), 1);
+
+    // then what was said before we came in
+    struct request_history history_packet;
+    memset(&history_packet, 0, sizeof(history_packet));
+    history_packet.req_type = REQ_HISTORY;
+    strncpy(history_packet.req_channel, channel_name, (CHANNEL_MAX - 1));
+    client_send(&history_packet, sizeof(history_packet), 1);
 }
 
 void client_leave_request(char *channel_name)
@@ -86,10 +275,20 @@ void client_leave_request(char *channel_name)
         }
     }
 
-    struct request_leave leave_packet;
-    leave_packet.req_type = REQ_LEAVE;
-    strncpy(leave_packet.req_channel, channel_name, (CHANNEL_MAX - 1));
-    sendto(socket_fd, &leave_packet, sizeof(leave_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_LEAVE, channel_name, (size_t)CHANNEL_MAX);
+        client_send_wire(&w);
+    }
+    else
+    {
+        struct request_leave leave_packet;
+        leave_packet.req_type = REQ_LEAVE;
+        strncpy(leave_packet.req_channel, channel_name, (CHANNEL_MAX - 1));
+        client_send(&leave_packet, sizeof(leave_packet), 1);
+    }
 
     printf("You left channel: %s\n", channel_name);
 }
@@ -100,11 +299,20 @@ void client_say_request(char *request)
     if (strcmp(active_channel, "") == 0)
         return;
 
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_SAY, active_channel, (size_t)CHANNEL_MAX, request, (size_t)(SAY_MAX - 1));
+        client_send(wire_buf, wire_len(&w), client_say_reliable(active_channel));
+        return;
+    }
+
     struct request_say say_packet;
     say_packet.req_type = REQ_SAY;
     strncpy(say_packet.req_channel, active_channel, (CHANNEL_MAX - 1));
     strncpy(say_packet.req_text, request, (SAY_MAX - 1));
-    sendto(socket_fd, &say_packet, sizeof(say_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    client_send(&say_packet, sizeof(say_packet), client_say_reliable(active_channel));
 }
 
 void server_say_reply(const char *packet)
@@ -113,11 +321,50 @@ void server_say_reply(const char *packet)
     printf("[%s][%s]: %s\n", say_packet->txt_channel, say_packet->txt_username, say_packet->txt_text);
 }
 
-void client_list_request(void)
+// Prints every say coalesced into a TXT_BATCH
+void server_batch_reply(const char *packet)
 {
-    struct request_list list_packet;
-    list_packet.req_type = REQ_LIST;
-    sendto(socket_fd, &list_packet, sizeof(list_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    struct text_batch *batch_packet = (struct text_batch *)packet;
+
+    for (int i = 0; i < batch_packet->txt_nrecords && i < (int)BATCH_RECORDS_MAX; i++)
+    {
+        struct say_record *rec = &batch_packet->txt_records[i];
+        printf("[%.*s][%.*s]: %.*s\n", CHANNEL_MAX, rec->rec_channel, USERNAME_MAX, rec->rec_username, SAY_MAX, rec->rec_text);
+    }
+}
+
+// Asks for the page of channels starting at `cursor', filtered by list_prefix
+void client_list_request(int cursor)
+{
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        if (strcmp(list_prefix, "") != 0)
+            wire_put(&w, WIRE_REQUEST, REQ_LIST_PREFIX, (unsigned long)cursor, 0UL, list_prefix, (size_t)CHANNEL_MAX);
+        else
+            wire_put(&w, WIRE_REQUEST, REQ_LIST_PAGE, (unsigned long)cursor, 0UL);
+        client_send_wire(&w);
+        return;
+    }
+
+    if (strcmp(list_prefix, "") != 0)
+    {
+        struct request_list_prefix prefix_packet;
+        memset(&prefix_packet, 0, sizeof(prefix_packet));
+        prefix_packet.req_type = REQ_LIST_PREFIX;
+        prefix_packet.req_cursor = cursor;
+        prefix_packet.req_limit = 0;
+        strncpy(prefix_packet.req_prefix, list_prefix, (CHANNEL_MAX - 1));
+        client_send(&prefix_packet, sizeof(prefix_packet), 1);
+        return;
+    }
+
+    struct request_list_page list_packet;
+    list_packet.req_type = REQ_LIST_PAGE;
+    list_packet.req_cursor = cursor;
+    list_packet.req_limit = 0;
+    client_send(&list_packet, sizeof(list_packet), 1);
 }
 
 void server_list_reply(const char *packet)
@@ -132,13 +379,26 @@ void server_list_reply(const char *packet)
     }
 }
 
-void client_who_request(char *channel_name)
+// Asks for the page of users on `channel_name' starting at `cursor'
+void client_who_request(const char *channel_name, int cursor)
 {
-    struct request_who who_packet;
+    struct request_who_page who_packet;
+
+    if (server_v2)
+    {
+        WireWriter w;
+        wire_writer_init(&w, wire_buf, sizeof(wire_buf));
+        wire_put(&w, WIRE_REQUEST, REQ_WHO_PAGE, (unsigned long)cursor, 0UL, channel_name, (size_t)CHANNEL_MAX);
+        client_send_wire(&w);
+        return;
+    }
 
-    who_packet.req_type = REQ_WHO;
-    strncpy(who_packet.req_channel, ++channel_name, (CHANNEL_MAX - 1));
-    sendto(socket_fd, &who_packet, sizeof(who_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    memset(&who_packet, 0, sizeof(who_packet));
+    who_packet.req_type = REQ_WHO_PAGE;
+    who_packet.req_cursor = cursor;
+    who_packet.req_limit = 0;
+    strncpy(who_packet.req_channel, channel_name, (CHANNEL_MAX - 1));
+    client_send(&who_packet, sizeof(who_packet), 1);
 }
 
 void server_who_reply(char *packet)
@@ -152,6 +412,110 @@ void server_who_reply(char *packet)
     }
 }
 
+// Prints one page of channels and asks for the next one, if any
+void server_list_page_reply(const char *packet)
+{
+    struct text_list_page *page_packet = (struct text_list_page *)packet;
+
+    if (page_packet->txt_cursor == 0)
+        printf("Existing channels:\n");
+    for (int i = 0; i < page_packet->txt_nchannels; i++)
+    {
+        char name[CHANNEL_MAX + 1];
+        memcpy(name, page_packet->txt_channels[i].ch_channel, CHANNEL_MAX);
+        name[CHANNEL_MAX] = '\0';
+        printf("  %s\n", name);
+    }
+    int next = page_packet->txt_cursor + page_packet->txt_nchannels;
+    if (page_packet->txt_nchannels > 0 && next < page_packet->txt_total)
+        client_list_request(next);
+}
+
+// Prints one page of users and asks for the next one, if any
+void server_who_page_reply(const char *packet)
+{
+    struct text_who_page *page_packet = (struct text_who_page *)packet;
+    char channel[CHANNEL_MAX + 1];
+
+    memcpy(channel, page_packet->txt_channel, CHANNEL_MAX);
+    channel[CHANNEL_MAX] = '\0';
+    if (page_packet->txt_cursor == 0)
+        printf("Users on channel %s:\n", channel);
+    for (int i = 0; i < page_packet->txt_nusernames; i++)
+    {
+        char name[USERNAME_MAX + 1];
+        memcpy(name, page_packet->txt_users[i].us_username, USERNAME_MAX);
+        name[USERNAME_MAX] = '\0';
+        printf("  %s\n", name);
+    }
+    int next = page_packet->txt_cursor + page_packet->txt_nusernames;
+    if (page_packet->txt_nusernames > 0 && next < page_packet->txt_total)
+        client_who_request(channel, next);
+}
+
+// Handles every message of a v2 datagram, asking for the next page of a
+// list reply as the v1 page handlers do
+void server_v2_reply(const char *packet, size_t len)
+{
+    WireReader r;
+    WireMsg m;
+    WireStr item;
+
+    wire_reader_init(&r, packet, len);
+    while (wire_next(&r, WIRE_TEXT, &m) == 1)
+    {
+        if (!m.known)
+            continue;
+        switch (m.type)
+        {
+        case TXT_SAY:
+            printf("[%.*s][%.*s]: %.*s\n", (int)m.str[0].len, m.str[0].ptr, (int)m.str[1].len, m.str[1].ptr, (int)m.str[2].len, m.str[2].ptr);
+            break;
+        case TXT_ERROR:
+            printf("Error: %.*s\n", (int)m.str[0].len, m.str[0].ptr);
+            client_resume_failed();
+            break;
+        case TXT_TOKEN:
+        {
+            struct session_token tok;
+            tok.tok_id = (int)m.num[0];
+            tok.tok_generation = (unsigned int)m.num[1];
+            tok.tok_mac = m.num[2];
+            client_token_reply(&tok);
+            break;
+        }
+        case TXT_LIST:
+        case TXT_LIST_PAGE:
+        case TXT_WHO:
+        case TXT_WHO_PAGE:
+        {
+            int who = (m.type == TXT_WHO || m.type == TXT_WHO_PAGE);
+            char channel[CHANNEL_MAX];
+            unsigned long next = m.num[1] + m.num[2];
+
+            if (who)
+                wire_str_copy(channel, sizeof(channel), &m.str[0]);
+            if (m.num[1] == 0 && who)
+                printf("Users on channel %s:\n", channel);
+            else if (m.num[1] == 0)
+                printf("Existing channels:\n");
+            while (wire_next_item(&m, &item) == 1)
+                printf("  %.*s\n", (int)item.len, item.ptr);
+            if (m.num[2] > 0 && next < m.num[0])
+            {
+                if (who)
+                    client_who_request(channel, (int)next);
+                else
+                    client_list_request((int)next);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
 void client_switch_request(char *channel_name)
 {
     ++channel_name;
@@ -171,15 +535,79 @@ void server_error_reply(char *packet)
 {
     struct text_error *error_packet = (struct text_error *)packet;
     printf("Error: %s\n", error_packet->txt_error);
+    client_resume_failed();
+}
+
+// Handles a datagram (or reliable payload) from the server
+void server_reply(char *packet, size_t len)
+{
+    struct text *packet_type = (struct text *)packet;
+
+    // the login announced CAP_V2; a server that honours it
+    // answers in v2, and from then on so do we
+    if (wire_is_v2(packet, len))
+    {
+        server_v2 = 1;
+        server_v2_reply(packet, len);
+        return;
+    }
+    switch (packet_type->txt_type)
+    {
+    case TXT_SAY:
+        server_say_reply(packet);
+        break;
+    case TXT_LIST:
+        server_list_reply(packet);
+        break;
+    case TXT_WHO:
+        server_who_reply(packet);
+        break;
+    case TXT_LIST_PAGE:
+        server_list_page_reply(packet);
+        break;
+    case TXT_WHO_PAGE:
+        server_who_page_reply(packet);
+        break;
+    case TXT_BATCH:
+        server_batch_reply(packet);
+        break;
+    case TXT_ERROR:
+        server_error_reply(packet);
+        break;
+    case TXT_TOKEN:
+        client_token_reply(&((struct text_token *)packet)->txt_token);
+        break;
+    default:
+        break;
+    }
+}
+
+void server_reliable_reply(const void *payload, size_t len, void *arg UNUSED)
+{
+    if (len > sizeof(rel_buff))
+        return;
+    memset(rel_buff, 0, sizeof(rel_buff));
+    memcpy(rel_buff, payload, len);
+    server_reply(rel_buff, len);
 }
 
 // Driver code
 int main(int argc, char *argv[])
 {
 
+    // -r turns on reliable delivery, with says reliable in the channels
+    // whose names start with its argument ("" for all)
+    if (argc == 6 && strcmp(argv[1], "-r") == 0)
+    {
+        if ((rel = rl_create(256)) == NULL)
+            exit(EXIT_FAILURE);
+        rel_prefix = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
     if (argc != 4)
     {
-        printf("Usage: ./client server_socket server_port username\n");
+        printf("Usage: ./client [-r reliable_channel_prefix] server_socket server_port username\n");
         exit(EXIT_FAILURE);
     }
 
@@ -209,24 +637,17 @@ int main(int argc, char *argv[])
     for (int i = 1; i < MAX_CHANNELS; i++)
         strcpy(subscribed[i], "");
 
-    struct request_login login_packet;
-    login_packet.req_type = REQ_LOGIN;
-    strncpy(login_packet.req_username, username, (USERNAME_MAX - 1));
-    sendto(socket_fd, &login_packet, sizeof(login_packet), 0, (struct sockaddr *)&server, sizeof(server));
-
-    struct request_join join_packet;
-    join_packet.req_type = REQ_JOIN;
-    strncpy(join_packet.req_channel, DEFAULT_CHANNEL, (CHANNEL_MAX - 1));
-    sendto(socket_fd, &join_packet, sizeof(join_packet), 0, (struct sockaddr *)&server, sizeof(server));
+    client_login();
 
     printf("> ");
     fflush(stdout);
 
     fd_set receiver;
     char ch;
-    int i, j;
-    char buffer[1024], in_buff[100024];
-    struct text *packet_type;
+    int i = 0, j;
+    char buffer[1024], in_buff[2 * PAGE_BYTES_MAX];
+    ssize_t nread;
+    long long when;
 
     while (1)
     {
@@ -235,7 +656,22 @@ int main(int argc, char *argv[])
         FD_SET(socket_fd, &receiver);
         FD_SET(STDIN_FILENO, &receiver);
 
-        if (select((socket_fd + 1), &receiver, NULL, NULL, &tv) < 0)
+        // wake up for the reliable channel's next retransmission or acknowledgement
+        if (rel != NULL && (when = rl_deadline(rel)) >= 0)
+        {
+            when = (when > monotonic_usec()) ? when - monotonic_usec() : 0;
+            tv.tv_sec = when / 1000000;
+            tv.tv_usec = when % 1000000;
+        }
+
+        int ready = select((socket_fd + 1), &receiver, NULL, NULL, &tv);
+        if (rel != NULL)
+        {
+            rl_tick(rel, monotonic_usec(), client_output, NULL);
+            tv.tv_sec = 300;
+            tv.tv_usec = 100000;
+        }
+        if (ready < 0)
         {
             printf("Select failed\n");
         }
@@ -247,29 +683,18 @@ int main(int argc, char *argv[])
             {
 
                 memset(in_buff, 0, sizeof(in_buff));
-                if (recvfrom(socket_fd, in_buff, sizeof(in_buff), 0, &from_addr, &len) < 0)
+                if ((nread = recvfrom(socket_fd, in_buff, sizeof(in_buff), 0, &from_addr, &len)) < 0)
                     continue;
-                packet_type = (struct text *)in_buff;
 
                 putchar('\r');
 
-                switch (packet_type->txt_type)
+                if (rel != NULL && rl_is_envelope(in_buff, (size_t)nread))
                 {
-                case TXT_SAY:
-                    server_say_reply(in_buff);
-                    break;
-                case TXT_LIST:
-                    server_list_reply(in_buff);
-                    break;
-                case TXT_WHO:
-                    server_who_reply(in_buff);
-                    break;
-                case TXT_ERROR:
-                    server_error_reply(in_buff);
-                    break;
-                default:
-                    break;
+                    rl_receive(rel, in_buff, (size_t)nread, monotonic_usec(), server_reliable_reply, NULL);
+                    rl_tick(rel, monotonic_usec(), client_output, NULL);
                 }
+                else
+                    server_reply(in_buff, (size_t)nread);
 
                 printf("> ");
                 fflush(stdout);
@@ -300,7 +725,7 @@ int main(int argc, char *argv[])
                 // buffer[i] = '\0';
                 // i = 0;
                 // putchar('\n');
-                fgets(buffer, BUFSIZ, stdin);
+                fgets(buffer, sizeof(buffer), stdin);
                 buffer[strcspn(buffer, "\n")] = 0;
 
                 if (buffer[0] == '/')
@@ -319,16 +744,24 @@ int main(int argc, char *argv[])
                     }
                     else if (strncmp(buffer, "/list", 5) == 0)
                     {
-                        client_list_request();
+                        // "/list team-" lists only channels starting with "team-"
+                        memset(list_prefix, 0, sizeof(list_prefix));
+                        if (buffer[5] == ' ')
+                            strncpy(list_prefix, buffer + 6, (CHANNEL_MAX - 1));
+                        client_list_request(0);
                     }
                     else if (strncmp(buffer, "/who ", 5) == 0)
                     {
-                        client_who_request(strchr(buffer, ' '));
+                        client_who_request(strchr(buffer, ' ') + 1, 0);
                     }
                     else if (strncmp(buffer, "/switch ", 8) == 0)
                     {
                         client_switch_request(strchr(buffer, ' '));
                     }
+                    else if (strncmp(buffer, "/reconnect", 10) == 0)
+                    {
+                        client_resume_request();
+                    }
                     else
                     {
                         fprintf(stdout, "Unknown command\n");
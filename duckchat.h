@@ -25,11 +25,30 @@ typedef int text_t;
 #define REQ_LIST 5
 #define REQ_WHO 6
 #define REQ_KEEP_ALIVE 7 /* Only needed by graduate students */
+#define REQ_LIST_PAGE 8
+#define REQ_WHO_PAGE 9
+#define REQ_LIST_PREFIX 10
+#define REQ_HISTORY 11
+#define REQ_RESUME 12
+#define REQ_JOIN_MANY 13
+#define REQ_LEAVE_MANY 14
 /* Define codes for text types.  These are the messages sent to the client. */
 #define TXT_SAY 0
 #define TXT_LIST 1
 #define TXT_WHO 2
 #define TXT_ERROR 3
+#define TXT_LIST_PAGE 4
+#define TXT_WHO_PAGE 5
+#define TXT_BATCH 6
+#define TXT_TOKEN 7
+/* Capability bits a client may announce in struct request_login_caps. */
+#define CAP_BATCH 0x1 /* Client understands TXT_BATCH */
+#define CAP_V2 0x2 /* Client understands the compact encoding of wire.h */
+#define CAP_RESUME 0x4 /* Client wants a TXT_TOKEN to resume its session with */
+/* Paged and batched replies are kept to this many bytes of UDP payload, so
+ * that with IP and UDP headers they fit an unfragmented datagram on a
+ * 1280-byte path MTU (the IPv6 minimum, and below every common IPv4 link). */
+#define PAGE_BYTES_MAX 1200
 /* This structure is used for a generic request type, to the server. */
 struct request {
         request_t req_type;
@@ -41,6 +60,14 @@ struct request_login {
         request_t req_type; /* = REQ_LOGIN */
         char req_username[USERNAME_MAX];
 } packed;
+/* A login that also announces the client's capabilities.  Servers tell it
+ * apart from a plain request_login by its length, so clients that send the
+ * plain form keep getting plain replies. */
+struct request_login_caps {
+        request_t req_type; /* = REQ_LOGIN */
+        char req_username[USERNAME_MAX];
+        int req_caps; /* CAP_ bits */
+} packed;
 struct request_logout {
         request_t req_type; /* = REQ_LOGOUT */
 } packed;
@@ -64,6 +91,85 @@ struct request_who {
         request_t req_type; /* = REQ_WHO */
         char req_channel[CHANNEL_MAX]; 
 } packed;
+/* Paged variants of LIST and WHO.  The reply holds at most req_limit
+ * entries starting at req_cursor (0 or more than fits a page means as many
+ * as fit in PAGE_BYTES_MAX); the client asks for the next page at
+ * txt_cursor + the number of entries received, until txt_total is reached. */
+struct request_list_page {
+        request_t req_type; /* = REQ_LIST_PAGE */
+        int req_cursor;
+        int req_limit;
+} packed;
+struct request_who_page {
+        request_t req_type; /* = REQ_WHO_PAGE */
+        int req_cursor;
+        int req_limit;
+        char req_channel[CHANNEL_MAX];
+} packed;
+/* Paged LIST of only the channels whose names start with req_prefix; it is
+ * answered with TXT_LIST_PAGE replies, whose txt_total and txt_cursor then
+ * count matching channels only.  Channels come back in name order. */
+struct request_list_prefix {
+        request_t req_type; /* = REQ_LIST_PREFIX */
+        int req_cursor;
+        int req_limit;
+        char req_prefix[CHANNEL_MAX];
+} packed;
+
+/* Asks for the channel's recent says, oldest first.  They come back as
+ * TXT_BATCH datagrams to a client that announced CAP_BATCH, as v2 TXT_SAY
+ * messages several to a datagram to a CAP_V2 client, and as one TXT_SAY
+ * each otherwise.  A client typically sends it right after REQ_JOIN. */
+struct request_history {
+        request_t req_type; /* = REQ_HISTORY */
+        char req_channel[CHANNEL_MAX];
+} packed;
+
+/* Reliable delivery, optional.  A datagram that starts with REL_MAGIC is
+ * an envelope: struct rel_header followed, with REL_DATA set, by a v1 or v2
+ * datagram.  With REL_SEQ also set the payload is reliable: it is numbered
+ * rel_seq in the sender's sequence, retransmitted until acknowledged and
+ * delivered in sequence order; without it the payload is best-effort and
+ * the envelope only carries acknowledgements along.  Every envelope
+ * acknowledges the peer's sequence of epoch rel_peer: rel_ack is the next
+ * number not yet received, and bit i of rel_sack says rel_ack + 1 + i was.
+ * rel_base is the oldest number the sender still retransmits; the receiver
+ * need not wait for anything before it.  An endpoint picks a random, nonzero
+ * rel_epoch when it starts, so a peer that sees it change knows to start
+ * its receive sequence over.  A session is reliable once the server has had
+ * an envelope from it; see reliable.h. */
+#define REL_MAGIC 0xD3
+#define REL_DATA 0x1
+#define REL_SEQ 0x2
+struct rel_header {
+        unsigned char rel_magic; /* = REL_MAGIC */
+        unsigned char rel_flags; /* REL_ bits */
+        unsigned int rel_epoch; /* Sender's */
+        unsigned int rel_seq; /* With REL_SEQ */
+        unsigned int rel_base;
+        unsigned int rel_peer; /* Epoch acknowledged, 0 if none yet */
+        unsigned int rel_ack;
+        unsigned int rel_sack;
+} packed;
+
+/* Session resumption.  A client that announces CAP_RESUME at login is sent
+ * a TXT_TOKEN naming its session.  Presenting the token in a REQ_RESUME,
+ * from whatever address the client now has, moves the session there with
+ * its channels intact, and is answered with the same TXT_TOKEN; a client
+ * whose address changed, or that restarted, thus needs one request instead
+ * of a login and a join per channel.  A token is good until the session is
+ * logged out or expires; after that REQ_RESUME is answered with a
+ * TXT_ERROR and the client logs in again.  Tokens are opaque to clients. */
+struct session_token {
+        int tok_id;
+        unsigned int tok_generation;
+        unsigned long long tok_mac;
+} packed;
+struct request_resume {
+        request_t req_type; /* = REQ_RESUME */
+        struct session_token req_token;
+} packed;
+
 struct request_keep_alive {
         request_t req_type; /* = REQ_KEEP_ALIVE */
 } packed;
@@ -80,10 +186,35 @@ struct text_say {
         char txt_username[USERNAME_MAX];
         char txt_text[SAY_MAX];
 } packed;
-/* This is a substructure used by struct text_list. */
+/* One say inside a TXT_BATCH; the fields are those of struct text_say. */
+struct say_record {
+        char rec_channel[CHANNEL_MAX];
+        char rec_username[USERNAME_MAX];
+        char rec_text[SAY_MAX];
+} packed;
+/* Several says for the same recipient coalesced into one datagram, sent
+ * only to clients that announced CAP_BATCH at login. */
+struct text_batch {
+        text_t txt_type; /* = TXT_BATCH */
+        int txt_nrecords;
+        struct say_record txt_records[0];
+} packed;
+#define BATCH_RECORDS_MAX ((PAGE_BYTES_MAX - sizeof(struct text_batch)) / sizeof(struct say_record))
+/* This is a substructure used by struct text_list and struct
+ * request_channels. */
 struct channel_info {
         char ch_channel[CHANNEL_MAX];
 } packed;
+/* Joins or leaves every channel named, as that many REQ_JOIN or REQ_LEAVE
+ * requests would, in one datagram that the server handles as one batch.  A
+ * request names at most CHANNELS_MANY_MAX channels, and no more than fit in
+ * PAGE_BYTES_MAX; a v1 request is req_nchannels entries long. */
+#define CHANNELS_MANY_MAX 64
+struct request_channels {
+        request_t req_type; /* = REQ_JOIN_MANY or REQ_LEAVE_MANY */
+        int req_nchannels;
+        struct channel_info req_channels[0];
+} packed;
 struct text_list {
         text_t txt_type; /* = TXT_LIST */
         int txt_nchannels;
@@ -99,6 +230,27 @@ struct text_who {
         char txt_channel[CHANNEL_MAX]; // The channel requested
         struct user_info txt_users[0]; // May actually be more than 0
 } packed;
+struct text_list_page {
+        text_t txt_type; /* = TXT_LIST_PAGE */
+        int txt_total; /* Channels on the server */
+        int txt_cursor; /* Index of txt_channels[0] */
+        int txt_nchannels; /* Entries in this page */
+        struct channel_info txt_channels[0];
+} packed;
+struct text_who_page {
+        text_t txt_type; /* = TXT_WHO_PAGE */
+        int txt_total; /* Users on the channel */
+        int txt_cursor; /* Index of txt_users[0] */
+        int txt_nusernames; /* Entries in this page */
+        char txt_channel[CHANNEL_MAX];
+        struct user_info txt_users[0];
+} packed;
+#define LIST_PAGE_MAX ((PAGE_BYTES_MAX - sizeof(struct text_list_page)) / sizeof(struct channel_info))
+#define WHO_PAGE_MAX ((PAGE_BYTES_MAX - sizeof(struct text_who_page)) / sizeof(struct user_info))
+struct text_token {
+        text_t txt_type; /* = TXT_TOKEN */
+        struct session_token txt_token;
+} packed;
 struct text_error {
         text_t txt_type; /* = TXT_ERROR */
         char txt_error[SAY_MAX]; // Error message
@@ -0,0 +1,234 @@
+/*
+ * egress.c
+ *
+ * implementation of the send queue: a ring of datagram copies, threaded by
+ * destination so the oldest datagram of a destination is found in O(1);
+ * dropped datagrams stay in the ring as dead entries until flushed past
+ */
+
+#include "egress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#define NIL 0xFFFF
+
+typedef struct {
+    int dest;			/* -1: no session; -2: dropped */
+    unsigned short next;	/* next entry of the same destination, or NIL */
+    struct sockaddr_in addr;
+    size_t len;
+    char *data;
+} Entry;
+
+typedef struct {
+    unsigned short head;	/* oldest queued entry, valid if count > 0 */
+    unsigned short tail;
+    unsigned short count;
+} Chain;
+
+struct egress {
+    int fd;
+    int perDest;
+    long slots;
+    long head;			/* oldest entry of the ring */
+    long count;			/* entries in the ring, dead ones included */
+    long live;			/* entries still to be sent */
+    Entry *ring;
+    Chain *chains;
+    int nchains;
+    EgressStats stats;
+};
+
+Egress *eg_create(int fd, long slots, int perDest) {
+    Egress *eg = (Egress *)malloc(sizeof(Egress));
+
+    if (eg != NULL) {
+        if (slots > NIL)
+            slots = NIL;
+        eg->ring = (Entry *)malloc(slots * sizeof(Entry));
+        if (eg->ring == NULL) {
+            free(eg);
+            return NULL;
+        }
+        eg->fd = fd;
+        eg->perDest = perDest;
+        eg->slots = slots;
+        eg->head = eg->count = eg->live = 0L;
+        eg->chains = NULL;
+        eg->nchains = 0;
+        memset(&eg->stats, 0, sizeof(eg->stats));
+    }
+    return eg;
+}
+
+void eg_destroy(Egress *eg) {
+    long i;
+
+    for (i = 0L; i < eg->count; i++)
+        free(eg->ring[(eg->head + i) % eg->slots].data);
+    free(eg->ring);
+    free(eg->chains);
+    free(eg);
+}
+
+int eg_reserve(Egress *eg, int n) {
+    Chain *tmp;
+
+    if (n <= eg->nchains)
+        return 1;
+    if ((tmp = (Chain *)realloc(eg->chains, n * sizeof(Chain))) == NULL)
+        return 0;
+    memset(&tmp[eg->nchains], 0, (n - eg->nchains) * sizeof(Chain));
+    eg->chains = tmp;
+    eg->nchains = n;
+    return 1;
+}
+
+/*
+ * local function that kills the oldest entry of `dest'
+ */
+static void dropOldest(Egress *eg, int dest) {
+    Chain *c = &eg->chains[dest];
+    Entry *e = &eg->ring[c->head];
+
+    c->head = e->next;
+    c->count--;
+    e->dest = -2;
+    free(e->data);
+    e->data = NULL;
+    eg->live--;
+}
+
+/*
+ * local function that takes the entry at the head of the ring off it and
+ * off its chain
+ */
+static void popHead(Egress *eg) {
+    Entry *e = &eg->ring[eg->head];
+
+    if (e->dest >= 0) {
+        Chain *c = &eg->chains[e->dest];
+        c->head = e->next;
+        c->count--;
+    }
+    if (e->dest != -2)
+        eg->live--;
+    free(e->data);
+    e->data = NULL;
+    eg->head = (eg->head + 1) % eg->slots;
+    eg->count--;
+}
+
+/*
+ * local function that appends a copy of the datagram to the ring
+ */
+static int enqueue(Egress *eg, int dest, const struct sockaddr_in *addr,
+                   const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    unsigned short at;
+    char *data;
+    Entry *e;
+    int i;
+
+    if (dest >= 0 && dest < eg->nchains && eg->chains[dest].count >= eg->perDest) {
+        dropOldest(eg, dest);
+        eg->stats.droppedBehind++;
+    }
+    while (eg->count == eg->slots) {
+        if (eg->ring[eg->head].dest != -2)
+            eg->stats.droppedFull++;
+        popHead(eg);
+    }
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if ((data = (char *)malloc(len > 0 ? len : 1)) == NULL)
+        return 0;
+    for (len = 0, i = 0; i < iovcnt; i++) {
+        memcpy(data + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    at = (unsigned short)((eg->head + eg->count) % eg->slots);
+    e = &eg->ring[at];
+    e->dest = (dest >= 0 && dest < eg->nchains) ? dest : -1;
+    e->next = NIL;
+    e->addr = *addr;
+    e->len = len;
+    e->data = data;
+    if (e->dest >= 0) {
+        Chain *c = &eg->chains[dest];
+        if (c->count == 0)
+            c->head = at;
+        else
+            eg->ring[c->tail].next = at;
+        c->tail = at;
+        c->count++;
+    }
+    eg->count++;
+    eg->live++;
+    eg->stats.queued++;
+    return 1;
+}
+
+int eg_sendv(Egress *eg, int dest, const struct sockaddr_in *addr,
+             const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+
+    if (eg->live == 0L) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *)addr;
+        msg.msg_namelen = sizeof(*addr);
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        if (sendmsg(eg->fd, &msg, MSG_DONTWAIT) >= 0)
+            return 1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            eg->stats.failed++;
+            return -1;
+        }
+    }
+    return enqueue(eg, dest, addr, iov, iovcnt) ? 0 : -1;
+}
+
+int eg_send(Egress *eg, int dest, const struct sockaddr_in *addr,
+            const void *buf, size_t len) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return eg_sendv(eg, dest, addr, &iov, 1);
+}
+
+long eg_flush(Egress *eg) {
+    while (eg->count > 0L) {
+        Entry *e = &eg->ring[eg->head];
+        if (e->dest != -2 &&
+            sendto(eg->fd, e->data, e->len, MSG_DONTWAIT,
+                   (struct sockaddr *)&e->addr, sizeof(e->addr)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                break;
+            eg->stats.failed++;
+        }
+        popHead(eg);
+    }
+    return eg->live;
+}
+
+long eg_pending(Egress *eg) {
+    return eg->live;
+}
+
+void eg_forget(Egress *eg, int dest) {
+    if (dest < 0 || dest >= eg->nchains)
+        return;
+    while (eg->chains[dest].count > 0) {
+        dropOldest(eg, dest);
+        eg->stats.droppedForgotten++;
+    }
+}
+
+const EgressStats *eg_stats(Egress *eg) {
+    return &eg->stats;
+}
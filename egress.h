@@ -0,0 +1,94 @@
+#ifndef _EGRESS_H_
+#define _EGRESS_H_
+
+/*
+ * interface definition for a non-blocking UDP send queue with a bound per
+ * destination
+ *
+ * datagrams are sent straight away while the socket takes them; once a
+ * send would block (EAGAIN), that datagram and every later one is copied
+ * into a bounded FIFO, in order, and sent by eg_flush() when the socket is
+ * writable again
+ *
+ * each datagram is charged to a destination (a session id, or -1 for an
+ * address with no session); a destination with `perDest' datagrams queued
+ * loses its oldest one for every new one, so a receiver that falls behind
+ * only costs itself messages, and a full queue drops its oldest datagram
+ *
+ * the per-destination chains cost 6 bytes a destination
+ */
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+typedef struct egress Egress;		/* opaque type definition */
+
+typedef struct {
+    unsigned long queued;		/* datagrams that had to wait */
+    unsigned long droppedBehind;	/* oldest of a destination over its bound */
+    unsigned long droppedFull;		/* oldest of a full queue */
+    unsigned long droppedForgotten;	/* still queued when eg_forget() was called */
+    unsigned long failed;		/* send errors other than EAGAIN */
+} EgressStats;
+
+/*
+ * creates a queue sending on the non-blocking socket `fd', holding up to
+ * `slots' (at most 65535) datagrams and up to `perDest' per destination
+ *
+ * returns a pointer to the queue, or NULL if there are malloc() errors
+ */
+Egress *eg_create(int fd, long slots, int perDest);
+
+/*
+ * destroys the queue, dropping whatever it holds
+ */
+void eg_destroy(Egress *eg);
+
+/*
+ * makes room for destinations 0 .. n-1
+ *
+ * returns 1 if successful, 0 if not (malloc failure)
+ */
+int eg_reserve(Egress *eg, int n);
+
+/*
+ * sends the concatenation of `iov[0..iovcnt-1]' to `addr' on behalf of
+ * destination `dest', or queues a copy if the socket would block or
+ * datagrams are already waiting
+ *
+ * returns 1 if the datagram was sent, 0 if it was queued, -1 if it was lost
+ * (send error, or no memory for the copy)
+ */
+int eg_sendv(Egress *eg, int dest, const struct sockaddr_in *addr,
+             const struct iovec *iov, int iovcnt);
+
+/*
+ * eg_sendv() of a single buffer
+ */
+int eg_send(Egress *eg, int dest, const struct sockaddr_in *addr,
+            const void *buf, size_t len);
+
+/*
+ * sends queued datagrams in order until the socket would block
+ *
+ * returns the number still queued
+ */
+long eg_flush(Egress *eg);
+
+/*
+ * returns the number of datagrams queued
+ */
+long eg_pending(Egress *eg);
+
+/*
+ * drops every datagram queued for `dest', whose id is about to be reused
+ */
+void eg_forget(Egress *eg, int dest);
+
+/*
+ * returns the queue's counters
+ */
+const EgressStats *eg_stats(Egress *eg);
+
+#endif /* _EGRESS_H_ */
@@ -0,0 +1,109 @@
+/*
+ * epoch.c
+ *
+ * implementation of the reclamation domain: the classic three-epoch scheme
+ *
+ * a pin is counted in pins[e % 3] for the epoch e it saw; the writer moves
+ * the epoch from e to e + 1 only when no pin of e - 1 is left.  Pins older
+ * than e - 1 were gone when the epoch last moved, and a reader can only pin
+ * the current epoch, so at that point nothing pinned at or before e - 1
+ * remains, and the objects retired during e - 1 can be destroyed; their list
+ * is the one epoch e + 2 will retire into, so it is emptied just in time
+ */
+
+#include "epoch.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+
+struct epoch_domain {
+    atomic_ulong epoch;
+    atomic_long pins[3];
+    EpochNode *limbo[3];	/* retired during epoch i (mod 3); writer only */
+    unsigned long retired;
+    unsigned long reclaimed;
+};
+
+EpochDomain *ep_create(void) {
+    EpochDomain *ep = (EpochDomain *)malloc(sizeof(EpochDomain));
+    int i;
+
+    if (ep != NULL) {
+        atomic_init(&ep->epoch, 0UL);
+        for (i = 0; i < 3; i++) {
+            atomic_init(&ep->pins[i], 0L);
+            ep->limbo[i] = NULL;
+        }
+        ep->retired = ep->reclaimed = 0UL;
+    }
+    return ep;
+}
+
+/*
+ * local function that destroys a limbo list; returns the number destroyed
+ */
+static long purge(EpochNode **list) {
+    EpochNode *node = *list, *next;
+    long n = 0L;
+
+    for (; node != NULL; node = next, n++) {
+        next = node->next;
+        node->destroy(node);
+    }
+    *list = NULL;
+    return n;
+}
+
+void ep_destroy(EpochDomain *ep) {
+    int i;
+
+    for (i = 0; i < 3; i++)
+        (void)purge(&ep->limbo[i]);
+    free(ep);
+}
+
+unsigned long ep_pin(EpochDomain *ep) {
+    unsigned long e;
+
+    /* the pin only counts if the epoch has not moved on meanwhile */
+    for (;;) {
+        e = atomic_load(&ep->epoch);
+        atomic_fetch_add(&ep->pins[e % 3], 1L);
+        if (atomic_load(&ep->epoch) == e)
+            return e;
+        atomic_fetch_sub(&ep->pins[e % 3], 1L);
+    }
+}
+
+void ep_unpin(EpochDomain *ep, unsigned long epoch) {
+    atomic_fetch_sub_explicit(&ep->pins[epoch % 3], 1L, memory_order_release);
+}
+
+void ep_retire(EpochDomain *ep, EpochNode *node, void (*destroy)(EpochNode *node)) {
+    unsigned long e = atomic_load_explicit(&ep->epoch, memory_order_relaxed);
+
+    node->destroy = destroy;
+    node->next = ep->limbo[e % 3];
+    ep->limbo[e % 3] = node;
+    ep->retired++;
+}
+
+long ep_reclaim(EpochDomain *ep) {
+    unsigned long e = atomic_load_explicit(&ep->epoch, memory_order_relaxed);
+    long n;
+
+    if (atomic_load(&ep->pins[(e + 2) % 3]) != 0L)
+        return 0L;
+    n = purge(&ep->limbo[(e + 2) % 3]);
+    ep->reclaimed += (unsigned long)n;
+    atomic_store(&ep->epoch, e + 1);
+    return n;
+}
+
+EpochStats ep_stats(EpochDomain *ep) {
+    EpochStats s;
+
+    s.epoch = atomic_load(&ep->epoch);
+    s.retired = ep->retired;
+    s.reclaimed = ep->reclaimed;
+    return s;
+}
@@ -0,0 +1,75 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+/*
+ * interface definition for epoch-based reclamation of objects that one
+ * writer thread replaces while other threads may still be reading them
+ *
+ * a reader pins the current epoch before it picks up a pointer to a shared
+ * object and unpins it when it is done with the object; the writer unpublishes
+ * an object and then retires it, and the object is destroyed by a later
+ * ep_reclaim() once no pin old enough to have seen it is left.  Pins are
+ * counted per epoch, not per object, so pinning costs the same whatever is
+ * read under it.  Only the writer thread may retire and reclaim; any thread
+ * may pin and unpin.
+ *
+ * objects embed an EpochNode, whose `destroy' ep_retire() sets
+ */
+
+typedef struct epoch_domain EpochDomain;	/* opaque type definition */
+
+typedef struct epoch_node {
+    struct epoch_node *next;
+    void (*destroy)(struct epoch_node *node);
+} EpochNode;
+
+typedef struct {
+    unsigned long epoch;	/* the current epoch */
+    unsigned long retired;	/* objects retired */
+    unsigned long reclaimed;	/* objects destroyed */
+} EpochStats;
+
+/*
+ * creates a reclamation domain
+ *
+ * returns a pointer to the domain, or NULL if there are malloc() errors
+ */
+EpochDomain *ep_create(void);
+
+/*
+ * destroys every object still retired, then the domain; no pin may be held
+ */
+void ep_destroy(EpochDomain *ep);
+
+/*
+ * pins the current epoch; objects retired from now on outlive the pin
+ *
+ * returns the epoch pinned, to be given back to ep_unpin()
+ */
+unsigned long ep_pin(EpochDomain *ep);
+
+/*
+ * releases a pin taken by ep_pin()
+ */
+void ep_unpin(EpochDomain *ep, unsigned long epoch);
+
+/*
+ * hands an object that is no longer reachable by new readers to the domain;
+ * `destroy' is called on it once every reader that could hold it is done
+ */
+void ep_retire(EpochDomain *ep, EpochNode *node, void (*destroy)(EpochNode *node));
+
+/*
+ * advances the epoch if no reader is left in the one before, destroying what
+ * was retired two epochs ago
+ *
+ * returns the number of objects destroyed
+ */
+long ep_reclaim(EpochDomain *ep);
+
+/*
+ * returns the domain's counters
+ */
+EpochStats ep_stats(EpochDomain *ep);
+
+#endif /* _EPOCH_H_ */
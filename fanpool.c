@@ -0,0 +1,276 @@
+/*
+ * fanpool.c
+ *
+ * implementation of the fan-out pool: one FIFO of chunks per worker,
+ * guarded by a mutex and condition variable; a job is reference counted
+ * by its outstanding chunks
+ */
+
+#define _GNU_SOURCE
+#include "fanpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define SEND_BATCH 256		/* datagrams per sendmmsg() */
+#define DRAIN_WAIT_MS 50	/* longest wait for a full socket to drain */
+
+struct fanjob {
+    atomic_long chunks;		/* outstanding chunks */
+    long n;
+    const struct sockaddr_in *addrs;
+    const unsigned char *which;
+    void (*release)(void *arg);	/* done with the recipients, or NULL */
+    void *arg;
+    struct iovec iov[2];
+};
+
+typedef struct chunk {
+    struct chunk *next;
+    FanJob *job;
+    long start;
+    long end;
+} Chunk;
+
+typedef struct {
+    FanPool *fp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Chunk *head;
+    Chunk *tail;
+} Worker;
+
+struct fanpool {
+    int fd;
+    int nthreads;
+    long chunk;
+    int stopping;
+    Worker *workers;
+    pthread_mutex_t lock;	/* guards pending, signals idle */
+    pthread_cond_t idle;
+    long pending;		/* chunks queued or being sent */
+    atomic_ulong jobs;
+    atomic_ulong sent;
+    atomic_ulong dropped;
+    atomic_ulong failed;
+};
+
+/*
+ * local function that frees a job whose last chunk is done, or gives its
+ * borrowed recipients back
+ */
+static void finishJob(FanJob *job) {
+    if (job->release != NULL)
+        job->release(job->arg);
+    free(job);
+}
+
+/*
+ * local function that sends one chunk, waiting out a full socket
+ */
+static void sendChunk(FanPool *fp, Chunk *c) {
+    struct mmsghdr msgs[SEND_BATCH];
+    FanJob *job = c->job;
+    long i = c->start;
+
+    while (i < c->end) {
+        int n = 0, sent = 0;
+        for (; i < c->end && n < SEND_BATCH; i++, n++) {
+            memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+            msgs[n].msg_hdr.msg_name = (void *)&job->addrs[i];
+            msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[n].msg_hdr.msg_iov = &job->iov[job->which[i]];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        while (sent < n) {
+            int r = sendmmsg(fp->fd, &msgs[sent], n - sent, MSG_DONTWAIT);
+            if (r > 0) {
+                sent += r;
+                atomic_fetch_add(&fp->sent, (unsigned long)r);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                struct pollfd pfd;
+                pfd.fd = fp->fd;
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, DRAIN_WAIT_MS) <= 0) {
+                    atomic_fetch_add(&fp->dropped, (unsigned long)(n - sent + (c->end - i)));
+                    return;
+                }
+            } else {
+                sent++;		/* skip the datagram that failed */
+                atomic_fetch_add(&fp->failed, 1UL);
+            }
+        }
+    }
+}
+
+static void *workerMain(void *arg) {
+    Worker *w = (Worker *)arg;
+    FanPool *fp = w->fp;
+    Chunk *c;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL && !fp->stopping)
+            pthread_cond_wait(&w->ready, &w->lock);
+        if ((c = w->head) == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        if ((w->head = c->next) == NULL)
+            w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        sendChunk(fp, c);
+        if (atomic_fetch_sub(&c->job->chunks, 1L) == 1L)
+            finishJob(c->job);
+        free(c);
+
+        pthread_mutex_lock(&fp->lock);
+        if (--fp->pending == 0L)
+            pthread_cond_broadcast(&fp->idle);
+        pthread_mutex_unlock(&fp->lock);
+    }
+    return NULL;
+}
+
+FanPool *fp_create(int fd, int nthreads, long chunk) {
+    FanPool *fp = (FanPool *)malloc(sizeof(FanPool));
+    int i;
+
+    if (fp == NULL)
+        return NULL;
+    if ((fp->workers = (Worker *)calloc(nthreads, sizeof(Worker))) == NULL) {
+        free(fp);
+        return NULL;
+    }
+    fp->fd = fd;
+    fp->nthreads = nthreads;
+    fp->chunk = (chunk > 0L) ? chunk : 4096L;
+    fp->stopping = 0;
+    fp->pending = 0L;
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->idle, NULL);
+    atomic_init(&fp->jobs, 0UL);
+    atomic_init(&fp->sent, 0UL);
+    atomic_init(&fp->dropped, 0UL);
+    atomic_init(&fp->failed, 0UL);
+    for (i = 0; i < nthreads; i++) {
+        Worker *w = &fp->workers[i];
+        w->fp = fp;
+        w->head = w->tail = NULL;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->ready, NULL);
+        if (pthread_create(&w->thread, NULL, workerMain, w) != 0) {
+            fp->nthreads = i;
+            fp_destroy(fp);
+            return NULL;
+        }
+    }
+    return fp;
+}
+
+void fp_destroy(FanPool *fp) {
+    int i;
+
+    fp_wait(fp);
+    for (i = 0; i < fp->nthreads; i++) {
+        pthread_mutex_lock(&fp->workers[i].lock);
+        fp->stopping = 1;
+        pthread_cond_signal(&fp->workers[i].ready);
+        pthread_mutex_unlock(&fp->workers[i].lock);
+    }
+    for (i = 0; i < fp->nthreads; i++)
+        pthread_join(fp->workers[i].thread, NULL);
+    free(fp->workers);
+    free(fp);
+}
+
+FanJob *fp_job_shared(const void *msg0, size_t len0, const void *msg1, size_t len1,
+                      const struct sockaddr_in *addrs, const unsigned char *which,
+                      long n, void (*release)(void *arg), void *arg) {
+    FanJob *job;
+
+    if (msg1 == NULL)
+        len1 = 0;
+    /* the job and its messages are one allocation */
+    if ((job = (FanJob *)malloc(sizeof(FanJob) + len0 + len1)) == NULL)
+        return NULL;
+    job->iov[0].iov_base = (char *)(job + 1);
+    job->iov[0].iov_len = len0;
+    job->iov[1].iov_base = (char *)(job + 1) + len0;
+    job->iov[1].iov_len = len1;
+    memcpy(job->iov[0].iov_base, msg0, len0);
+    if (len1 > 0)
+        memcpy(job->iov[1].iov_base, msg1, len1);
+    job->n = n;
+    job->addrs = addrs;
+    job->which = which;
+    job->release = release;
+    job->arg = arg;
+    return job;
+}
+
+void fp_submit(FanPool *fp, FanJob *job, long n) {
+    long nchunks = (n + fp->chunk - 1) / fp->chunk, k;
+
+    atomic_fetch_add(&fp->jobs, 1UL);
+    if (nchunks == 0L) {
+        finishJob(job);
+        return;
+    }
+    atomic_init(&job->chunks, nchunks);
+    pthread_mutex_lock(&fp->lock);
+    fp->pending += nchunks;
+    pthread_mutex_unlock(&fp->lock);
+
+    for (k = 0L; k < nchunks; k++) {
+        Worker *w = &fp->workers[k % fp->nthreads];
+        Chunk *c = (Chunk *)malloc(sizeof(Chunk));
+        if (c == NULL) {
+            /* account the chunk as dropped, as a full socket would */
+            long end = (k + 1) * fp->chunk < n ? (k + 1) * fp->chunk : n;
+            atomic_fetch_add(&fp->dropped, (unsigned long)(end - k * fp->chunk));
+            if (atomic_fetch_sub(&job->chunks, 1L) == 1L)
+                finishJob(job);
+            pthread_mutex_lock(&fp->lock);
+            if (--fp->pending == 0L)
+                pthread_cond_broadcast(&fp->idle);
+            pthread_mutex_unlock(&fp->lock);
+            continue;
+        }
+        c->next = NULL;
+        c->job = job;
+        c->start = k * fp->chunk;
+        c->end = (c->start + fp->chunk < n) ? c->start + fp->chunk : n;
+        pthread_mutex_lock(&w->lock);
+        if (w->tail == NULL)
+            w->head = c;
+        else
+            w->tail->next = c;
+        w->tail = c;
+        pthread_cond_signal(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+void fp_wait(FanPool *fp) {
+    pthread_mutex_lock(&fp->lock);
+    while (fp->pending > 0L)
+        pthread_cond_wait(&fp->idle, &fp->lock);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+FanPoolStats fp_stats(FanPool *fp) {
+    FanPoolStats s;
+
+    s.jobs = atomic_load(&fp->jobs);
+    s.sent = atomic_load(&fp->sent);
+    s.dropped = atomic_load(&fp->dropped);
+    s.failed = atomic_load(&fp->failed);
+    return s;
+}
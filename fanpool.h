@@ -0,0 +1,76 @@
+#ifndef _FANPOOL_H_
+#define _FANPOOL_H_
+
+/*
+ * interface definition for a pool of threads that send one message to a
+ * large set of addresses
+ *
+ * a job carries up to two encodings of the message and, per recipient, an
+ * address and the encoding it takes, in arrays the caller keeps until the
+ * pool releases them; fp_submit() hands a job over and returns at once;
+ * the recipients are split into chunks of `chunk' and chunk k of every job
+ * goes to worker k % nthreads, so a recipient that stays at the same
+ * position of successive jobs gets them in order
+ *
+ * workers send on the shared (non-blocking) socket with sendmmsg(); when
+ * it would block a worker waits for it to drain, up to a bound, and then
+ * drops the rest of its chunk
+ */
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+typedef struct fanpool FanPool;		/* opaque type definitions */
+typedef struct fanjob FanJob;
+
+typedef struct {
+    unsigned long jobs;			/* jobs submitted */
+    unsigned long sent;			/* datagrams sent by workers */
+    unsigned long dropped;		/* given up on a full socket */
+    unsigned long failed;		/* send errors other than EAGAIN */
+} FanPoolStats;
+
+/*
+ * creates a pool of `nthreads' workers sending on socket `fd'
+ *
+ * returns a pointer to the pool, or NULL if there are malloc() or thread
+ * creation errors
+ */
+FanPool *fp_create(int fd, int nthreads, long chunk);
+
+/*
+ * waits for submitted jobs to finish, stops the workers and frees the pool
+ */
+void fp_destroy(FanPool *fp);
+
+/*
+ * allocates a job for the `n' recipients of arrays the caller keeps, of the
+ * message whose encodings are `msg0' and `msg1' (copied); `msg1' may be NULL
+ * if every recipient takes `msg0'.  The pool calls `release(arg)' once it is
+ * done with the arrays, from whichever thread sent the last chunk, or from
+ * fp_submit() if there is nothing to send
+ *
+ * returns the job, or NULL if there are malloc() errors, in which case
+ * `release' is not called
+ */
+FanJob *fp_job_shared(const void *msg0, size_t len0, const void *msg1, size_t len1,
+                      const struct sockaddr_in *addrs, const unsigned char *which,
+                      long n, void (*release)(void *arg), void *arg);
+
+/*
+ * hands the first `n' recipients of the job to the workers; the job is
+ * freed by the pool once sent
+ */
+void fp_submit(FanPool *fp, FanJob *job, long n);
+
+/*
+ * waits until every submitted job has been sent
+ */
+void fp_wait(FanPool *fp);
+
+/*
+ * returns the pool's counters
+ */
+FanPoolStats fp_stats(FanPool *fp);
+
+#endif /* _FANPOOL_H_ */
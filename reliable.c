@@ -0,0 +1,429 @@
+/*
+ * reliable.c
+ *
+ * implementation of a reliable channel end
+ *
+ * the send window is a ring of RL_WINDOW slots indexed by sequence number;
+ * base is the oldest payload still owed an acknowledgement and limit the
+ * first one not in the window, and payloads past the window wait in a FIFO
+ * that is only non-empty while the window is full.  Held payloads use a
+ * ring of the same size indexed the same way, so the selective
+ * acknowledgement bits are read straight off it
+ */
+
+#define _GNU_SOURCE
+#include "reliable.h"
+#include "duckchat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#define RTO_INIT_USEC 200000LL
+#define RTO_MIN_USEC 10000LL
+#define RTO_MAX_USEC 2000000LL
+#define ACK_DELAY_USEC 2000LL
+#define REORDER_THRESHOLD 3	/* later payloads acknowledged before one is resent */
+#define REORDER_SHARE 8		/* or ones sent this share of a round trip after it */
+#define HEADER_BYTES sizeof(struct rel_header)
+
+typedef struct message {
+    struct message *next;		/* in the queue */
+    size_t len;
+    unsigned char buf[];		/* header room and payload, or a held payload */
+} Message;
+
+typedef struct {
+    Message *msg;			/* NULL once acknowledged or given up on */
+    int tries;
+    int sacked;
+    int timed;				/* sent once and not sampled yet */
+    long long sentAt;			/* first transmission */
+    long long lastSent;
+    long long due;
+} Slot;
+
+struct reliable {
+    unsigned int epoch;
+    unsigned int base;
+    unsigned int limit;
+    unsigned int next;			/* next number to give out */
+    Slot slots[RL_WINDOW];
+    Message *queue;
+    Message *queueTail;
+    long queueMax;
+    int sampled;			/* srtt holds an estimate */
+    long long srtt;
+    long long rttvar;
+    long long rto;
+    unsigned int peer;			/* the peer's epoch, 0 before it is heard */
+    unsigned int expected;		/* next number to deliver */
+    Message *held[RL_WINDOW];
+    unsigned int heldSeq[RL_WINDOW];
+    long long ackDue;			/* 0 if no acknowledgement is owed */
+    ReliableStats stats;
+};
+
+// sequence numbers wrap, so they are compared by their distance
+static int before(unsigned int a, unsigned int b) {
+    return (int)(a - b) < 0;
+}
+
+int rl_is_envelope(const void *buf, size_t len) {
+    return len >= HEADER_BYTES && *(const unsigned char *)buf == REL_MAGIC;
+}
+
+Reliable *rl_create(long queueMax) {
+    Reliable *rl = (Reliable *)calloc(1, sizeof(Reliable));
+
+    if (rl != NULL) {
+        if (getrandom(&rl->epoch, sizeof(rl->epoch), GRND_NONBLOCK) != sizeof(rl->epoch))
+            rl->epoch = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ (unsigned int)(size_t)rl;
+        if (rl->epoch == 0U)
+            rl->epoch = 1U;
+        rl->base = rl->limit = rl->next = 1U;
+        rl->queueMax = queueMax;
+        rl->rto = RTO_INIT_USEC;
+    }
+    return rl;
+}
+
+void rl_destroy(Reliable *rl) {
+    Message *m, *next;
+    int i;
+
+    for (i = 0; i < RL_WINDOW; i++) {
+        free(rl->slots[i].msg);
+        free(rl->held[i]);
+    }
+    for (m = rl->queue; m != NULL; m = next) {
+        next = m->next;
+        free(m);
+    }
+    free(rl);
+}
+
+static unsigned int sackBits(Reliable *rl) {
+    unsigned int bits = 0U, seq;
+    int i;
+
+    for (i = 0; i < RL_WINDOW - 1; i++) {
+        seq = rl->expected + 1U + (unsigned int)i;
+        if (rl->held[seq % RL_WINDOW] != NULL && rl->heldSeq[seq % RL_WINDOW] == seq)
+            bits |= 1U << i;
+    }
+    return bits;
+}
+
+// local function that writes an envelope header, which acknowledges everything received
+static void stamp(Reliable *rl, unsigned char *buf, int flags, unsigned int seq) {
+    struct rel_header h;
+
+    h.rel_magic = REL_MAGIC;
+    h.rel_flags = (unsigned char)flags;
+    h.rel_epoch = rl->epoch;
+    h.rel_seq = seq;
+    h.rel_base = rl->base;
+    h.rel_peer = rl->peer;
+    h.rel_ack = rl->expected;
+    h.rel_sack = sackBits(rl);
+    memcpy(buf, &h, HEADER_BYTES);
+    rl->ackDue = 0LL;
+}
+
+static void transmit(Reliable *rl, unsigned int seq, long long now, RlOutput out, void *arg) {
+    Slot *s = &rl->slots[seq % RL_WINDOW];
+    long long timeout = rl->rto;
+    int i;
+
+    stamp(rl, s->msg->buf, REL_DATA | REL_SEQ, seq);
+    s->lastSent = now;
+    if (s->tries == 0) {
+        s->sentAt = now;
+        s->timed = 1;
+        rl->stats.sent++;
+    } else {
+        // Karn: a round trip of a resent payload could belong to either send
+        s->timed = 0;
+        rl->stats.retransmitted++;
+    }
+    for (i = 0; i < s->tries && timeout < RTO_MAX_USEC; i++)
+        timeout *= 2;
+    s->tries++;
+    s->due = now + ((timeout < RTO_MAX_USEC) ? timeout : RTO_MAX_USEC);
+    out(s->msg->buf, s->msg->len, arg);
+}
+
+// local function that folds a round trip into the estimates, as RFC 6298 does
+static void sample(Reliable *rl, long long r) {
+    if (!rl->sampled) {
+        rl->srtt = r;
+        rl->rttvar = r / 2;
+        rl->sampled = 1;
+    } else {
+        rl->rttvar = (3 * rl->rttvar + llabs(rl->srtt - r)) / 4;
+        rl->srtt = (7 * rl->srtt + r) / 8;
+    }
+    rl->rto = rl->srtt + ((4 * rl->rttvar > 1000LL) ? 4 * rl->rttvar : 1000LL);
+    if (rl->rto < RTO_MIN_USEC)
+        rl->rto = RTO_MIN_USEC;
+    if (rl->rto > RTO_MAX_USEC)
+        rl->rto = RTO_MAX_USEC;
+}
+
+// local function that moves base past finished slots and fills the window from the queue
+static void advance(Reliable *rl, long long now) {
+    while (rl->base != rl->limit && rl->slots[rl->base % RL_WINDOW].msg == NULL)
+        rl->base++;
+    while (rl->queue != NULL && rl->limit - rl->base < RL_WINDOW) {
+        Slot *s = &rl->slots[rl->limit % RL_WINDOW];
+        s->msg = rl->queue;
+        if ((rl->queue = rl->queue->next) == NULL)
+            rl->queueTail = NULL;
+        s->tries = s->sacked = s->timed = 0;
+        s->due = now;
+        rl->limit++;
+    }
+}
+
+// local function that samples the round trip and returns when the payload was last sent
+static long long acknowledged(Reliable *rl, Slot *s, long long now) {
+    if (s->timed) {
+        sample(rl, now - s->sentAt);
+        s->timed = 0;
+    }
+    return s->lastSent;
+}
+
+static void takeAcks(Reliable *rl, unsigned int ack, unsigned int sack, long long now) {
+    long long newest = -1LL, t;
+    unsigned int seq;
+    int i, later = 0;
+
+    // an acknowledgement of something never sent is stale or bogus
+    if (before(ack, rl->base) || before(rl->limit, ack))
+        return;
+    for (seq = rl->base; seq != ack; seq++) {
+        Slot *s = &rl->slots[seq % RL_WINDOW];
+        if (s->msg != NULL) {
+            if ((t = acknowledged(rl, s, now)) > newest)
+                newest = t;
+            free(s->msg);
+            s->msg = NULL;
+        }
+    }
+    for (i = 0; i < RL_WINDOW - 1; i++) {
+        Slot *s = &rl->slots[(ack + 1U + (unsigned int)i) % RL_WINDOW];
+        seq = ack + 1U + (unsigned int)i;
+        if ((sack & (1U << i)) && before(seq, rl->limit) && s->msg != NULL && !s->sacked) {
+            s->sacked = 1;
+            if ((t = acknowledged(rl, s, now)) > newest)
+                newest = t;
+        }
+    }
+    // a payload is taken to be lost once enough that were sent after its
+    // first transmission, or any sent well after its last, have arrived
+    for (seq = rl->limit; newest >= 0LL && seq != ack; ) {
+        Slot *s = &rl->slots[--seq % RL_WINDOW];
+        if (s->msg == NULL)
+            continue;
+        if (s->sacked)
+            later++;
+        else if (s->due > now && ((s->tries == 1 && later >= REORDER_THRESHOLD) ||
+                                  newest - s->lastSent > rl->srtt / REORDER_SHARE))
+            s->due = now;
+    }
+    advance(rl, now);
+}
+
+int rl_send(Reliable *rl, const void *payload, size_t len, long long now, RlOutput out, void *arg) {
+    Message *m;
+
+    if ((long)(rl->next - rl->base) >= RL_WINDOW + rl->queueMax ||
+        (m = (Message *)malloc(sizeof(Message) + HEADER_BYTES + len)) == NULL) {
+        rl->stats.refused++;
+        return 0;
+    }
+    m->next = NULL;
+    m->len = HEADER_BYTES + len;
+    memcpy(m->buf + HEADER_BYTES, payload, len);
+    rl->next++;
+    if (rl->queueTail != NULL)
+        rl->queueTail->next = m;
+    else
+        rl->queue = m;
+    rl->queueTail = m;
+    // the queue only holds anything while the window is full
+    if (rl->limit - rl->base < RL_WINDOW) {
+        advance(rl, now);
+        transmit(rl, rl->limit - 1U, now, out, arg);
+    }
+    return 1;
+}
+
+size_t rl_wrap(Reliable *rl, const void *payload, size_t len, void *buf, size_t cap) {
+    if (HEADER_BYTES + len > cap)
+        return 0;
+    stamp(rl, (unsigned char *)buf, REL_DATA, 0U);
+    memcpy((unsigned char *)buf + HEADER_BYTES, payload, len);
+    return HEADER_BYTES + len;
+}
+
+static void owe(Reliable *rl, long long when) {
+    if (rl->ackDue == 0LL || when < rl->ackDue)
+        rl->ackDue = when;
+}
+
+// local function that delivers held payloads for as long as they are next in line
+static void deliverHeld(Reliable *rl, long long now, RlDeliver deliver, void *arg) {
+    Message *m;
+
+    while ((m = rl->held[rl->expected % RL_WINDOW]) != NULL && rl->heldSeq[rl->expected % RL_WINDOW] == rl->expected) {
+        rl->held[rl->expected % RL_WINDOW] = NULL;
+        rl->expected++;
+        rl->stats.delivered++;
+        owe(rl, now + ACK_DELAY_USEC);
+        deliver(m->buf, m->len, arg);
+        free(m);
+    }
+}
+
+static void dropHeld(Reliable *rl) {
+    int i;
+
+    for (i = 0; i < RL_WINDOW; i++) {
+        free(rl->held[i]);
+        rl->held[i] = NULL;
+    }
+}
+
+int rl_receive(Reliable *rl, const void *datagram, size_t len, long long now,
+               RlDeliver deliver, void *arg) {
+    const unsigned char *payload = (const unsigned char *)datagram + HEADER_BYTES;
+    size_t n = len - HEADER_BYTES;
+    struct rel_header h;
+    int d, i;
+
+    if (!rl_is_envelope(datagram, len))
+        return 0;
+    memcpy(&h, datagram, HEADER_BYTES);
+    if (h.rel_epoch == 0U)
+        return 0;
+    // a new peer, or the same one started over
+    if (h.rel_epoch != rl->peer) {
+        dropHeld(rl);
+        rl->peer = h.rel_epoch;
+        rl->expected = h.rel_base;
+    }
+    if (h.rel_peer == rl->epoch)
+        takeAcks(rl, h.rel_ack, h.rel_sack, now);
+    // the peer resends nothing before its base: take what is held of it
+    for (i = 0; i < RL_WINDOW && before(rl->expected, h.rel_base); i++) {
+        rl->expected++;
+        deliverHeld(rl, now, deliver, arg);
+    }
+    if (before(rl->expected, h.rel_base)) {
+        dropHeld(rl);
+        rl->expected = h.rel_base;
+    }
+    deliverHeld(rl, now, deliver, arg);
+
+    if (!(h.rel_flags & REL_DATA))
+        return 1;
+    if (!(h.rel_flags & REL_SEQ)) {
+        deliver(payload, n, arg);
+        return 1;
+    }
+    d = (int)(h.rel_seq - rl->expected);
+    if (d < 0) {
+        // our acknowledgement went missing: send it again now
+        rl->stats.duplicates++;
+        owe(rl, now);
+        return 1;
+    }
+    if (d >= RL_WINDOW)
+        return 1;
+    if (d > 0) {
+        Message *m;
+        if (rl->held[h.rel_seq % RL_WINDOW] != NULL && rl->heldSeq[h.rel_seq % RL_WINDOW] == h.rel_seq) {
+            rl->stats.duplicates++;
+        } else if ((m = (Message *)malloc(sizeof(Message) + n)) != NULL) {
+            free(rl->held[h.rel_seq % RL_WINDOW]);
+            m->next = NULL;
+            m->len = n;
+            memcpy(m->buf, payload, n);
+            rl->held[h.rel_seq % RL_WINDOW] = m;
+            rl->heldSeq[h.rel_seq % RL_WINDOW] = h.rel_seq;
+        }
+        // tell the sender about the gap at once
+        owe(rl, now);
+        return 1;
+    }
+    rl->expected++;
+    rl->stats.delivered++;
+    owe(rl, now + ACK_DELAY_USEC);
+    deliver(payload, n, arg);
+    deliverHeld(rl, now, deliver, arg);
+    return 1;
+}
+
+long long rl_deadline(Reliable *rl) {
+    long long when = (rl->ackDue != 0LL) ? rl->ackDue : -1LL;
+    unsigned int seq;
+
+    for (seq = rl->base; seq != rl->limit; seq++) {
+        Slot *s = &rl->slots[seq % RL_WINDOW];
+        if (s->msg != NULL && !s->sacked && (when < 0LL || s->due < when))
+            when = s->due;
+    }
+    return when;
+}
+
+static void sendAck(Reliable *rl, RlOutput out, void *arg) {
+    unsigned char buf[HEADER_BYTES];
+
+    stamp(rl, buf, 0, 0U);
+    rl->stats.acks++;
+    out(buf, sizeof(buf), arg);
+}
+
+void rl_tick(Reliable *rl, long long now, RlOutput out, void *arg) {
+    unsigned int seq, from = rl->limit;
+
+    for (seq = rl->base; seq != rl->limit; seq++) {
+        Slot *s = &rl->slots[seq % RL_WINDOW];
+        if (s->msg == NULL || s->sacked || s->due > now)
+            continue;
+        if (s->tries >= RL_TRIES) {
+            free(s->msg);
+            s->msg = NULL;
+            rl->stats.abandoned++;
+            continue;
+        }
+        transmit(rl, seq, now, out, arg);
+    }
+    // giving up may have made room for queued payloads
+    advance(rl, now);
+    for (seq = from; seq != rl->limit; seq++)
+        transmit(rl, seq, now, out, arg);
+    if (rl->ackDue != 0LL && rl->ackDue <= now)
+        sendAck(rl, out, arg);
+}
+
+void rl_ack_now(Reliable *rl, RlOutput out, void *arg) {
+    if (rl->ackDue != 0LL)
+        sendAck(rl, out, arg);
+}
+
+long rl_backlog(Reliable *rl) {
+    return (long)(rl->next - rl->base);
+}
+
+ReliableStats rl_stats(Reliable *rl) {
+    ReliableStats s = rl->stats;
+
+    s.srttUsec = rl->sampled ? rl->srtt : 0LL;
+    s.rtoUsec = rl->rto;
+    return s;
+}
@@ -0,0 +1,126 @@
+#ifndef _RELIABLE_H_
+#define _RELIABLE_H_
+
+/*
+ * interface definition for one end of a reliable, ordered channel of
+ * datagrams to one peer, in the envelopes of duckchat.h
+ *
+ * reliable payloads are numbered as they are sent; up to RL_WINDOW of them
+ * are in flight at once and the rest wait in order.  Each is retransmitted
+ * when its timer runs out, the timer being the RFC 6298 estimate from the
+ * round trips of payloads that were only sent once, doubled on every
+ * retransmission; a payload that three later ones have overtaken, by the
+ * peer's selective acknowledgements, is retransmitted without waiting for
+ * it.  One that is still unacknowledged after RL_TRIES transmissions is
+ * given up on, and the peer is told not to wait for it.
+ *
+ * received payloads are delivered in sequence order: one that arrives early
+ * is held, duplicates are dropped, and best-effort payloads are delivered
+ * as they come.  Acknowledgements ride on whatever this end sends next; if
+ * it sends nothing for a couple of milliseconds, or a payload arrived out
+ * of order or twice, an envelope with only the acknowledgement goes out.
+ *
+ * the channel does no I/O of its own: the caller passes each datagram
+ * received from the peer to rl_receive(), and gives rl_send(), rl_tick()
+ * and rl_ack_now() an `out' function that sends one to the peer; timers
+ * are the caller's to keep, by calling rl_tick() by rl_deadline().  Times
+ * are monotonic microseconds.
+ */
+
+#include <stddef.h>
+
+#define RL_WINDOW 32
+#define RL_TRIES 8
+
+typedef struct reliable Reliable;	/* opaque type definition */
+
+typedef void (*RlOutput)(const void *datagram, size_t len, void *arg);
+typedef void (*RlDeliver)(const void *payload, size_t len, void *arg);
+
+typedef struct {
+    unsigned long sent;			/* reliable payloads sent */
+    unsigned long retransmitted;	/* retransmissions of them */
+    unsigned long abandoned;		/* given up after RL_TRIES */
+    unsigned long refused;		/* rl_send() with the queue full */
+    unsigned long delivered;		/* reliable payloads delivered */
+    unsigned long duplicates;		/* received again, or held already */
+    unsigned long acks;			/* acknowledgement-only envelopes sent */
+    long long srttUsec;			/* smoothed round trip, 0 if no sample */
+    long long rtoUsec;			/* current retransmission timeout */
+} ReliableStats;
+
+/*
+ * returns 1 if the datagram is an envelope, 0 if not
+ */
+int rl_is_envelope(const void *buf, size_t len);
+
+/*
+ * creates a channel end that queues up to `queueMax' payloads beyond the
+ * window
+ *
+ * returns a pointer to it, or NULL if there are malloc() errors
+ */
+Reliable *rl_create(long queueMax);
+
+/*
+ * destroys the channel end and whatever it has not delivered or had
+ * acknowledged
+ */
+void rl_destroy(Reliable *rl);
+
+/*
+ * sends a copy of the payload reliably, at once if the window has room
+ *
+ * returns 1 if successful, 0 if the queue is full or there are malloc()
+ * errors
+ */
+int rl_send(Reliable *rl, const void *payload, size_t len, long long now, RlOutput out, void *arg);
+
+/*
+ * wraps the payload in a best-effort envelope in `buf' of `cap' bytes,
+ * acknowledging what has been received so far
+ *
+ * returns the envelope's length, or 0 if it does not fit
+ */
+size_t rl_wrap(Reliable *rl, const void *payload, size_t len, void *buf, size_t cap);
+
+/*
+ * takes in an envelope from the peer, passing each payload it makes
+ * deliverable to `deliver(payload, len, arg)'; `deliver' may send on the
+ * channel but not destroy it.  Retransmissions the envelope shows to be
+ * needed are left to the next rl_tick(), whose deadline is then `now'
+ *
+ * returns 1 if the envelope was taken, 0 if it is malformed
+ */
+int rl_receive(Reliable *rl, const void *datagram, size_t len, long long now,
+               RlDeliver deliver, void *arg);
+
+/*
+ * returns when rl_tick() next has something to do, or -1 if nothing is
+ * in flight and no acknowledgement is owed
+ */
+long long rl_deadline(Reliable *rl);
+
+/*
+ * retransmits (or gives up on) what is due and sends an acknowledgement
+ * if one is due
+ */
+void rl_tick(Reliable *rl, long long now, RlOutput out, void *arg);
+
+/*
+ * sends an acknowledgement at once if one is owed
+ */
+void rl_ack_now(Reliable *rl, RlOutput out, void *arg);
+
+/*
+ * returns the number of reliable payloads sent or queued and not yet
+ * acknowledged or given up on
+ */
+long rl_backlog(Reliable *rl);
+
+/*
+ * returns the channel end's counters and timer estimates
+ */
+ReliableStats rl_stats(Reliable *rl);
+
+#endif /* _RELIABLE_H_ */
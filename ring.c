@@ -0,0 +1,195 @@
+/*
+ * ring.c
+ *
+ * implementation of the rings
+ *
+ * Ring: the classic two-index ring; each side caches the other's index and
+ * only reloads it when the cached value says the ring is full (producer)
+ * or empty (consumer), so in steady state a batch costs one release store
+ *
+ * MpscRing: producers claim a run of slots with a compare-and-swap on the
+ * tail and publish each slot by storing its position + 1 in the slot's
+ * sequence word; the consumer takes slots in order for as long as their
+ * sequence words say they are published
+ */
+
+#include "ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+struct ring {
+    _Alignas(RING_CACHELINE) atomic_ulong head;	/* next to pop */
+    unsigned long cachedTail;			/* consumer's view of tail */
+    _Alignas(RING_CACHELINE) atomic_ulong tail;	/* next to push */
+    unsigned long cachedHead;			/* producer's view of head */
+    _Alignas(RING_CACHELINE) unsigned long mask;
+    size_t elemSize;
+    char *slots;
+};
+
+struct mpsc_ring {
+    _Alignas(RING_CACHELINE) atomic_ulong head;
+    _Alignas(RING_CACHELINE) atomic_ulong tail;
+    _Alignas(RING_CACHELINE) unsigned long mask;
+    size_t elemSize;
+    size_t stride;				/* sequence word + element */
+    char *slots;
+};
+
+static unsigned long roundUp(long capacity) {
+    unsigned long n = 2UL;
+
+    while (n < (unsigned long)capacity)
+        n <<= 1;
+    return n;
+}
+
+/*
+ * local function that copies `n' elements between the ring's slot array,
+ * starting at position `pos', and a flat array, wrapping as needed
+ */
+static void copySlots(char *slots, unsigned long mask, size_t size,
+                      unsigned long pos, char *flat, long n, int in) {
+    unsigned long at = pos & mask;
+    unsigned long first = mask + 1 - at;
+
+    if (first > (unsigned long)n)
+        first = (unsigned long)n;
+    if (in) {
+        memcpy(slots + at * size, flat, first * size);
+        memcpy(slots, flat + first * size, (n - first) * size);
+    } else {
+        memcpy(flat, slots + at * size, first * size);
+        memcpy(flat + first * size, slots, (n - first) * size);
+    }
+}
+
+Ring *ring_create(size_t elemSize, long capacity) {
+    Ring *r = (Ring *)aligned_alloc(RING_CACHELINE, sizeof(Ring));
+
+    if (r != NULL) {
+        r->mask = roundUp(capacity) - 1;
+        r->elemSize = elemSize;
+        if ((r->slots = (char *)malloc((r->mask + 1) * elemSize)) == NULL) {
+            free(r);
+            return NULL;
+        }
+        atomic_init(&r->head, 0UL);
+        atomic_init(&r->tail, 0UL);
+        r->cachedHead = r->cachedTail = 0UL;
+    }
+    return r;
+}
+
+void ring_destroy(Ring *r) {
+    free(r->slots);
+    free(r);
+}
+
+long ring_push(Ring *r, const void *elems, long n) {
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned long cap = r->mask + 1;
+
+    if (tail - r->cachedHead + n > cap) {
+        r->cachedHead = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->cachedHead + n > cap)
+            n = (long)(cap - (tail - r->cachedHead));
+    }
+    if (n <= 0L)
+        return 0L;
+    copySlots(r->slots, r->mask, r->elemSize, tail, (char *)elems, n, 1);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+long ring_pop(Ring *r, void *elems, long max) {
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    long n;
+
+    if (r->cachedTail - head < (unsigned long)max)
+        r->cachedTail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    n = (long)(r->cachedTail - head);
+    if (n > max)
+        n = max;
+    if (n <= 0L)
+        return 0L;
+    copySlots(r->slots, r->mask, r->elemSize, head, (char *)elems, n, 0);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+long ring_count(Ring *r) {
+    return (long)(atomic_load(&r->tail) - atomic_load(&r->head));
+}
+
+MpscRing *mpsc_create(size_t elemSize, long capacity) {
+    MpscRing *r = (MpscRing *)aligned_alloc(RING_CACHELINE, sizeof(MpscRing));
+    unsigned long i;
+
+    if (r != NULL) {
+        r->mask = roundUp(capacity) - 1;
+        r->elemSize = elemSize;
+        r->stride = (sizeof(atomic_ulong) + elemSize + 7) & ~(size_t)7;
+        if ((r->slots = (char *)malloc((r->mask + 1) * r->stride)) == NULL) {
+            free(r);
+            return NULL;
+        }
+        /* a sequence word of 0 matches no position: nothing is published */
+        for (i = 0UL; i <= r->mask; i++)
+            atomic_init((atomic_ulong *)(r->slots + i * r->stride), 0UL);
+        atomic_init(&r->head, 0UL);
+        atomic_init(&r->tail, 0UL);
+    }
+    return r;
+}
+
+void mpsc_destroy(MpscRing *r) {
+    free(r->slots);
+    free(r);
+}
+
+long mpsc_push(MpscRing *r, const void *elems, long n) {
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned long cap = r->mask + 1;
+    const char *src = (const char *)elems;
+    long k, i;
+
+    for (;;) {
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        k = (long)(cap - (tail - head));
+        if (k > n)
+            k = n;
+        if (k <= 0L)
+            return 0L;
+        if (atomic_compare_exchange_weak_explicit(&r->tail, &tail, tail + k,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for (i = 0L; i < k; i++) {
+        char *slot = r->slots + ((tail + i) & r->mask) * r->stride;
+        memcpy(slot + sizeof(atomic_ulong), src + i * r->elemSize, r->elemSize);
+        atomic_store_explicit((atomic_ulong *)slot, tail + i + 1, memory_order_release);
+    }
+    return k;
+}
+
+long mpsc_pop(MpscRing *r, void *elems, long max) {
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    char *dst = (char *)elems;
+    long i;
+
+    for (i = 0L; i < max; i++) {
+        char *slot = r->slots + ((head + i) & r->mask) * r->stride;
+        if (atomic_load_explicit((atomic_ulong *)slot, memory_order_acquire) != head + i + 1)
+            break;
+        memcpy(dst + i * r->elemSize, slot + sizeof(atomic_ulong), r->elemSize);
+    }
+    if (i > 0L)
+        atomic_store_explicit(&r->head, head + i, memory_order_release);
+    return i;
+}
+
+long mpsc_count(MpscRing *r) {
+    return (long)(atomic_load(&r->tail) - atomic_load(&r->head));
+}
@@ -0,0 +1,66 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+/*
+ * interface definition for bounded lock-free rings of fixed-size elements
+ *
+ * Ring is single-producer single-consumer; MpscRing takes any number of
+ * producer threads and one consumer.  Both hold a power-of-two number of
+ * elements (the capacity asked for is rounded up), copy elements in and
+ * out in batches, and keep the producer's and the consumer's indexes on
+ * cache lines of their own so the two sides do not false-share.
+ *
+ * push and pop never block: they move as many elements as there are room
+ * or elements for, and return that number
+ */
+
+#include <stddef.h>
+
+#define RING_CACHELINE 64
+
+typedef struct ring Ring;		/* opaque type definitions */
+typedef struct mpsc_ring MpscRing;
+
+/*
+ * creates a ring of at least `capacity' elements of `elemSize' bytes
+ *
+ * returns a pointer to the ring, or NULL if there are malloc() errors
+ */
+Ring *ring_create(size_t elemSize, long capacity);
+
+/*
+ * destroys the ring
+ */
+void ring_destroy(Ring *r);
+
+/*
+ * copies up to `n' elements from `elems' into the ring (producer only)
+ *
+ * returns the number of elements pushed
+ */
+long ring_push(Ring *r, const void *elems, long n);
+
+/*
+ * copies up to `max' elements out of the ring into `elems' (consumer only)
+ *
+ * returns the number of elements popped
+ */
+long ring_pop(Ring *r, void *elems, long max);
+
+/*
+ * returns the number of elements in the ring; exact only if neither side
+ * is running
+ */
+long ring_count(Ring *r);
+
+/*
+ * the same for the multi-producer ring; mpsc_push() may be called by any
+ * number of threads at once, mpsc_pop() by one
+ */
+MpscRing *mpsc_create(size_t elemSize, long capacity);
+void mpsc_destroy(MpscRing *r);
+long mpsc_push(MpscRing *r, const void *elems, long n);
+long mpsc_pop(MpscRing *r, void *elems, long max);
+long mpsc_count(MpscRing *r);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,636 @@
+/*
+ * saylog.c
+ *
+ * implementation of the say log
+ *
+ * segment files are named say-<seq>.log with seq counting up from 1; every
+ * segment but the current one has its sequence number and first stamp in
+ * an index, oldest first, which is all a range read needs to pick segments.
+ * The writer only takes the lock to roll over; the flusher takes it to
+ * pick up its work and to hand over the next segment
+ */
+
+#define _GNU_SOURCE
+#include "saylog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_MAGIC "DUCKLOG1"
+#define LOG_PAGE 4096UL
+#define HEADER_BYTES LOG_PAGE		/* records start on a page */
+#define RECORD_BYTES sizeof(SayLogRecord)
+#define PREFAULT_BYTES (4UL << 20)	/* mapped writable ahead of the writer */
+
+typedef struct {
+    char magic[8];
+    uint32_t recordBytes;
+    uint32_t headerBytes;
+    uint64_t seq;
+} SegmentHeader;
+
+typedef struct segment {
+    struct segment *next;		/* on the retired list */
+    unsigned long seq;
+    int fd;
+    char *base;				/* the whole file, mapped shared */
+    size_t bytes;
+    atomic_size_t used;			/* header and complete records */
+    size_t synced;			/* flusher only */
+    size_t faulted;			/* flusher only: prefaulted up to here */
+} Segment;
+
+typedef struct {
+    unsigned long seq;
+    long long first;			/* LLONG_MAX if it has no records */
+} SegmentIndex;
+
+struct say_log {
+    char *dir;
+    int dirFd;
+    size_t segmentBytes;
+    int syncMs;
+    Segment *cur;			/* writer's; replaced under the lock */
+    long long last;			/* writer: newest stamp */
+    pthread_t flusher;
+    pthread_mutex_t lock;		/* guards everything below */
+    pthread_cond_t wake;		/* the flusher waits here */
+    pthread_cond_t done;		/* ... and broadcasts here after a pass */
+    Segment *spare;			/* the next segment, made ahead */
+    int spareFailed;			/* the flusher's last try to make it failed */
+    Segment *retired;			/* left by the writer, to sync and unmap */
+    SegmentIndex *index;		/* segments before cur, oldest first */
+    long nindex;
+    long capIndex;
+    unsigned long passes;
+    int syncWanted;
+    int stopping;
+    atomic_ulong appended;
+    atomic_ulong synced;
+    atomic_ulong syncs;
+    atomic_llong syncMaxUsec;
+    atomic_ulong failed;
+};
+
+static long long monotonicUsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static size_t recordsIn(size_t bytes) {
+    return (bytes > HEADER_BYTES) ? (bytes - HEADER_BYTES) / RECORD_BYTES : 0;
+}
+
+static SayLogRecord *record(const char *base, size_t i) {
+    return (SayLogRecord *)(base + HEADER_BYTES + i * RECORD_BYTES);
+}
+
+static long long stampOf(const char *base, size_t i) {
+    return __atomic_load_n(&record(base, i)->stamp, __ATOMIC_ACQUIRE);
+}
+
+static void segmentPath(SayLog *log, unsigned long seq, char *path) {
+    snprintf(path, PATH_MAX, "%s/say-%08lu.log", log->dir, seq);
+}
+
+/*
+ * local function that maps a segment file; returns the mapping, or NULL if
+ * the file cannot be mapped or is not a segment
+ */
+static char *mapFile(int fd, size_t *bytes, int writable) {
+    struct stat st;
+    char *base;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < HEADER_BYTES)
+        return NULL;
+    base = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (memcmp(((SegmentHeader *)base)->magic, LOG_MAGIC, 8) != 0 ||
+        ((SegmentHeader *)base)->recordBytes != RECORD_BYTES ||
+        ((SegmentHeader *)base)->headerBytes != HEADER_BYTES) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    *bytes = st.st_size;
+    return base;
+}
+
+/*
+ * local function that maps the pages the writer will need next writable, so
+ * it does not take a fault on each (a shared mapping of a file is populated
+ * read-only, and a page is protected again once synced)
+ */
+static void prefault(Segment *s) {
+#ifdef MADV_POPULATE_WRITE
+    size_t used = atomic_load_explicit(&s->used, memory_order_relaxed);
+    size_t from = (used + LOG_PAGE - 1) & ~(LOG_PAGE - 1), to = from + PREFAULT_BYTES;
+
+    if (from < s->faulted)
+        from = s->faulted;
+    if (to > s->bytes)
+        to = s->bytes;
+    if (from < to && madvise(s->base + from, to - from, MADV_POPULATE_WRITE) == 0)
+        s->faulted = to;
+#else
+    (void)s;
+#endif
+}
+
+static void freeSegment(Segment *s) {
+    munmap(s->base, s->bytes);
+    close(s->fd);
+    free(s);
+}
+
+/*
+ * local function that creates segment `seq' with its blocks allocated and
+ * its first pages mapped writable; returns the segment, or NULL on errors
+ */
+static Segment *createSegment(SayLog *log, unsigned long seq) {
+    char path[PATH_MAX];
+    Segment *s = (Segment *)malloc(sizeof(Segment));
+    SegmentHeader *h;
+    struct stat st;
+    long long first = 0LL;
+
+    if (s == NULL)
+        return NULL;
+    segmentPath(log, seq, path);
+    if ((s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        free(s);
+        return NULL;
+    }
+    // a spare left by a process that never used it can be taken over, but
+    // nothing with records in it
+    s->bytes = log->segmentBytes;
+    if (fstat(s->fd, &st) < 0 || (st.st_size > 0 &&
+        (pread(s->fd, &first, sizeof(first), HEADER_BYTES) < 0 || first != 0LL))) {
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    if ((size_t)st.st_size > s->bytes)
+        s->bytes = st.st_size;
+    if (posix_fallocate(s->fd, 0, s->bytes) != 0 ||
+        (s->base = mmap(NULL, s->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0)) == MAP_FAILED) {
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    h = (SegmentHeader *)s->base;
+    memcpy(h->magic, LOG_MAGIC, 8);
+    h->recordBytes = RECORD_BYTES;
+    h->headerBytes = HEADER_BYTES;
+    h->seq = seq;
+    // the name must survive a crash along with the records
+    (void)fsync(log->dirFd);
+    s->next = NULL;
+    s->seq = seq;
+    atomic_init(&s->used, HEADER_BYTES);
+    s->synced = 0;
+    s->faulted = 0;
+    prefault(s);
+    return s;
+}
+
+/*
+ * local function that reopens the newest segment for appending after its
+ * last complete record, found by binary search for the first zero stamp
+ */
+static Segment *reopenSegment(SayLog *log, unsigned long seq) {
+    char path[PATH_MAX];
+    Segment *s = (Segment *)malloc(sizeof(Segment));
+    size_t lo = 0, hi, mid;
+
+    if (s == NULL)
+        return NULL;
+    segmentPath(log, seq, path);
+    if ((s->fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        free(s);
+        return NULL;
+    }
+    if ((s->base = mapFile(s->fd, &s->bytes, 1)) == NULL) {
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    for (hi = recordsIn(s->bytes); lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+        if (stampOf(s->base, mid) != 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0)
+        log->last = stampOf(s->base, lo - 1);
+    s->next = NULL;
+    s->seq = seq;
+    atomic_init(&s->used, HEADER_BYTES + lo * RECORD_BYTES);
+    s->synced = HEADER_BYTES + lo * RECORD_BYTES;
+    s->faulted = 0;
+    return s;
+}
+
+// local function that adds a segment to the index; returns 1 if successful
+static int indexSegment(SayLog *log, unsigned long seq, long long first) {
+    if (log->nindex == log->capIndex) {
+        long cap = (log->capIndex > 0L) ? 2L * log->capIndex : 16L;
+        SegmentIndex *p = (SegmentIndex *)realloc(log->index, cap * sizeof(SegmentIndex));
+        if (p == NULL)
+            return 0;
+        log->index = p;
+        log->capIndex = cap;
+    }
+    log->index[log->nindex].seq = seq;
+    log->index[log->nindex].first = first;
+    log->nindex++;
+    return 1;
+}
+
+static int bySeq(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * local function that indexes the segments already in the directory and
+ * reopens the newest; returns 1 if successful
+ */
+static int scanDir(SayLog *log) {
+    DIR *d = fdopendir(dup(log->dirFd));
+    struct dirent *e;
+    unsigned long *seqs = NULL, seq;
+    long n = 0L, cap = 0L, i;
+    int ok = 1;
+
+    if (d == NULL)
+        return 0;
+    while ((e = readdir(d)) != NULL) {
+        int end = 0;
+        if (sscanf(e->d_name, "say-%lu.log%n", &seq, &end) != 1 || e->d_name[end] != '\0' || seq == 0)
+            continue;
+        if (n == cap) {
+            unsigned long *p = (unsigned long *)realloc(seqs, (cap = cap ? 2 * cap : 64) * sizeof(unsigned long));
+            if (p == NULL) {
+                ok = 0;
+                break;
+            }
+            seqs = p;
+        }
+        seqs[n++] = seq;
+    }
+    closedir(d);
+    qsort(seqs, n, sizeof(unsigned long), bySeq);
+    for (i = 0; ok && i < n - 1; i++) {
+        char path[PATH_MAX];
+        size_t bytes;
+        char *base;
+        int fd;
+        segmentPath(log, seqs[i], path);
+        // a file that is not a segment is left alone
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        if ((base = mapFile(fd, &bytes, 0)) != NULL) {
+            long long first = (recordsIn(bytes) > 0 && stampOf(base, 0) != 0) ? stampOf(base, 0) : LLONG_MAX;
+            ok = indexSegment(log, seqs[i], first);
+            munmap(base, bytes);
+        }
+        close(fd);
+    }
+    if (ok && n > 0 && (log->cur = reopenSegment(log, seqs[n - 1])) == NULL)
+        ok = indexSegment(log, seqs[n - 1], LLONG_MAX) &&
+             (log->cur = createSegment(log, seqs[n - 1] + 1)) != NULL;
+    if (ok && n == 0)
+        ok = (log->cur = createSegment(log, 1UL)) != NULL;
+    free(seqs);
+    return ok;
+}
+
+/*
+ * local function that syncs what was appended to the segment since its
+ * last sync, from the start of the page the last sync ended in
+ */
+static void syncSegment(SayLog *log, Segment *s) {
+    size_t used = atomic_load_explicit(&s->used, memory_order_acquire);
+    size_t from = s->synced & ~(LOG_PAGE - 1);
+    long long start, took;
+
+    if (recordsIn(used) == recordsIn(s->synced))
+        return;
+    start = monotonicUsec();
+    if (msync(s->base + from, used - from, MS_SYNC) < 0)
+        return;
+    took = monotonicUsec() - start;
+    atomic_fetch_add(&log->synced, (unsigned long)(recordsIn(used) - recordsIn(s->synced)));
+    atomic_fetch_add(&log->syncs, 1UL);
+    if (took > atomic_load(&log->syncMaxUsec))
+        atomic_store(&log->syncMaxUsec, took);
+    s->synced = used;
+}
+
+static void *flusherMain(void *arg) {
+    SayLog *log = (SayLog *)arg;
+    struct timespec until;
+    int stopping;
+
+    pthread_mutex_lock(&log->lock);
+    for (;;) {
+        Segment *cur, *retired, *next, *spare = NULL;
+        unsigned long spareSeq = 0UL;
+
+        if (!log->stopping && !log->syncWanted && log->retired == NULL &&
+            (log->spare != NULL || log->spareFailed)) {
+            clock_gettime(CLOCK_MONOTONIC, &until);
+            until.tv_sec += log->syncMs / 1000;
+            until.tv_nsec += (log->syncMs % 1000) * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            (void)pthread_cond_timedwait(&log->wake, &log->lock, &until);
+        }
+        cur = log->cur;
+        retired = log->retired;
+        log->retired = NULL;
+        log->syncWanted = 0;
+        stopping = log->stopping;
+        if (log->spare == NULL && !stopping)
+            spareSeq = cur->seq + 1;
+        pthread_mutex_unlock(&log->lock);
+
+        for (; retired != NULL; retired = next) {
+            next = retired->next;
+            syncSegment(log, retired);
+            freeSegment(retired);
+        }
+        syncSegment(log, cur);
+        prefault(cur);
+        if (spareSeq != 0UL)
+            spare = createSegment(log, spareSeq);
+
+        pthread_mutex_lock(&log->lock);
+        if (spareSeq != 0UL) {
+            log->spare = spare;
+            log->spareFailed = (spare == NULL);
+        }
+        log->passes++;
+        pthread_cond_broadcast(&log->done);
+        if (stopping)
+            break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+SayLog *sl_open(const char *dir, size_t segmentBytes, int syncMs) {
+    SayLog *log = (SayLog *)calloc(1, sizeof(SayLog));
+    pthread_condattr_t attr;
+
+    if (log == NULL)
+        return NULL;
+    log->segmentBytes = (segmentBytes + LOG_PAGE - 1) & ~(LOG_PAGE - 1);
+    if (log->segmentBytes < HEADER_BYTES + LOG_PAGE)
+        log->segmentBytes = HEADER_BYTES + LOG_PAGE;
+    log->syncMs = (syncMs > 0) ? syncMs : 1;
+    log->dirFd = -1;
+    if ((log->dir = strdup(dir)) == NULL ||
+        (mkdir(dir, 0755) < 0 && errno != EEXIST) ||
+        (log->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        !scanDir(log)) {
+        if (log->cur != NULL)
+            freeSegment(log->cur);
+        if (log->dirFd >= 0)
+            close(log->dirFd);
+        free(log->index);
+        free(log->dir);
+        free(log);
+        return NULL;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&log->done, NULL);
+    if (pthread_create(&log->flusher, NULL, flusherMain, log) != 0) {
+        freeSegment(log->cur);
+        close(log->dirFd);
+        free(log->index);
+        free(log->dir);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void sl_close(SayLog *log) {
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&log->lock);
+    log->stopping = 1;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->flusher, NULL);
+    // the flusher's last pass synced everything, so only the spare is left
+    freeSegment(log->cur);
+    if (log->spare != NULL) {
+        segmentPath(log, log->spare->seq, path);
+        freeSegment(log->spare);
+        unlink(path);
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    pthread_cond_destroy(&log->done);
+    close(log->dirFd);
+    free(log->index);
+    free(log->dir);
+    free(log);
+}
+
+/*
+ * local function that moves the writer to the spare segment, waiting for
+ * the flusher to make it if need be; returns 1 if successful
+ */
+static int roll(SayLog *log) {
+    Segment *old = log->cur;
+    long long first = (old->bytes >= HEADER_BYTES + RECORD_BYTES && stampOf(old->base, 0) != 0)
+                      ? stampOf(old->base, 0) : LLONG_MAX;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->spare == NULL && !log->spareFailed) {
+        pthread_cond_signal(&log->wake);
+        pthread_cond_wait(&log->done, &log->lock);
+    }
+    if (log->spare == NULL || !indexSegment(log, old->seq, first)) {
+        // the flusher tries again on its next pass; until then says are lost
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+    old->next = log->retired;
+    log->retired = old;
+    log->cur = log->spare;
+    log->spare = NULL;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    return 1;
+}
+
+static void copyField(char *dst, const char *src, size_t max) {
+    size_t n = strnlen(src, max);
+
+    memcpy(dst, src, n);
+    memset(dst + n, 0, max - n);
+}
+
+int sl_append(SayLog *log, const char *channel, const char *username, const char *text) {
+    Segment *s = log->cur;
+    size_t used = atomic_load_explicit(&s->used, memory_order_relaxed);
+    SayLogRecord *rec;
+    struct timespec ts;
+    long long stamp;
+
+    if (used + RECORD_BYTES > s->bytes) {
+        if (!roll(log)) {
+            atomic_fetch_add_explicit(&log->failed, 1UL, memory_order_relaxed);
+            return 0;
+        }
+        s = log->cur;
+        used = atomic_load_explicit(&s->used, memory_order_relaxed);
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stamp = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (stamp < log->last)
+        stamp = log->last;
+    log->last = stamp;
+
+    rec = (SayLogRecord *)(s->base + used);
+    copyField(rec->channel, channel, CHANNEL_MAX);
+    copyField(rec->username, username, USERNAME_MAX);
+    copyField(rec->text, text, SAY_MAX);
+    __atomic_store_n(&rec->stamp, stamp, __ATOMIC_RELEASE);
+    atomic_store_explicit(&s->used, used + RECORD_BYTES, memory_order_release);
+    atomic_store_explicit(&log->appended, atomic_load_explicit(&log->appended, memory_order_relaxed) + 1UL,
+                          memory_order_relaxed);
+    return 1;
+}
+
+void sl_sync(SayLog *log) {
+    unsigned long target;
+
+    // the next pass may have read `used' before the call; the one after
+    // cannot have
+    pthread_mutex_lock(&log->lock);
+    target = log->passes + 2UL;
+    log->syncWanted = 1;
+    pthread_cond_signal(&log->wake);
+    while (log->passes < target) {
+        pthread_cond_wait(&log->done, &log->lock);
+        if (log->passes < target)
+            log->syncWanted = 1;
+        pthread_cond_signal(&log->wake);
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * local function that reads the records of one segment stamped `from' to
+ * `to'; returns the number read, or -1 if the segment cannot be mapped
+ */
+static long readSegment(SayLog *log, unsigned long seq, long long from, long long to,
+                        void (*fn)(const SayLogRecord *rec, void *arg), void *arg) {
+    char path[PATH_MAX];
+    size_t bytes, lo = 0, hi, n, i;
+    long count = 0L;
+    char *base;
+    int fd;
+
+    segmentPath(log, seq, path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1L;
+    if ((base = mapFile(fd, &bytes, 0)) == NULL) {
+        close(fd);
+        return -1L;
+    }
+    // an unused record (stamp 0) sorts after every used one
+    for (hi = n = recordsIn(bytes); lo < hi; ) {
+        size_t mid = lo + (hi - lo) / 2;
+        long long stamp = stampOf(base, mid);
+        if (stamp != 0 && stamp < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < n; i++, count++) {
+        long long stamp = stampOf(base, i);
+        if (stamp == 0 || stamp > to)
+            break;
+        fn(record(base, i), arg);
+    }
+    munmap(base, bytes);
+    close(fd);
+    return count;
+}
+
+long sl_read(SayLog *log, long long from, long long to,
+             void (*fn)(const SayLogRecord *rec, void *arg), void *arg) {
+    SegmentIndex *index;
+    long n, i, total = 0L, got;
+
+    pthread_mutex_lock(&log->lock);
+    n = log->nindex;
+    if ((index = (SegmentIndex *)malloc((n + 1) * sizeof(SegmentIndex))) == NULL) {
+        pthread_mutex_unlock(&log->lock);
+        return -1L;
+    }
+    memcpy(index, log->index, n * sizeof(SegmentIndex));
+    // the current segment's first stamp is not known without looking
+    index[n].seq = log->cur->seq;
+    index[n].first = LLONG_MIN;
+    pthread_mutex_unlock(&log->lock);
+
+    for (i = 0; i <= n; i++) {
+        // segment i holds stamps from its first up to the next one's first
+        if (i < n && index[i].first == LLONG_MAX)
+            continue;
+        if (i < n && index[i].first > to)
+            break;
+        if (i < n && index[i + 1].first != LLONG_MIN && index[i + 1].first < from)
+            continue;
+        if ((got = readSegment(log, index[i].seq, from, to, fn, arg)) < 0L) {
+            total = -1L;
+            break;
+        }
+        total += got;
+    }
+    free(index);
+    return total;
+}
+
+SayLogStats sl_stats(SayLog *log) {
+    SayLogStats s;
+
+    s.appended = atomic_load(&log->appended);
+    s.synced = atomic_load(&log->synced);
+    s.syncs = atomic_load(&log->syncs);
+    s.syncMaxUsec = atomic_load(&log->syncMaxUsec);
+    s.failed = atomic_load(&log->failed);
+    pthread_mutex_lock(&log->lock);
+    s.segments = (unsigned long)log->nindex + 1UL;
+    pthread_mutex_unlock(&log->lock);
+    return s;
+}
@@ -0,0 +1,92 @@
+#ifndef _SAYLOG_H_
+#define _SAYLOG_H_
+
+/*
+ * interface definition for an append-only log of says kept in a directory
+ * of preallocated segment files
+ *
+ * a segment is a one-page header followed by fixed-size records, and is
+ * mapped shared for its whole length, so appending a record is a copy into
+ * the mapping with no system call; the file's blocks are allocated when it
+ * is created, so a full disk shows up then and not as a fault on a later
+ * copy.  A flusher thread syncs what was appended since its last pass every
+ * `syncMs' milliseconds, one msync() for however many records that is; it
+ * also makes the next segment ahead of time, so rolling over to it is a
+ * pointer swap, maps the pages the writer is about to fill writable, so
+ * copying into them does not fault, and syncs and unmaps each segment the
+ * writer has left.
+ *
+ * record stamps never decrease, segment to segment and within a segment, so
+ * a range read picks its segments from the first stamp of each and its first
+ * record by binary search.  A record's stamp is stored last and an unused
+ * record is all zeroes, so the log reopens after the last record whose stamp
+ * made it to the file.
+ *
+ * one thread appends; any thread may read or wait for a sync
+ */
+
+#include <stddef.h>
+#include "duckchat.h"
+
+typedef struct say_log SayLog;		/* opaque type definition */
+
+typedef struct {
+    long long stamp;			/* usec since the Epoch; never 0 */
+    char channel[CHANNEL_MAX];		/* NUL-padded */
+    char username[USERNAME_MAX];
+    char text[SAY_MAX];
+} SayLogRecord;
+
+typedef struct {
+    unsigned long appended;		/* records appended since opening */
+    unsigned long synced;		/* of which synced to the file */
+    unsigned long syncs;		/* msync() calls that had records to sync */
+    long long syncMaxUsec;		/* longest of those */
+    unsigned long segments;		/* segment files, including the current */
+    unsigned long failed;		/* appends lost for want of a segment */
+} SayLogStats;
+
+/*
+ * opens the log in directory `dir', creating it if need be, in segments of
+ * `segmentBytes' (rounded up to whole pages), synced every `syncMs'
+ * milliseconds; appends go after the last record already in the log
+ *
+ * returns a pointer to the log, or NULL if there are I/O, malloc() or
+ * thread creation errors
+ */
+SayLog *sl_open(const char *dir, size_t segmentBytes, int syncMs);
+
+/*
+ * syncs everything appended, stops the flusher and closes the log
+ */
+void sl_close(SayLog *log);
+
+/*
+ * appends a say stamped with the current time; the strings are copied up
+ * to their size in SayLogRecord or first NUL
+ *
+ * returns 1 if successful, 0 if no segment could be made for it
+ */
+int sl_append(SayLog *log, const char *channel, const char *username, const char *text);
+
+/*
+ * waits until everything appended before the call is synced
+ */
+void sl_sync(SayLog *log);
+
+/*
+ * calls `fn(rec, arg)' for each record stamped `from' to `to', inclusive,
+ * oldest first; records appended meanwhile may or may not be seen
+ *
+ * returns the number of records passed to `fn', or -1 if a segment could
+ * not be read
+ */
+long sl_read(SayLog *log, long long from, long long to,
+             void (*fn)(const SayLogRecord *rec, void *arg), void *arg);
+
+/*
+ * returns the log's counters
+ */
+SayLogStats sl_stats(SayLog *log);
+
+#endif /* _SAYLOG_H_ */
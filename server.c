@@ -10,395 +10,3624 @@
  * Hashmap and LinkedList implementations are provided by Prof. Joe Sventek
  */
 
-#include <stdio.h> 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "hashmap.h"
-#include "linkedlist.h"
+#include "addrmap.h"
+#include "slab.h"
+#include "wire.h"
+#include "egress.h"
+#include "fanpool.h"
+#include "ring.h"
+#include "epoch.h"
+#include "sketch.h"
+#include "saylog.h"
+#include "reliable.h"
 #include "duckchat.h"
+#include "server.h"
 
 
 #define DEFAULT_CHANNEL "Common"
 #define MAX_CHANNELS 10
 #define UNUSED __attribute__((unused))
 
+#define FANOUT_BATCH 256 /* datagrams handed to one sendmmsg() call */
+#define EGRESS_SLOTS 16384 /* datagrams waiting for the socket to drain */
+#define EGRESS_PER_SESSION 64 /* beyond this a session loses its oldest */
+#define FANOUT_CHUNK 4096 /* recipients per fan-out pool work item */
+#define PREFETCH_AHEAD 8
+
 int socket_fd;
-HashMap *users = NULL;
+AddrMap *users = NULL;
+Egress *egress = NULL; /* every datagram the server sends goes through here */
+FanPool *fanpool = NULL; /* sends to channels of fanout_policy.threshold or more */
+EpochDomain *snap_epochs = NULL; /* reclaims member snapshots the pool may still read */
 HashMap *channels = NULL;
 struct sockaddr_in client, server;
 
-typedef struct {
-    struct sockaddr_in *addr;
-    char *ip_addr;
-    char *username;
-    LinkedList *channels;
-} User;
+/*
+ * Session and channel records are fixed-size and come from slabs: a user is
+ * a single cache-line object holding its name, its id and the head of its
+ * membership list, so login and logout each cost one slab
+ * operation and a login storm never touches the general heap.
+ */
+Slab *user_slab = NULL;
+Slab *channel_slab = NULL;
+Slab *membership_slab = NULL;
+
+typedef struct channel Channel;
+typedef struct member_snap MemberSnap;
+
+/* One node per channel a user is in, threaded off the user record. */
+typedef struct membership {
+    Channel *channel;
+    struct membership *next;
+    long index; /* position in channel->members */
+} Membership;
+
+/*
+ * Token bucket admitting says, refilled at the configured rate up to the
+ * configured burst.  Tokens are kept in thousandths so that rates of a few
+ * says per second still refill every millisecond.
+ */
+typedef struct {
+    int tokens;
+    unsigned int stamp; /* monotonic ms of the last refill */
+} Bucket;
+
+/*
+ * A channel's last says, for REQ_HISTORY: a ring of history_depth records,
+ * one cache-aligned block allocated at the channel's first say and freed
+ * with the channel, so recording a say is two memcpy()s into the oldest
+ * record and a channel's history never takes more than
+ * history_depth * sizeof(HistoryRecord) bytes, whatever is said in it.
+ */
+typedef struct {
+    char username[USERNAME_MAX];
+    char text[SAY_MAX];
+} HistoryRecord;
+
+/*
+ * members[] is the hot column walked by fan-out; refs[i] points back at the
+ * membership node of members[i] so that a leave can swap-remove in O(1).
+ */
+struct channel {
+    char name[CHANNEL_MAX];
+    int *members; /* packed user ids */
+    Membership **refs;
+    long nmembers;
+    long capacity;
+    unsigned long version; /* bumped on every join and leave */
+    unsigned long who_version; /* version who_cache was built at */
+    struct text_who *who_cache; /* serialized WHO reply, built lazily */
+    long who_capacity; /* entries who_cache has room for */
+    Bucket says; /* say budget shared by every member */
+    MemberSnap *_Atomic snap; /* recipients for the fan-out pool, or NULL */
+    HistoryRecord *history; /* NULL until the first say */
+    unsigned long history_next; /* says recorded; record i is at i % history_depth */
+    int reliable; /* named under reliable_policy.prefix */
+};
+
+/*
+ * A session is budgeted at 128 bytes or less, memberships aside:
+ *
+ *   User record (one cache line)                  64
+ *   session_addrs[] entry                         16
+ *   session_users[] entry                          8
+ *   free_ids[] entry                               4
+ *   session_caps[] entry                           1
+ *   session_rel[] and session_busy[] entries       9
+ *   session_gens[] entry                           4
+ *   egress queue chain                             6
+ *   users index (4-byte slots, at most half full)  8-16
+ *                                                -----
+ *                                               120-128
+ *
+ * Each membership adds its Membership node (24) plus the members[] id (4)
+ * and refs[] pointer (8) in the channel, before array growth slack.  The
+ * address lives only in session_addrs[]; the user record keeps no copy,
+ * which leaves room in its cache line for the say bucket.
+ * bench_memory measures the real figures.
+ */
+typedef struct batch Batch;
+
+typedef struct {
+    char username[USERNAME_MAX];
+    Membership *channels;
+    Batch *batch; /* says waiting to go out as one TXT_BATCH, or NULL */
+    int id;
+    Bucket says; /* the session's own say budget */
+    unsigned int notice_stamp; /* monotonic ms of the last throttle error */
+} User;
+
+/*
+ * Says for a CAP_BATCH session are coalesced here and flushed as a single
+ * datagram when it is full or BATCH_FLUSH_USEC after the oldest pending
+ * batch was started, whichever comes first.  For a v1 session the datagram
+ * is a TXT_BATCH; for a CAP_V2 session it is the v2 TXT_SAY messages one
+ * after the other, which fits several times as many says.  Batches come from
+ * a slab and only exist while they hold records.
+ */
+#define BATCH_FLUSH_USEC 500
+#define BATCH_BYTES(n) (sizeof(struct text_batch) + sizeof(struct say_record) * (n))
+
+struct batch {
+    int id; /* owning session */
+    int dirty_index; /* position in dirty_batches[] */
+    size_t len; /* bytes of packet in use */
+    union {
+        struct text_batch v1;
+        unsigned char bytes[BATCH_BYTES(BATCH_RECORDS_MAX)];
+    } packet;
+};
+
+Slab *batch_slab = NULL;
+Batch **dirty_batches = NULL;
+int ndirty_batches = 0;
+int dirty_capacity = 0;
+long long batch_deadline = 0LL; /* monotonic usec; valid while any are dirty */
+
+_Static_assert(sizeof(User) <= SLAB_CACHELINE, "a User must fit in one cache line");
+
+/*
+ * A say costs O(channel size) sends, so each is admitted against both the
+ * sender's bucket and the channel's before any fan-out work is done.  A
+ * throttled sender is told so at most once per THROTTLE_NOTICE_MS.
+ */
+#define THROTTLE_NOTICE_MS 1000
+
+struct say_limits say_limits = { 20, 40, 200, 400 };
+struct fanout_policy fanout_policy = { 4, 10000L };
+struct history_policy history_policy = { 16 };
+unsigned long history_depth = 0UL; /* history_policy.depth rounded up to a power of two */
+struct saylog_policy saylog_policy = { NULL, 10, 64L << 20 };
+SayLog *saylog = NULL;
+int saylog_failing = 0; /* the last append was lost */
+struct server_stats server_stats;
+
+/*
+ * Every logged in user gets a dense integer id.  The destination address of
+ * each id lives in session_addrs[], one contiguous struct-of-arrays column, so
+ * fan-out only has to walk a channel's packed id array and index into it.
+ */
+struct sockaddr_in *session_addrs = NULL;
+User **session_users = NULL;
+int session_capacity = 0;
+int session_next = 0;
+int *free_ids = NULL;
+int nfree_ids = 0;
+unsigned char *session_caps = NULL; /* CAP_ bits announced at login */
+Reliable **session_rel = NULL; /* the session's reliable channel end, or NULL */
+unsigned char *session_busy = NULL; /* 1 while the id is on rel_busy[] */
+unsigned int *session_gens = NULL; /* logins the id has had, for its tokens */
+
+#define USER_ADDR(u) (&session_addrs[(u)->id])
+#define USER_V2(u) (session_caps[(u)->id] & CAP_V2)
+
+/* Room for the largest v2 reply: a full unpaged LIST or WHO, or one say. */
+unsigned char wire_out[65507];
+
+/*
+ * The TXT_LIST reply is kept serialized and patched in place whenever a
+ * channel is created or removed, so a LIST is a single send of this buffer.
+ * Its entries are kept sorted by name, which makes the buffer double as the
+ * ordered channel index: a prefix query is two binary searches and a slice.
+ */
+struct text_list *list_cache = NULL;
+long list_capacity = 0L;
+
+#define LIST_BYTES(n) (sizeof(struct text_list) + sizeof(struct channel_info) * (n))
+
+/*
+ * Reliable delivery (see reliable.h).  A session that sends an envelope gets
+ * a channel end in session_rel[], and from then on every reply to it, and
+ * every say in a reliable channel, is sent reliably; says elsewhere stay
+ * plain datagrams.  Channel ends with something in flight or an
+ * acknowledgement owed are listed in rel_busy[], which is all the timer
+ * work looks at, and drop off it once they are idle; an id whose channel
+ * end is dropped stays listed until the next pass, so that marking is a
+ * flag per id rather than a position.  While an envelope is being handled
+ * its channel end is rel_delivering, so that the replies to a login, or to
+ * a session that has just logged out, still go through it.
+ */
+#define RELIABLE_QUEUE 256 /* reliable sends queued per session beyond the window */
+
+struct reliable_policy reliable_policy = { NULL };
+int *rel_busy = NULL;
+int nrel_busy = 0;
+int rel_busy_capacity = 0;
+Reliable *rel_delivering = NULL;
+struct sockaddr_in *rel_delivering_addr = NULL;
+unsigned char rel_gather[65507]; /* a gathered reply on its way into rl_send() */
+
+/* Where a channel end's datagrams go: to a session, or to an address with none. */
+typedef struct {
+    int id;
+    struct sockaddr_in *addr;
+} RelPeer;
+
+void rel_mark_busy(int id) {
+    if (session_busy[id])
+        return;
+    if (nrel_busy == rel_busy_capacity) {
+        int N = (rel_busy_capacity > 0) ? 2 * rel_busy_capacity : 256;
+        int *tmp = realloc(rel_busy, N * sizeof(int));
+        if (tmp == NULL)
+            return;
+        rel_busy = tmp;
+        rel_busy_capacity = N;
+    }
+    session_busy[id] = 1;
+    rel_busy[nrel_busy++] = id;
+}
+
+// drops the session's channel end, unless an envelope it took is still being
+// handled; rel_tick_due() takes the id off rel_busy[]
+void rel_detach(int id) {
+    if (session_rel[id] == NULL)
+        return;
+    if (session_rel[id] != rel_delivering)
+        rl_destroy(session_rel[id]);
+    session_rel[id] = NULL;
+}
+
+// grows the session columns to hold at least `n' ids; returns 1 if successful
+int session_reserve(int n) {
+    int N = (session_capacity > 0) ? session_capacity : 1024;
+
+    while (N < n)
+        N *= 2;
+    if (N == session_capacity)
+        return 1;
+    struct sockaddr_in *a = realloc(session_addrs, N * sizeof(*a));
+    if (a == NULL)
+        return 0;
+    session_addrs = a;
+    User **u = realloc(session_users, N * sizeof(*u));
+    if (u == NULL)
+        return 0;
+    session_users = u;
+    int *f = realloc(free_ids, N * sizeof(*f));
+    if (f == NULL)
+        return 0;
+    free_ids = f;
+    unsigned char *c = realloc(session_caps, N * sizeof(*c));
+    if (c == NULL)
+        return 0;
+    session_caps = c;
+    Reliable **r = realloc(session_rel, N * sizeof(*r));
+    if (r == NULL)
+        return 0;
+    session_rel = r;
+    unsigned char *b = realloc(session_busy, N * sizeof(*b));
+    if (b == NULL)
+        return 0;
+    session_busy = b;
+    memset(session_busy + session_capacity, 0, (N - session_capacity) * sizeof(*b));
+    unsigned int *g = realloc(session_gens, N * sizeof(*g));
+    if (g == NULL)
+        return 0;
+    session_gens = g;
+    memset(session_gens + session_capacity, 0, (N - session_capacity) * sizeof(*g));
+    if (!eg_reserve(egress, N))
+        return 0;
+    session_capacity = N;
+    return 1;
+}
+
+int session_alloc_id(User *user, struct sockaddr_in *addr) {
+    int id;
+
+    if (nfree_ids > 0) {
+        id = free_ids[--nfree_ids];
+    } else {
+        if (session_next == session_capacity && !session_reserve(session_capacity + 1))
+            return -1;
+        id = session_next++;
+    }
+    session_addrs[id] = *addr;
+    session_users[id] = user;
+    session_caps[id] = 0;
+    session_rel[id] = NULL;
+    session_gens[id]++;
+    return id;
+}
+
+void session_release_id(int id) {
+    rel_detach(id);
+    eg_forget(egress, id);
+    session_users[id] = NULL;
+    free_ids[nfree_ids++] = id;
+}
+
+/*
+ * Resumption tokens.  A token names a session by id and by the generation
+ * of the id, which session_alloc_id() bumps for every login, so a token of
+ * a session since logged out matches nothing.  The two are signed with a
+ * SipHash-2-4 MAC under token_key, a random key drawn at start-up and kept
+ * across snapshots and upgrades, which leaves nothing per session to store
+ * and makes tokens unforgeable without it.
+ */
+uint64_t token_key[2];
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+// SipHash-2-4 of the 8-byte message (id, generation) under token_key
+uint64_t token_mac(int id, unsigned int generation) {
+    uint64_t m = ((uint64_t)(unsigned int)id << 32) | generation, b = 8ULL << 56;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ token_key[0], v1 = 0x646f72616e646f6dULL ^ token_key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ token_key[0], v3 = 0x7465646279746573ULL ^ token_key[1];
+    int i;
+
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v3 ^= b;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (i = 0; i < 4; i++)
+        SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// returns the id the token names if it is genuine and the session still on, -1 if not
+int token_session(const struct session_token *tok) {
+    int id = tok->tok_id;
+
+    if (id < 0 || id >= session_next || session_users[id] == NULL || session_gens[id] != tok->tok_generation ||
+        token_mac(id, tok->tok_generation) != tok->tok_mac)
+        return -1;
+    return id;
+}
+
+long long monotonic_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+unsigned int monotonic_msec(void) {
+    return (unsigned int)(monotonic_usec() / 1000);
+}
+
+void rel_output(const void *datagram, size_t len, void *arg) {
+    RelPeer *peer = (RelPeer *)arg;
+    (void)eg_send(egress, peer->id, peer->addr, datagram, len);
+}
+
+/*
+ * Sends a reply to the session `id' at `addr' (id -1 for an address with
+ * no session) reliably if it has a channel end, and as a plain datagram if
+ * not.  A reliable reply the session's queue has no room for is dropped.
+ */
+void session_send(int id, struct sockaddr_in *addr, const void *buf, size_t len) {
+    Reliable *rl = (id >= 0) ? session_rel[id] : NULL;
+    RelPeer peer = { id, addr };
+
+    if (rl == NULL && rel_delivering != NULL && addr->sin_port == rel_delivering_addr->sin_port &&
+        addr->sin_addr.s_addr == rel_delivering_addr->sin_addr.s_addr)
+        rl = rel_delivering;
+    if (rl == NULL) {
+        (void)eg_send(egress, id, addr, buf, len);
+        return;
+    }
+    (void)rl_send(rl, buf, len, monotonic_usec(), rel_output, &peer);
+    if (id >= 0 && rl == session_rel[id])
+        rel_mark_busy(id);
+}
+
+// returns how long until a reliable session has a timer due, in usec, or -1 if none has
+long long rel_wait_usec(void) {
+    long long when = -1LL, d;
+    int i;
+
+    for (i = 0; i < nrel_busy; i++)
+        if (session_rel[rel_busy[i]] != NULL && (d = rl_deadline(session_rel[rel_busy[i]])) >= 0LL &&
+            (when < 0LL || d < when))
+            when = d;
+    if (when < 0LL)
+        return -1LL;
+    when -= monotonic_usec();
+    return (when > 0LL) ? when : 0LL;
+}
+
+// runs the retransmission and acknowledgement timers that are due
+void rel_tick_due(void) {
+    long long now = monotonic_usec(), d;
+    int i;
+
+    for (i = nrel_busy - 1; i >= 0; i--) {
+        int id = rel_busy[i];
+        Reliable *rl = session_rel[id];
+        RelPeer peer = { id, &session_addrs[id] };
+        if (rl != NULL && (d = rl_deadline(rl)) >= 0LL && d <= now) {
+            rl_tick(rl, now, rel_output, &peer);
+            d = rl_deadline(rl);
+        }
+        if (rl == NULL || d < 0LL) {
+            rel_busy[i] = rel_busy[--nrel_busy];
+            session_busy[id] = 0;
+        }
+    }
+}
+
+void bucket_init(Bucket *b, int burst) {
+    b->tokens = burst * 1000;
+    b->stamp = monotonic_msec();
+}
+
+// tops the bucket up for the time since its last refill; a rate of 0 means unlimited
+void bucket_refill(Bucket *b, int rate, int burst, unsigned int now) {
+    long long t;
+    if (rate <= 0)
+        return;
+    t = b->tokens + (long long)(unsigned int)(now - b->stamp) * rate;
+    b->tokens = (t > burst * 1000LL) ? burst * 1000 : (int)t;
+    b->stamp = now;
+}
+
+int bucket_ready(Bucket *b, int rate) {
+    return rate <= 0 || b->tokens >= 1000;
+}
+
+Channel *malloc_channel(Slab *slab, const char *name) {
+    Channel *ch = (Channel *)slab_alloc(slab);
+    if (ch != NULL) {
+        memset(ch->name, 0, sizeof(ch->name));
+        strncpy(ch->name, name, (CHANNEL_MAX - 1));
+        ch->members = NULL;
+        ch->refs = NULL;
+        ch->nmembers = 0L;
+        ch->capacity = 0L;
+        ch->version = 0UL;
+        ch->who_version = 0UL;
+        ch->who_cache = NULL;
+        ch->who_capacity = 0L;
+        atomic_init(&ch->snap, NULL);
+        ch->history = NULL;
+        ch->history_next = 0UL;
+        ch->reliable = reliable_policy.prefix != NULL &&
+                       !strncmp(ch->name, reliable_policy.prefix, strlen(reliable_policy.prefix));
+        bucket_init(&ch->says, say_limits.channel_burst);
+    }
+    return ch;
+}
+
+void free_channel(Slab *slab, Channel *ch) {
+    free(ch->members);
+    free(ch->refs);
+    free(ch->who_cache);
+    free(ch->history);
+    slab_free(slab, ch);
+}
+
+// grows the member arrays to hold at least `n'; returns 1 if successful
+int channel_reserve(Channel *ch, long n) {
+    long N = (ch->capacity > 0L) ? ch->capacity : 8L;
+
+    while (N < n)
+        N *= 2;
+    if (N == ch->capacity)
+        return 1;
+    int *tmp = realloc(ch->members, N * sizeof(int));
+    if (tmp == NULL)
+        return 0;
+    ch->members = tmp;
+    Membership **r = realloc(ch->refs, N * sizeof(Membership *));
+    if (r == NULL)
+        return 0;
+    ch->refs = r;
+    ch->capacity = N;
+    return 1;
+}
+
+// returns 1 if successful, 0 if out of memory
+int channel_add_member(Channel *ch, Membership *m, int id) {
+    if (ch->nmembers == ch->capacity && !channel_reserve(ch, ch->nmembers + 1))
+        return 0;
+    m->channel = ch;
+    m->index = ch->nmembers;
+    ch->members[ch->nmembers] = id;
+    ch->refs[ch->nmembers] = m;
+    ch->nmembers++;
+    ch->version++;
+    return 1;
+}
+
+// swap-remove; member order carries no meaning
+void channel_remove_member(Channel *ch, Membership *m) {
+    long last = --ch->nmembers;
+    ch->members[m->index] = ch->members[last];
+    ch->refs[m->index] = ch->refs[last];
+    ch->refs[m->index]->index = m->index;
+    ch->version++;
+}
+
+#define WHO_BYTES(n) (sizeof(struct text_who) + sizeof(struct user_info) * (n))
+
+/*
+ * Returns the channel's serialized TXT_WHO reply, rebuilding it only if a
+ * join or leave has happened since it was last built; NULL if out of memory.
+ * `users' maps the member ids to their records.
+ */
+struct text_who *channel_who(Channel *ch, User **users) {
+    if (ch->who_cache != NULL && ch->who_version == ch->version)
+        return ch->who_cache;
+    if (ch->who_cache == NULL || ch->who_capacity < ch->nmembers) {
+        long N = (ch->capacity > 0L) ? ch->capacity : 1L;
+        struct text_who *tmp = realloc(ch->who_cache, WHO_BYTES(N));
+        if (tmp == NULL)
+            return NULL;
+        ch->who_cache = tmp;
+        ch->who_capacity = N;
+    }
+    ch->who_cache->txt_type = TXT_WHO;
+    ch->who_cache->txt_nusernames = (int)ch->nmembers;
+    memcpy(ch->who_cache->txt_channel, ch->name, CHANNEL_MAX);
+    for (long i = 0L; i < ch->nmembers; i++)
+        memcpy(ch->who_cache->txt_users[i].us_username, users[ch->members[i]]->username, USERNAME_MAX);
+    ch->who_version = ch->version;
+    return ch->who_cache;
+}
+
+/*
+ * Returns the index of the first entry whose first `len' bytes compare
+ * greater than (upper != 0) or not less than (upper == 0) those of `key'.
+ */
+long list_cache_bound(const char *key, size_t len, int upper) {
+    long lo = 0L, hi = list_cache->txt_nchannels;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        int c = strncmp(list_cache->txt_channels[mid].ch_channel, key, len);
+        if (c < 0 || (upper && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// returns 1 if successful, 0 if out of memory
+int list_cache_add(const char *name) {
+    long n = list_cache->txt_nchannels, i;
+    if (n == list_capacity) {
+        long N = 2 * list_capacity;
+        struct text_list *tmp = realloc(list_cache, LIST_BYTES(N));
+        if (tmp == NULL)
+            return 0;
+        list_cache = tmp;
+        list_capacity = N;
+    }
+    i = list_cache_bound(name, CHANNEL_MAX, 0);
+    memmove(&list_cache->txt_channels[i + 1], &list_cache->txt_channels[i], (n - i) * sizeof(struct channel_info));
+    memcpy(list_cache->txt_channels[i].ch_channel, name, CHANNEL_MAX);
+    list_cache->txt_nchannels++;
+    return 1;
+}
+
+void list_cache_remove(const char *name) {
+    long n = list_cache->txt_nchannels;
+    long i = list_cache_bound(name, CHANNEL_MAX, 0);
+    if (i < n && strncmp(list_cache->txt_channels[i].ch_channel, name, CHANNEL_MAX) == 0) {
+        memmove(&list_cache->txt_channels[i], &list_cache->txt_channels[i + 1], (n - i - 1) * sizeof(struct channel_info));
+        list_cache->txt_nchannels--;
+    }
+}
+
+// returns the new channel, or NULL if out of memory
+Channel *channel_create(const char *name) {
+    Channel *ch = malloc_channel(channel_slab, name);
+    if (ch == NULL)
+        return NULL;
+    if (!hm_put(channels, ch->name, ch, NULL)) {
+        free_channel(channel_slab, ch);
+        return NULL;
+    }
+    if (!list_cache_add(ch->name)) {
+        (void)hm_remove(channels, ch->name, (void **)&ch);
+        free_channel(channel_slab, ch);
+        return NULL;
+    }
+    return ch;
+}
+
+void history_record(Channel *ch, const char *username, const char *text) {
+    HistoryRecord *r;
+
+    if (history_depth == 0UL)
+        return;
+    if (ch->history == NULL &&
+        posix_memalign((void **)&ch->history, SLAB_CACHELINE, history_depth * sizeof(HistoryRecord)) != 0) {
+        ch->history = NULL;
+        return;
+    }
+    r = &ch->history[ch->history_next++ & (history_depth - 1)];
+    memcpy(r->username, username, USERNAME_MAX);
+    memcpy(r->text, text, SAY_MAX);
+}
+
+// starts loading the record the channel's next say will overwrite
+void history_prefetch(Channel *ch) {
+    if (ch->history != NULL) {
+        char *r = (char *)&ch->history[ch->history_next & (history_depth - 1)];
+        __builtin_prefetch(r, 1);
+        __builtin_prefetch(r + sizeof(HistoryRecord) - 1, 1);
+    }
+}
+
+// returns the number of the oldest record still in the channel's ring
+unsigned long history_oldest(Channel *ch) {
+    return (ch->history_next > history_depth) ? ch->history_next - history_depth : 0UL;
+}
+
+/*
+ * Encodes the records from `*next' on into one datagram in the session's
+ * encoding, at most PAGE_BYTES_MAX bytes, and moves `*next' past them.
+ * Returns the datagram's length, or 0 once every record has been sent.
+ */
+size_t history_encode(Channel *ch, unsigned long *next, unsigned char caps, unsigned char *buf) {
+    HistoryRecord *r;
+
+    if (*next >= ch->history_next)
+        return 0;
+    if (caps & CAP_V2) {
+        WireWriter w;
+        wire_writer_init(&w, buf, PAGE_BYTES_MAX);
+        for (; *next < ch->history_next; (*next)++) {
+            r = &ch->history[*next & (history_depth - 1)];
+            if (!wire_put(&w, WIRE_TEXT, TXT_SAY, ch->name, (size_t)CHANNEL_MAX, r->username,
+                          (size_t)USERNAME_MAX, r->text, (size_t)SAY_MAX))
+                break;
+        }
+        return wire_len(&w);
+    }
+    if (caps & CAP_BATCH) {
+        struct text_batch *b = (struct text_batch *)buf;
+        b->txt_type = TXT_BATCH;
+        for (b->txt_nrecords = 0; *next < ch->history_next && b->txt_nrecords < (int)BATCH_RECORDS_MAX; (*next)++) {
+            struct say_record *rec = &b->txt_records[b->txt_nrecords++];
+            r = &ch->history[*next & (history_depth - 1)];
+            memcpy(rec->rec_channel, ch->name, CHANNEL_MAX);
+            memcpy(rec->rec_username, r->username, USERNAME_MAX);
+            memcpy(rec->rec_text, r->text, SAY_MAX);
+        }
+        return BATCH_BYTES(b->txt_nrecords);
+    }
+    struct text_say *say = (struct text_say *)buf;
+    r = &ch->history[(*next)++ & (history_depth - 1)];
+    say->txt_type = TXT_SAY;
+    memcpy(say->txt_channel, ch->name, CHANNEL_MAX);
+    memcpy(say->txt_username, r->username, USERNAME_MAX);
+    memcpy(say->txt_text, r->text, SAY_MAX);
+    return sizeof(*say);
+}
+
+/*
+ * Fan-out to a channel too large to send to inline goes to the pool, which
+ * reads the recipients from an immutable snapshot of the channel's members:
+ * their addresses and encodings, and apart from those the ids of members
+ * that take batches, which only the dispatch loop may touch.  The snapshot
+ * is built by the first say after a join or leave and published in the
+ * channel with an atomic swap, so a run of says to a settled channel costs
+ * the loop O(1) each plus its batch appends, and a join storm rebuilds
+ * nothing until someone speaks.  A job pins the epoch while the pool reads
+ * the snapshot it was given; a replaced snapshot is retired and freed once
+ * no job that could hold it is left.  A member whose datagram is still with
+ * the pool skips the egress queue, and with it the per-session bound.
+ */
+struct member_snap {
+    EpochNode node;
+    unsigned long version; /* the channel's version it was built at */
+    long n; /* recipients the pool sends to */
+    long nbatch; /* CAP_BATCH members */
+    struct sockaddr_in *addrs;
+    unsigned char *which; /* encoding per recipient */
+    int *batch_ids;
+};
+
+void snap_destroy(EpochNode *node) {
+    free(node);
+}
+
+void snap_unpin(void *epoch) {
+    ep_unpin(snap_epochs, (unsigned long)(uintptr_t)epoch);
+}
+
+// unpublishes the channel's snapshot and hands it to the epochs
+void channel_snap_retire(Channel *ch) {
+    MemberSnap *old = atomic_exchange(&ch->snap, NULL);
+    if (old != NULL)
+        ep_retire(snap_epochs, &old->node, snap_destroy);
+}
+
+// returns a snapshot of the channel's current members, or NULL if out of memory
+MemberSnap *channel_snapshot(Channel *ch) {
+    MemberSnap *s = atomic_load_explicit(&ch->snap, memory_order_relaxed);
+    long i, nbatch = 0L;
+    char *mem;
+
+    if (s != NULL && s->version == ch->version)
+        return s;
+    for (i = 0L; i < ch->nmembers; i++)
+        if (session_caps[ch->members[i]] & CAP_BATCH)
+            nbatch++;
+    mem = malloc(sizeof(MemberSnap) + (ch->nmembers - nbatch) * sizeof(struct sockaddr_in) +
+                 nbatch * sizeof(int) + (ch->nmembers - nbatch));
+    if (mem == NULL)
+        return NULL;
+    s = (MemberSnap *)mem;
+    s->version = ch->version;
+    s->n = s->nbatch = 0L;
+    s->addrs = (struct sockaddr_in *)(s + 1);
+    s->batch_ids = (int *)(s->addrs + (ch->nmembers - nbatch));
+    s->which = (unsigned char *)(s->batch_ids + nbatch);
+    for (i = 0L; i < ch->nmembers; i++) {
+        int id = ch->members[i];
+        if (session_caps[id] & CAP_BATCH) {
+            s->batch_ids[s->nbatch++] = id;
+        } else {
+            s->addrs[s->n] = session_addrs[id];
+            s->which[s->n++] = (session_caps[id] & CAP_V2) ? 1 : 0;
+        }
+    }
+    channel_snap_retire(ch);
+    atomic_store_explicit(&ch->snap, s, memory_order_release);
+    return s;
+}
+
+// drops the channel once its last member is gone, unless it is the default
+void channel_release_if_empty(Channel *ch) {
+    if (ch->nmembers == 0L && strcmp(ch->name, DEFAULT_CHANNEL)) {
+        list_cache_remove(ch->name);
+        (void)hm_remove(channels, ch->name, (void **)&ch);
+        printf("Removed the empty channel %s\n", ch->name);
+        channel_snap_retire(ch);
+        free_channel(channel_slab, ch);
+    }
+}
+
+User *malloc_user(const char *name, struct sockaddr_in *addr) {
+
+    User *new_user = (User *)slab_alloc(user_slab);
+
+    if (new_user != NULL) {
+        new_user->id = session_alloc_id(new_user, addr);
+        if (new_user->id < 0) {
+            slab_free(user_slab, new_user);
+            return NULL;
+        }
+        memset(new_user->username, 0, sizeof(new_user->username));
+        strncpy(new_user->username, name, (USERNAME_MAX - 1));
+        new_user->channels = NULL;
+        new_user->batch = NULL;
+        bucket_init(&new_user->says, say_limits.session_burst);
+        new_user->notice_stamp = new_user->says.stamp - THROTTLE_NOTICE_MS;
+    }
+
+    return new_user;    
+}
+
+// sends whatever the user's batch holds and returns it to the slab
+void batch_flush(User *user) {
+    Batch *b = user->batch;
+    if (b == NULL)
+        return;
+    (void)eg_send(egress, user->id, USER_ADDR(user), &b->packet, b->len);
+    dirty_batches[b->dirty_index] = dirty_batches[--ndirty_batches];
+    dirty_batches[b->dirty_index]->dirty_index = b->dirty_index;
+    user->batch = NULL;
+    slab_free(batch_slab, b);
+}
+
+long long batch_wait_usec(void) {
+    long long wait;
+    if (ndirty_batches == 0)
+        return -1LL;
+    wait = batch_deadline - monotonic_usec();
+    return (wait > 0LL) ? wait : 0LL;
+}
+
+/*
+ * All batches pending at the deadline go out together: the deadline was set
+ * by the oldest of them, so none waits longer than BATCH_FLUSH_USEC.
+ */
+void batch_flush_due(void) {
+    if (ndirty_batches == 0 || monotonic_usec() < batch_deadline)
+        return;
+    while (ndirty_batches > 0)
+        batch_flush(session_users[dirty_batches[0]->id]);
+}
+
+/*
+ * Queues a say for the user, starting a batch if none is pending; `v2' is
+ * the say's v2 message (without WIRE_MAGIC), used if the user is CAP_V2.
+ * Returns 0 if no batch could be allocated, in which case the caller sends
+ * directly.
+ */
+int batch_append(User *user, const struct text_say *msg, const unsigned char *v2, size_t v2len) {
+    Batch *b = user->batch;
+    if (b != NULL && USER_V2(user) && b->len + v2len > sizeof(b->packet))
+        batch_flush(user);
+    if ((b = user->batch) == NULL) {
+        if (ndirty_batches == dirty_capacity) {
+            int N = (dirty_capacity > 0) ? 2 * dirty_capacity : 256;
+            Batch **tmp = realloc(dirty_batches, N * sizeof(Batch *));
+            if (tmp == NULL)
+                return 0;
+            dirty_batches = tmp;
+            dirty_capacity = N;
+        }
+        if ((b = (Batch *)slab_alloc(batch_slab)) == NULL)
+            return 0;
+        b->id = user->id;
+        if (USER_V2(user)) {
+            b->packet.bytes[0] = WIRE_MAGIC;
+            b->len = 1;
+        } else {
+            b->packet.v1.txt_type = TXT_BATCH;
+            b->packet.v1.txt_nrecords = 0;
+            b->len = BATCH_BYTES(0);
+        }
+        if (ndirty_batches == 0)
+            batch_deadline = monotonic_usec() + BATCH_FLUSH_USEC;
+        b->dirty_index = ndirty_batches;
+        dirty_batches[ndirty_batches++] = b;
+        user->batch = b;
+    }
+    if (USER_V2(user)) {
+        memcpy(&b->packet.bytes[b->len], v2, v2len);
+        b->len += v2len;
+        return 1;
+    }
+    memcpy(&b->packet.v1.txt_records[b->packet.v1.txt_nrecords++], msg->txt_channel, sizeof(struct say_record));
+    b->len += sizeof(struct say_record);
+    if (b->packet.v1.txt_nrecords == BATCH_RECORDS_MAX)
+        batch_flush(user);
+    return 1;
+}
+
+void free_user(User *user) {
+    Membership *m;
+
+    batch_flush(user);
+    while ((m = user->channels) != NULL) {
+        user->channels = m->next;
+        slab_free(membership_slab, m);
+    }
+    session_release_id(user->id);
+    slab_free(user_slab, user);
+}
+
+User *server_find_user(struct sockaddr_in *addr) {
+    int id = am_get(users, addr);
+    return (id < 0) ? NULL : session_users[id];
+}
+
+/*
+ * Sends a say to every member of the channel.  The send vector is built by
+ * a linear scan of the packed id array, pointing each message header
+ * straight at the member's slot in session_addrs[]; members that take
+ * batches get the say appended to their pending batch instead, and in a
+ * reliable channel the members with a reliable channel end get it sent
+ * through that, which keeps such channels off the pool.  The say is encoded
+ * once per encoding, and each member gets the one it speaks.
+ */
+void server_fanout_parallel(Channel *ch, struct text_say *msg, struct iovec *iov) {
+    MemberSnap *s;
+    FanJob *job;
+    unsigned long epoch;
+    long i;
+
+    if ((s = channel_snapshot(ch)) == NULL)
+        return;
+    for (i = 0L; i < s->nbatch; i++) {
+        int id = s->batch_ids[i];
+        if (!batch_append(session_users[id], msg, (unsigned char *)iov[1].iov_base + 1, iov[1].iov_len - 1))
+            (void)eg_sendv(egress, id, &session_addrs[id], &iov[(session_caps[id] & CAP_V2) ? 1 : 0], 1);
+    }
+    epoch = ep_pin(snap_epochs);
+    job = fp_job_shared(iov[0].iov_base, iov[0].iov_len, iov[1].iov_base, iov[1].iov_len,
+                        s->addrs, s->which, s->n, snap_unpin, (void *)(uintptr_t)epoch);
+    if (job == NULL) {
+        ep_unpin(snap_epochs, epoch);
+        return;
+    }
+    fp_submit(fanpool, job, s->n);
+}
+
+void server_fanout(Channel *ch, struct text_say *msg) {
+    struct mmsghdr msgs[FANOUT_BATCH];
+    int ids[FANOUT_BATCH];
+    struct iovec iov[2];
+    unsigned char v2[sizeof(struct text_say) + 8];
+    WireWriter w;
+    long i = 0L;
+
+    wire_writer_init(&w, v2, sizeof(v2));
+    (void)wire_put(&w, WIRE_TEXT, TXT_SAY, msg->txt_channel, (size_t)CHANNEL_MAX,
+                   msg->txt_username, (size_t)USERNAME_MAX, msg->txt_text, (size_t)SAY_MAX);
+    iov[0].iov_base = msg;
+    iov[0].iov_len = sizeof(*msg);
+    iov[1].iov_base = v2;
+    iov[1].iov_len = wire_len(&w);
+    if (fanpool != NULL && ch->nmembers >= fanout_policy.threshold && !ch->reliable) {
+        server_fanout_parallel(ch, msg, iov);
+        return;
+    }
+    while (i < ch->nmembers) {
+        int n = 0;
+        for (; i < ch->nmembers && n < FANOUT_BATCH; i++) {
+            if (i + PREFETCH_AHEAD < ch->nmembers)
+                __builtin_prefetch(&session_addrs[ch->members[i + PREFETCH_AHEAD]]);
+            unsigned char caps = session_caps[ch->members[i]];
+            if (ch->reliable && session_rel[ch->members[i]] != NULL) {
+                struct iovec *v = &iov[(caps & CAP_V2) ? 1 : 0];
+                session_send(ch->members[i], &session_addrs[ch->members[i]], v->iov_base, v->iov_len);
+                continue;
+            }
+            if ((caps & CAP_BATCH) &&
+                batch_append(session_users[ch->members[i]], msg, v2 + 1, iov[1].iov_len - 1))
+                continue;
+            memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+            msgs[n].msg_hdr.msg_name = &session_addrs[ch->members[i]];
+            msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[n].msg_hdr.msg_iov = &iov[(caps & CAP_V2) ? 1 : 0];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            ids[n] = ch->members[i];
+            n++;
+        }
+        // once the socket is full, the rest go through the egress queue in order
+        for (int sent = 0; sent < n; ) {
+            int r = (eg_pending(egress) > 0L) ? -1 : sendmmsg(socket_fd, &msgs[sent], n - sent, MSG_DONTWAIT);
+            if (r <= 0) {
+                for (; sent < n; sent++)
+                    (void)eg_sendv(egress, ids[sent], msgs[sent].msg_hdr.msg_name, msgs[sent].msg_hdr.msg_iov, 1);
+                break;
+            }
+            sent += r;
+        }
+    }
+}
+
+void server_send_error(struct sockaddr_in *addr, char *msg) {
+    struct text_error error_packet;
+    int id = am_get(users, addr);
+
+    if (id >= 0 && (session_caps[id] & CAP_V2)) {
+        WireWriter w;
+        wire_writer_init(&w, wire_out, sizeof(wire_out));
+        (void)wire_put(&w, WIRE_TEXT, TXT_ERROR, msg, (size_t)(SAY_MAX - 1));
+        session_send(id, addr, wire_out, wire_len(&w));
+        return;
+    }
+    memset(&error_packet, 0, sizeof(error_packet));
+    error_packet.txt_type = TXT_ERROR;
+    strncpy(error_packet.txt_error, msg, (SAY_MAX - 1));
+    session_send(id, addr, &error_packet, sizeof(error_packet));
+}
+
+// sends the session its resumption token
+void server_send_token(User *user) {
+    struct text_token token_packet;
+    unsigned int gen = session_gens[user->id];
+
+    if (USER_V2(user)) {
+        WireWriter w;
+        wire_writer_init(&w, wire_out, sizeof(wire_out));
+        (void)wire_put(&w, WIRE_TEXT, TXT_TOKEN, (unsigned long)user->id, (unsigned long)gen,
+                       (unsigned long)token_mac(user->id, gen));
+        session_send(user->id, USER_ADDR(user), wire_out, wire_len(&w));
+        return;
+    }
+    token_packet.txt_type = TXT_TOKEN;
+    token_packet.txt_token.tok_id = user->id;
+    token_packet.txt_token.tok_generation = gen;
+    token_packet.txt_token.tok_mac = token_mac(user->id, gen);
+    session_send(user->id, USER_ADDR(user), &token_packet, sizeof(token_packet));
+}
+
+// tells a throttled sender its says are being dropped, at most once per THROTTLE_NOTICE_MS
+void server_throttle_notice(User *user, unsigned int now) {
+    if (now - user->notice_stamp < THROTTLE_NOTICE_MS)
+        return;
+    user->notice_stamp = now;
+    __atomic_fetch_add(&server_stats.throttle_notices, 1UL, __ATOMIC_RELAXED);
+    server_send_error(USER_ADDR(user), "You are sending too fast; says are being dropped.");
+}
+
+/*
+ * Hot channels.  Every admitted say is counted against its channel in two
+ * count-min sketches, one of says and one of the recipients it went to, and
+ * each estimate is offered to a top-k, all in fixed memory however many
+ * channels there are.  The counts cover windows of HOT_WINDOW_MS: when one
+ * ends, its top channels are kept as the report and the sketches start
+ * over.  A shard reports the says it admits, with the channel's size, to the
+ * dispatch thread, which owns the sketches.
+ */
+#define HOT_WIDTH 2048
+#define HOT_DEPTH 4
+#define HOT_K 10
+#define HOT_WINDOW_MS 10000
+
+typedef struct {
+    char name[CHANNEL_MAX];
+    unsigned long says;
+    unsigned long sends;
+} HotChannel;
+
+CountMin *say_counts = NULL, *send_counts = NULL;
+TopK *hot_by_says = NULL, *hot_by_sends = NULL;
+unsigned int hot_window_start = 0;
+HotChannel hot_report[2][HOT_K]; /* by says and by sends, of the last window */
+int hot_nreport[2] = { 0, 0 };
+unsigned int hot_report_ms = 0; /* length of that window, 0 if none yet */
+
+// copies a top-k out with both estimates of each of its channels
+int hot_collect(TopK *tk, HotChannel *out) {
+    TopKEntry top[HOT_K];
+    int i, n = topk_list(tk, top);
+
+    for (i = 0; i < n; i++) {
+        memset(out[i].name, 0, CHANNEL_MAX);
+        strncpy(out[i].name, top[i].key, (CHANNEL_MAX - 1));
+        out[i].says = cms_estimate(say_counts, top[i].key, CHANNEL_MAX);
+        out[i].sends = cms_estimate(send_counts, top[i].key, CHANNEL_MAX);
+    }
+    return n;
+}
+
+// ends the window if it is over, keeping its top channels as the report
+void hot_roll(unsigned int now) {
+    if (now - hot_window_start < HOT_WINDOW_MS)
+        return;
+    hot_nreport[0] = hot_collect(hot_by_says, hot_report[0]);
+    hot_nreport[1] = hot_collect(hot_by_sends, hot_report[1]);
+    hot_report_ms = now - hot_window_start;
+    cms_clear(say_counts);
+    cms_clear(send_counts);
+    topk_clear(hot_by_says);
+    topk_clear(hot_by_sends);
+    hot_window_start = now;
+}
+
+void hot_record(const char *channel, long recipients, unsigned int now) {
+    hot_roll(now);
+    topk_offer(hot_by_says, channel, CHANNEL_MAX, cms_add(say_counts, channel, CHANNEL_MAX, 1UL));
+    if (recipients > 0L)
+        topk_offer(hot_by_sends, channel, CHANNEL_MAX,
+                   cms_add(send_counts, channel, CHANNEL_MAX, (unsigned long)recipients));
+}
+
+void hot_print(FILE *out) {
+    static const char *by[2] = { "says", "recipient sends" };
+    HotChannel top[HOT_K];
+    unsigned int ms;
+    int k, i, n;
+
+    hot_roll(monotonic_msec());
+    for (k = 0; k < 2; k++) {
+        // before the first window ends, report the one under way
+        if (hot_report_ms > 0) {
+            ms = hot_report_ms;
+            n = hot_nreport[k];
+            memcpy(top, hot_report[k], n * sizeof(HotChannel));
+        } else {
+            ms = monotonic_msec() - hot_window_start;
+            n = hot_collect(k ? hot_by_sends : hot_by_says, top);
+        }
+        fprintf(out, "hot channels by %s over %.1f s:\n", by[k], ms / 1000.0);
+        for (i = 0; i < n; i++)
+            fprintf(out, "  %-31s %10.1f says/s %12.1f sends/s\n", top[i].name,
+                    top[i].says * 1000.0 / (ms ? ms : 1), top[i].sends * 1000.0 / (ms ? ms : 1));
+    }
+}
+
+// appends a say to the log, and says so on stderr when says start being lost
+void saylog_append(const char *channel, const char *username, const char *text) {
+    int ok = sl_append(saylog, channel, username, text);
+
+    if (!ok && !saylog_failing)
+        fprintf(stderr, "Say log has no segment to append to; says are being lost\n");
+    else if (ok && saylog_failing)
+        fprintf(stderr, "Say log appending again\n");
+    saylog_failing = !ok;
+}
+
+/*
+ * Channel shards.  With shard_policy.shards set, every channel belongs to one
+ * shard thread, picked by hashing its name, and only that thread touches the
+ * channel's record, members and caches, so none of it is locked.  Sessions
+ * stay with the dispatch thread: it looks the sender up, admits a say against
+ * the session's bucket, and passes joins, leaves, says and WHOs to the owning
+ * shard over the shard's ring, with the session's id, address, caps and name
+ * copied in.  A shard keeps its own replica of each session it has heard
+ * from, indexed by id, so its fan-out walks shard-local columns just as the
+ * dispatch thread walks session_addrs[].  A logout is passed to every shard,
+ * behind anything already queued for that session, before its id is reused.
+ * Shards send straight to the socket and report over one multi-producer
+ * ring the channels they create or remove, the says they admit and the says
+ * they turn down.  The dispatch thread applies these to the LIST cache, the
+ * hot channel sketches and the say log, and gives a turned-down say's token
+ * back to its sender, before it handles the next batch of requests.  Says
+ * to sharded channels are not batched.
+ */
+#define SHARD_SLOTS 4096
+#define SHARD_BATCH 32 /* messages per ring_pop() */
+
+struct shard_policy shard_policy = { 0 };
+
+enum { SHARD_JOIN, SHARD_LEAVE, SHARD_SAY, SHARD_WHO, SHARD_WHO_PAGE, SHARD_HISTORY, SHARD_DROP, SHARD_REBIND };
+
+typedef struct {
+    int op;
+    int id;
+    int cursor;
+    int limit;
+    unsigned char caps;
+    struct sockaddr_in addr;
+    char username[USERNAME_MAX];
+    char channel[CHANNEL_MAX];
+    char text[SAY_MAX];
+} ShardMsg;
+
+enum { SHARD_CREATED, SHARD_REMOVED, SHARD_SAID, SHARD_REFUSED };
+
+typedef struct {
+    int kind;
+    int id; /* the sender, SHARD_REFUSED only */
+    int throttled; /* SHARD_REFUSED: by the channel's bucket, not for want of the channel */
+    char name[CHANNEL_MAX]; /* the channel */
+    char username[USERNAME_MAX]; /* the sender */
+    char text[SAY_MAX]; /* SHARD_SAID only */
+    long recipients; /* SHARD_SAID only */
+} ShardEvent;
+
+typedef struct {
+    pthread_t thread;
+    Ring *inbox; /* ShardMsg, from the dispatch thread */
+    int wake_fd; /* eventfd the dispatch thread writes when the shard sleeps */
+    atomic_int sleeping;
+    unsigned long posted; /* dispatch thread only */
+    atomic_ulong done; /* messages handled */
+    HashMap *channels;
+    Slab *user_slab;
+    Slab *channel_slab;
+    Slab *membership_slab;
+    User **users; /* session replicas by id */
+    struct sockaddr_in *addrs;
+    unsigned char *caps;
+    int capacity;
+    atomic_ulong sent;
+    atomic_ulong dropped; /* socket full */
+    unsigned char out[65507]; /* v2 replies */
+} Shard;
+
+Shard *shards = NULL;
+MpscRing *shard_events = NULL; /* ShardEvent, from every shard */
+int wake_fd = -1; /* eventfd the receive thread and the shards write when the handlers sleep */
+atomic_int handlers_sleeping = 0;
+
+// FNV-1a of the channel name
+int shard_of(const char *channel) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < CHANNEL_MAX && channel[i] != '\0'; i++)
+        h = (h ^ (unsigned char)channel[i]) * 16777619u;
+    return (int)(h % (unsigned int)shard_policy.shards);
+}
+
+// gives the sender back the token of a say its shard turned down, and tells
+// it if the channel's bucket was the reason
+void shard_refused(const ShardEvent *ev, unsigned int now) {
+    User *user;
+
+    if (ev->throttled)
+        server_stats.says_throttled_channel++;
+    // the session may have gone, and its id been reused, since the say
+    if (ev->id >= session_next || (user = session_users[ev->id]) == NULL ||
+        strncmp(user->username, ev->username, USERNAME_MAX) != 0)
+        return;
+    if (say_limits.session_rate > 0 && user->says.tokens < say_limits.session_burst * 1000)
+        user->says.tokens += 1000;
+    if (ev->throttled)
+        server_throttle_notice(user, now);
+}
+
+// brings the LIST cache up to date with the channels the shards created and
+// removed, counts and logs the says they admitted and refunds those they did not
+void shard_apply_events(void) {
+    ShardEvent ev[64];
+    unsigned int now;
+    long i, n;
+
+    if (shard_events == NULL)
+        return;
+    while ((n = mpsc_pop(shard_events, ev, 64L)) > 0L) {
+        now = monotonic_msec();
+        for (i = 0L; i < n; i++) {
+            switch (ev[i].kind) {
+                case SHARD_CREATED: (void)list_cache_add(ev[i].name); break;
+                case SHARD_REMOVED: list_cache_remove(ev[i].name); break;
+                case SHARD_REFUSED: shard_refused(&ev[i], now); break;
+                default:
+                    hot_record(ev[i].name, ev[i].recipients, now);
+                    if (saylog != NULL)
+                        saylog_append(ev[i].name, ev[i].username, ev[i].text);
+                    break;
+            }
+        }
+    }
+}
+
+/*
+ * Queues a message for the shard and wakes it if it is asleep.  A say finding
+ * the ring full is shed; anything else waits for room, since a lost join,
+ * leave or logout would leave the shard's view of the session wrong.
+ */
+void shard_post(Shard *sh, const ShardMsg *msg) {
+    while (ring_push(sh->inbox, msg, 1L) == 0L) {
+        if (msg->op == SHARD_SAY) {
+            __atomic_fetch_add(&server_stats.says_shed, 1UL, __ATOMIC_RELAXED);
+            return;
+        }
+        // a shard may be waiting on the event ring in turn
+        shard_apply_events();
+        sched_yield();
+    }
+    sh->posted++;
+    // pairs with the fence in shard_main(): either the shard sees the message
+    // or this thread sees it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sh->sleeping) && atomic_exchange(&sh->sleeping, 0)) {
+        uint64_t one = 1;
+        (void)write(sh->wake_fd, &one, sizeof(one));
+    }
+}
+
+void shard_forward(int op, User *user, const char *channel, const char *text, int cursor, int limit) {
+    ShardMsg msg;
+
+    msg.op = op;
+    msg.id = user->id;
+    msg.cursor = cursor;
+    msg.limit = limit;
+    msg.caps = session_caps[user->id];
+    msg.addr = *USER_ADDR(user);
+    memcpy(msg.username, user->username, USERNAME_MAX);
+    memcpy(msg.channel, channel, CHANNEL_MAX);
+    memset(msg.text, 0, SAY_MAX);
+    if (text != NULL)
+        strncpy(msg.text, text, (SAY_MAX - 1));
+    shard_post(&shards[shard_of(channel)], &msg);
+}
+
+// tells every shard the session is gone
+void shard_drop(int id) {
+    ShardMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op = SHARD_DROP;
+    msg.id = id;
+    for (int i = 0; i < shard_policy.shards; i++)
+        shard_post(&shards[i], &msg);
+}
+
+// tells every shard the session has moved to a new address
+void shard_rebind(int id) {
+    ShardMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op = SHARD_REBIND;
+    msg.id = id;
+    msg.addr = session_addrs[id];
+    for (int i = 0; i < shard_policy.shards; i++)
+        shard_post(&shards[i], &msg);
+}
+
+void server_login_request(char *packet, size_t len, struct sockaddr_in *addr) {
+
+    struct request_login *login_packet = (struct request_login *) packet;
+    char name[USERNAME_MAX];
+    memset(name, 0, sizeof(name));
+    strncpy(name, login_packet->req_username, (USERNAME_MAX - 1));
+
+    // a second login from the same address replaces the first session
+    if (server_find_user(addr) != NULL)
+        server_logout_request(addr);
+
+    User *user = malloc_user(name, addr);
+    if(user == NULL || !am_put(users, user->id)){
+        server_send_error(addr, "Failed to log into the server.");
+        if (user != NULL)
+            free_user(user);
+        return;
+    }
+    if (len >= sizeof(struct request_login_caps))
+        session_caps[user->id] = (unsigned char)((struct request_login_caps *) packet)->req_caps;
+
+    printf("%s logged in to the chat\n", user->username);
+    if (session_caps[user->id] & CAP_RESUME)
+        server_send_token(user);
+    return;
+    
+}
+
+/*
+ * Moves the session a token names to the address it is presented from.  The
+ * memberships stay as they are: only the session's address changes, in
+ * session_addrs[], the users index and the shards' replicas, and the fan-out
+ * snapshots of its channels, which hold addresses, are dropped to be rebuilt.
+ * A session already at the new address is logged out first, as by a login,
+ * and a reliable channel end is left behind with the old address.
+ */
+void server_resume_request(const char *packet, struct sockaddr_in *addr) {
+
+    const struct request_resume *resume_packet = (const struct request_resume *) packet;
+    struct sockaddr_in old;
+    User *user;
+    int id;
+
+    if ((id = token_session(&resume_packet->req_token)) < 0) {
+        server_send_error(addr, "Session expired; log in again.");
+        return;
+    }
+    user = session_users[id];
+    old = session_addrs[id];
+    if (old.sin_addr.s_addr != addr->sin_addr.s_addr || old.sin_port != addr->sin_port) {
+        if (server_find_user(addr) != NULL)
+            server_logout_request(addr);
+        (void)am_remove(users, &old);
+        session_addrs[id] = *addr;
+        if (!am_put(users, id)) {
+            // put it back where it was; the slot it had is still free
+            session_addrs[id] = old;
+            (void)am_put(users, id);
+            server_send_error(addr, "Failed to resume the session.");
+            return;
+        }
+        rel_detach(id);
+        if (shards != NULL)
+            shard_rebind(id);
+        for (Membership *m = user->channels; m != NULL; m = m->next)
+            channel_snap_retire(m->channel);
+    }
+    printf("%s resumed the session\n", user->username);
+    server_send_token(user);
+}
+
+void server_logout_request(struct sockaddr_in *addr) {
+
+    int id;
+    if ((id = am_remove(users, addr)) < 0)
+        return;
+    User *user = session_users[id];
+
+    printf("%s logged out\n", user->username);
+    if (shards != NULL)
+        shard_drop(id);
+
+    for (Membership *m = user->channels; m != NULL; m = m->next) {
+        channel_remove_member(m->channel, m);
+        channel_release_if_empty(m->channel);
+    }
+    free_user(user);
+}
+
+void server_join_request(char *packet, struct sockaddr_in *addr) {
+    
+    User *user;
+    Channel *ch = NULL;
+    Membership *m;
+    char channel[CHANNEL_MAX];
+    struct request_join *join_packet = (struct request_join *) packet;
+
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, join_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        shard_forward(SHARD_JOIN, user, channel, NULL, 0, 0);
+        return;
+    }
+
+    if (!hm_get(channels, channel, (void **)&ch)) {
+        if ((ch = channel_create(channel)) == NULL) {
+            server_send_error(USER_ADDR(user), "Failed to create the channel.");
+            return;
+        }
+        printf("%s created the channel %s\n", user->username, channel);
+    }
+
+    for (m = user->channels; m != NULL; m = m->next)
+        if (m->channel == ch)
+            break;
+    if (m == NULL) {
+        if ((m = (Membership *)slab_alloc(membership_slab)) == NULL ||
+            !channel_add_member(ch, m, user->id)) {
+            if (m != NULL)
+                slab_free(membership_slab, m);
+            channel_release_if_empty(ch);
+            server_send_error(USER_ADDR(user), "Failed to join the channel.");
+            return;
+        }
+        m->next = user->channels;
+        user->channels = m;
+    }
+    printf("%s joined the channel %s\n", user->username, channel);
+}
+
+void server_leave_request(char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    Channel *ch;
+    Membership **pm;
+    char channel[CHANNEL_MAX];
+    struct request_leave *leave_packet = (struct request_leave *) packet;
+
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, leave_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        shard_forward(SHARD_LEAVE, user, channel, NULL, 0, 0);
+        return;
+    }
+
+    if (!hm_get(channels, channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", channel);
+        server_send_error(USER_ADDR(user), "Channel you are trying to delete do not exist.\n");
+        return;
+    }
+
+    // unsubsribing user from this channel
+    for (pm = &user->channels; *pm != NULL; pm = &(*pm)->next) {
+        if ((*pm)->channel == ch) {
+            Membership *m = *pm;
+            *pm = m->next;
+            channel_remove_member(ch, m);
+            slab_free(membership_slab, m);
+            printf("%s left the channel %s\n", user->username, channel);
+            break;
+        }
+    }
+
+    channel_release_if_empty(ch);
+
+    return;
+}
+
+/*
+ * Bulk joins and leaves.  The session is looked up once for the whole
+ * request, every channel named is resolved against the channel table in
+ * one pass, and the session's membership list is walked once against a
+ * small open-addressed set of the channels named, rather than once per
+ * channel; a batch is logged as one line.  On shards each channel still
+ * goes to its own shard.
+ */
+#define MANY_SET_BITS 7
+#define MANY_SET_SLOTS (1 << MANY_SET_BITS) /* at least twice CHANNELS_MANY_MAX */
+
+typedef struct {
+    Channel *slot[MANY_SET_SLOTS];
+    int at[MANY_SET_SLOTS]; /* position of the channel in the request */
+} ManySet;
+
+_Static_assert(MANY_SET_SLOTS >= 2 * CHANNELS_MANY_MAX, "the set of a bulk request must stay at most half full");
+
+int many_set_slot(const ManySet *set, const Channel *ch) {
+    unsigned int i = (unsigned int)((uintptr_t)ch >> 6) * 0x9E3779B1u >> (32 - MANY_SET_BITS);
+    while (set->slot[i] != NULL && set->slot[i] != ch)
+        i = (i + 1) & (MANY_SET_SLOTS - 1);
+    return (int)i;
+}
+
+// returns 1 if the channel was added, 0 if the request named it already
+int many_set_add(ManySet *set, Channel *ch, int at) {
+    int i = many_set_slot(set, ch);
+    if (set->slot[i] != NULL)
+        return 0;
+    set->slot[i] = ch;
+    set->at[i] = at;
+    return 1;
+}
+
+// returns the position of the channel in the request, or -1 if it is not in it
+int many_set_find(const ManySet *set, const Channel *ch) {
+    int i = many_set_slot(set, ch);
+    return (set->slot[i] != NULL) ? set->at[i] : -1;
+}
+
+// copies out the channel names of a bulk request `len' bytes long; returns how many
+int many_names(const char *packet, size_t len, char names[][CHANNEL_MAX]) {
+    const struct request_channels *req = (const struct request_channels *) packet;
+    long n, fit;
+
+    if (len < sizeof(*req))
+        return 0;
+    n = req->req_nchannels;
+    fit = (long)((len - sizeof(*req)) / sizeof(struct channel_info));
+    if (n > fit)
+        n = fit;
+    if (n > CHANNELS_MANY_MAX)
+        n = CHANNELS_MANY_MAX;
+    for (long i = 0L; i < n; i++) {
+        memcpy(names[i], req->req_channels[i].ch_channel, CHANNEL_MAX);
+        names[i][CHANNEL_MAX - 1] = '\0';
+    }
+    return (n > 0L) ? (int)n : 0;
+}
+
+// returns 1 if names[i] came earlier in the request, for the shards path, which keeps no set
+int many_repeated(char names[][CHANNEL_MAX], int i) {
+    for (int j = 0; j < i; j++)
+        if (!strcmp(names[j], names[i]))
+            return 1;
+    return 0;
+}
+
+void server_join_many_request(const char *packet, size_t len, struct sockaddr_in *addr) {
+
+    User *user;
+    char names[CHANNELS_MANY_MAX][CHANNEL_MAX];
+    Channel *chs[CHANNELS_MANY_MAX];
+    ManySet set;
+    int i, n, joined = 0, created = 0, failed = 0;
+
+    if ((user = server_find_user(addr)) == NULL || (n = many_names(packet, len, names)) == 0)
+        return;
+    if (shards != NULL) {
+        for (i = 0; i < n; i++)
+            if (!many_repeated(names, i))
+                shard_forward(SHARD_JOIN, user, names[i], NULL, 0, 0);
+        return;
+    }
+
+    // resolve every name, creating what is missing; a repeated name counts once
+    memset(set.slot, 0, sizeof(set.slot));
+    for (i = 0; i < n; i++) {
+        if (!hm_get(channels, names[i], (void **)&chs[i])) {
+            if ((chs[i] = channel_create(names[i])) == NULL) {
+                failed++;
+                continue;
+            }
+            created++;
+        }
+        if (!many_set_add(&set, chs[i], i))
+            chs[i] = NULL;
+        else
+            joined++;
+    }
+    // and leave out the channels the session is in already
+    for (Membership *m = user->channels; m != NULL; m = m->next)
+        if ((i = many_set_find(&set, m->channel)) >= 0) {
+            chs[i] = NULL;
+            joined--;
+        }
+
+    for (i = 0; i < n; i++) {
+        Membership *m;
+        if (chs[i] == NULL)
+            continue;
+        if ((m = (Membership *)slab_alloc(membership_slab)) == NULL ||
+            !channel_add_member(chs[i], m, user->id)) {
+            if (m != NULL)
+                slab_free(membership_slab, m);
+            channel_release_if_empty(chs[i]);
+            failed++;
+            joined--;
+            continue;
+        }
+        m->next = user->channels;
+        user->channels = m;
+    }
+    if (failed > 0)
+        server_send_error(USER_ADDR(user), "Failed to join some of the channels.");
+    printf("%s joined %d channels, %d of them new\n", user->username, joined, created);
+}
+
+void server_leave_many_request(const char *packet, size_t len, struct sockaddr_in *addr) {
+
+    User *user;
+    char names[CHANNELS_MANY_MAX][CHANNEL_MAX];
+    Channel *chs[CHANNELS_MANY_MAX];
+    Membership **pm;
+    ManySet set;
+    int i, n, left = 0, missing = 0;
+
+    if ((user = server_find_user(addr)) == NULL || (n = many_names(packet, len, names)) == 0)
+        return;
+    if (shards != NULL) {
+        for (i = 0; i < n; i++)
+            if (!many_repeated(names, i))
+                shard_forward(SHARD_LEAVE, user, names[i], NULL, 0, 0);
+        return;
+    }
+
+    memset(set.slot, 0, sizeof(set.slot));
+    for (i = 0; i < n; i++) {
+        if (!hm_get(channels, names[i], (void **)&chs[i])) {
+            chs[i] = NULL;
+            missing++;
+        } else if (!many_set_add(&set, chs[i], i)) {
+            chs[i] = NULL;
+        }
+    }
+    for (pm = &user->channels; *pm != NULL; ) {
+        Membership *m = *pm;
+        if (many_set_find(&set, m->channel) < 0) {
+            pm = &m->next;
+            continue;
+        }
+        *pm = m->next;
+        channel_remove_member(m->channel, m);
+        slab_free(membership_slab, m);
+        left++;
+    }
+    // only once every membership is gone may a channel go with it
+    for (i = 0; i < n; i++)
+        if (chs[i] != NULL)
+            channel_release_if_empty(chs[i]);
+    if (missing > 0)
+        server_send_error(USER_ADDR(user), "Channel you are trying to delete do not exist.\n");
+    printf("%s left %d channels\n", user->username, left);
+}
+
+void server_say_request(char *packet, struct sockaddr_in *addr) {
+    
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    struct request_say *say_packet = (struct request_say *) packet;
+    struct text_say msg_packet;
+    char channel[CHANNEL_MAX];
+    unsigned int now = monotonic_msec();
+    
+    bucket_refill(&user->says, say_limits.session_rate, say_limits.session_burst, now);
+    if (!bucket_ready(&user->says, say_limits.session_rate)) {
+        server_stats.says_throttled_session++;
+        server_throttle_notice(user, now);
+        return;
+    }
+
+    Channel *ch;
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, say_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        // the channel's bucket is the shard's to check; the session's token
+        // comes back if the shard turns the say down
+        if (say_limits.session_rate > 0)
+            user->says.tokens -= 1000;
+        // the shard reports the say back, to be counted and logged, once it
+        // has admitted it
+        shard_forward(SHARD_SAY, user, channel, say_packet->req_text, 0, 0);
+        return;
+    }
+    if (!hm_get(channels, channel, (void **)&ch))
+        return;
+    history_prefetch(ch);
+
+    bucket_refill(&ch->says, say_limits.channel_rate, say_limits.channel_burst, now);
+    if (!bucket_ready(&ch->says, say_limits.channel_rate)) {
+        server_stats.says_throttled_channel++;
+        server_throttle_notice(user, now);
+        return;
+    }
+    // charged only once both have admitted the say
+    if (say_limits.session_rate > 0)
+        user->says.tokens -= 1000;
+    if (say_limits.channel_rate > 0)
+        ch->says.tokens -= 1000;
+
+    memset(&msg_packet, 0, sizeof(msg_packet));
+    msg_packet.txt_type = TXT_SAY;
+    strncpy(msg_packet.txt_channel, channel, (CHANNEL_MAX - 1));
+    strncpy(msg_packet.txt_username, user->username, (USERNAME_MAX - 1));
+    strncpy(msg_packet.txt_text, say_packet->req_text, (SAY_MAX - 1));
+
+    hot_record(channel, ch->nmembers, now);
+    server_fanout(ch, &msg_packet);
+    history_record(ch, msg_packet.txt_username, msg_packet.txt_text);
+    if (saylog != NULL)
+        saylog_append(msg_packet.txt_channel, msg_packet.txt_username, msg_packet.txt_text);
+
+    printf("[%s][%s]: \"%s\"\n", msg_packet.txt_channel, user->username, msg_packet.txt_text);
+}
+
+void server_saylog_sync(void) {
+    if (saylog != NULL)
+        sl_sync(saylog);
+}
+
+/*
+ * Encodes `n' names as a v2 list reply of `type' into `buf' and returns its
+ * length.  A reply too big for one datagram is cut down to the names that
+ * fit; it still carries the total, so the client can page through the rest.
+ */
+size_t encode_names_v2(unsigned char *buf, size_t cap, int type, long total, long cursor, const char *channel, const char *names, size_t stride, long n) {
+    WireWriter w;
+
+    do {
+        wire_writer_init(&w, buf, cap);
+        if (wire_put_list(&w, type, total, cursor, channel, names, stride, n))
+            break;
+        n /= 2;
+    } while (n > 0L);
+    return wire_len(&w);
+}
+
+void send_names_v2(User *user, int type, long total, long cursor, const char *channel, const char *names, size_t stride, long n) {
+    // an envelope around the reply must still fit a datagram
+    size_t cap = sizeof(wire_out) - ((session_rel[user->id] != NULL) ? sizeof(struct rel_header) : 0);
+    size_t len = encode_names_v2(wire_out, cap, type, total, cursor, channel, names, stride, n);
+    session_send(user->id, USER_ADDR(user), wire_out, len);
+}
+
+void server_list_request(struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    if (USER_V2(user))
+        send_names_v2(user, TXT_LIST, list_cache->txt_nchannels, 0L, NULL, list_cache->txt_channels[0].ch_channel, sizeof(struct channel_info), list_cache->txt_nchannels);
+    else
+        session_send(user->id, USER_ADDR(user), list_cache, LIST_BYTES(list_cache->txt_nchannels));
+    printf("%s listed available channels on server\n", user->username);
+    return;
+}
+
+void server_who_request(const char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    Channel *ch;
+    char channel[CHANNEL_MAX];
+    struct text_who *send_packet = NULL;
+    struct request_who *who_packet = (struct request_who *) packet;
+
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, who_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        shard_forward(SHARD_WHO, user, channel, NULL, 0, 0);
+        return;
+    }
+    if (!hm_get(channels, channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", channel);
+        server_send_error(USER_ADDR(user), "Channel does not exist.\n");
+        return;
+    }
+
+    if ((send_packet = channel_who(ch, session_users)) == NULL) {
+        server_send_error(USER_ADDR(user), "Failed to list the channel.");
+        return;
+    }
+
+    if (USER_V2(user))
+        send_names_v2(user, TXT_WHO, send_packet->txt_nusernames, 0L, ch->name, send_packet->txt_users[0].us_username, sizeof(struct user_info), send_packet->txt_nusernames);
+    else
+        session_send(user->id, USER_ADDR(user), send_packet, WHO_BYTES(send_packet->txt_nusernames));
+    printf("%s listed all users on channel %s\n", user->username, channel);
+    return;
+}
+
+/*
+ * Clamps a page request to [0, total] and to at most `max' entries; returns
+ * the number of entries in the page and its first index in `*start'.
+ */
+long page_span(int cursor, int limit, long total, long max, long *start) {
+    long n;
+    *start = (cursor < 0) ? 0L : ((cursor > total) ? total : cursor);
+    n = (limit <= 0 || limit > max) ? max : limit;
+    return (total - *start < n) ? total - *start : n;
+}
+
+/*
+ * Sends a page header followed by a slice of a cached reply, gathering the
+ * two straight from where they live; for a reliable session, which keeps a
+ * copy until it is acknowledged, they are gathered into rel_gather first.
+ */
+void send_page(User *user, void *header, size_t hlen, void *entries, size_t elen) {
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = entries;
+    iov[1].iov_len = elen;
+    if (session_rel[user->id] != NULL && hlen + elen <= sizeof(rel_gather)) {
+        memcpy(rel_gather, header, hlen);
+        memcpy(rel_gather + hlen, entries, elen);
+        session_send(user->id, USER_ADDR(user), rel_gather, hlen + elen);
+        return;
+    }
+    (void)eg_sendv(egress, user->id, USER_ADDR(user), iov, 2);
+}
+
+void server_list_page_request(const char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    struct request_list_page *page_packet = (struct request_list_page *) packet;
+    struct text_list_page header;
+    long start, n;
+
+    n = page_span(page_packet->req_cursor, page_packet->req_limit, list_cache->txt_nchannels, LIST_PAGE_MAX, &start);
+    header.txt_type = TXT_LIST_PAGE;
+    header.txt_total = list_cache->txt_nchannels;
+    header.txt_cursor = (int)start;
+    header.txt_nchannels = (int)n;
+
+    if (USER_V2(user))
+        send_names_v2(user, TXT_LIST_PAGE, header.txt_total, start, NULL, list_cache->txt_channels[start].ch_channel, sizeof(struct channel_info), n);
+    else
+        send_page(user, &header, sizeof(header), &list_cache->txt_channels[start], n * sizeof(struct channel_info));
+    printf("%s listed channels %ld-%ld of %d\n", user->username, start, start + n, header.txt_total);
+}
+
+void server_list_prefix_request(const char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    struct request_list_prefix *prefix_packet = (struct request_list_prefix *) packet;
+    struct text_list_page header;
+    char prefix[CHANNEL_MAX];
+    long first, last, start, n;
+    size_t len;
+
+    memset(prefix, 0, sizeof(prefix));
+    strncpy(prefix, prefix_packet->req_prefix, (CHANNEL_MAX - 1));
+    len = strlen(prefix);
+
+    // matches are the contiguous run of entries that start with the prefix
+    first = list_cache_bound(prefix, len, 0);
+    last = list_cache_bound(prefix, len, 1);
+
+    n = page_span(prefix_packet->req_cursor, prefix_packet->req_limit, last - first, LIST_PAGE_MAX, &start);
+    header.txt_type = TXT_LIST_PAGE;
+    header.txt_total = (int)(last - first);
+    header.txt_cursor = (int)start;
+    header.txt_nchannels = (int)n;
+
+    if (USER_V2(user))
+        send_names_v2(user, TXT_LIST_PAGE, header.txt_total, start, NULL, list_cache->txt_channels[first + start].ch_channel, sizeof(struct channel_info), n);
+    else
+        send_page(user, &header, sizeof(header), &list_cache->txt_channels[first + start], n * sizeof(struct channel_info));
+    printf("%s listed channels %ld-%ld of %d starting with %s\n", user->username, start, start + n, header.txt_total, prefix);
+}
+
+void server_who_page_request(const char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    Channel *ch;
+    char channel[CHANNEL_MAX];
+    struct request_who_page *page_packet = (struct request_who_page *) packet;
+    struct text_who *who;
+    struct text_who_page header;
+    long start, n;
+
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, page_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        shard_forward(SHARD_WHO_PAGE, user, channel, NULL, page_packet->req_cursor, page_packet->req_limit);
+        return;
+    }
+    if (!hm_get(channels, channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", channel);
+        server_send_error(USER_ADDR(user), "Channel does not exist.\n");
+        return;
+    }
+    if ((who = channel_who(ch, session_users)) == NULL) {
+        server_send_error(USER_ADDR(user), "Failed to list the channel.");
+        return;
+    }
+
+    n = page_span(page_packet->req_cursor, page_packet->req_limit, who->txt_nusernames, WHO_PAGE_MAX, &start);
+    header.txt_type = TXT_WHO_PAGE;
+    header.txt_total = who->txt_nusernames;
+    header.txt_cursor = (int)start;
+    header.txt_nusernames = (int)n;
+    memcpy(header.txt_channel, ch->name, CHANNEL_MAX);
+
+    if (USER_V2(user))
+        send_names_v2(user, TXT_WHO_PAGE, header.txt_total, start, ch->name, who->txt_users[start].us_username, sizeof(struct user_info), n);
+    else
+        send_page(user, &header, sizeof(header), &who->txt_users[start], n * sizeof(struct user_info));
+    printf("%s listed users %ld-%ld of %d on channel %s\n", user->username, start, start + n, header.txt_total, channel);
+}
+
+void server_history_request(const char *packet, struct sockaddr_in *addr) {
+
+    User *user;
+    if ((user = server_find_user(addr)) == NULL)
+        return;
+
+    Channel *ch;
+    char channel[CHANNEL_MAX];
+    struct request_history *history_packet = (struct request_history *) packet;
+    unsigned long next;
+    size_t len;
+
+    memset(channel, 0, sizeof(channel));
+    strncpy(channel, history_packet->req_channel, (CHANNEL_MAX - 1));
+    if (shards != NULL) {
+        shard_forward(SHARD_HISTORY, user, channel, NULL, 0, 0);
+        return;
+    }
+    if (!hm_get(channels, channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", channel);
+        server_send_error(USER_ADDR(user), "Channel does not exist.\n");
+        return;
+    }
+    batch_flush(user); // keeps the replay behind says already waiting for the user
+    for (next = history_oldest(ch); (len = history_encode(ch, &next, session_caps[user->id], wire_out)) > 0; )
+        session_send(user->id, USER_ADDR(user), wire_out, len);
+    printf("%s read the history of channel %s\n", user->username, channel);
+}
+
+/*
+ * The shard side.  Everything below runs on a shard's own thread and touches
+ * only that shard's state, the socket, and the two rings.
+ */
+
+// returns the shard's replica of the message's session, creating it if need be
+User *shard_session(Shard *sh, const ShardMsg *msg) {
+    User *user;
+
+    if (msg->id >= sh->capacity) {
+        int N = (sh->capacity > 0) ? 2 * sh->capacity : 1024;
+        while (N <= msg->id)
+            N *= 2;
+        User **u = realloc(sh->users, N * sizeof(*u));
+        if (u == NULL)
+            return NULL;
+        sh->users = u;
+        memset(&sh->users[sh->capacity], 0, (N - sh->capacity) * sizeof(*u));
+        struct sockaddr_in *a = realloc(sh->addrs, N * sizeof(*a));
+        if (a == NULL)
+            return NULL;
+        sh->addrs = a;
+        unsigned char *c = realloc(sh->caps, N * sizeof(*c));
+        if (c == NULL)
+            return NULL;
+        sh->caps = c;
+        sh->capacity = N;
+    }
+    if ((user = sh->users[msg->id]) == NULL) {
+        if ((user = (User *)slab_alloc(sh->user_slab)) == NULL)
+            return NULL;
+        memcpy(user->username, msg->username, USERNAME_MAX);
+        user->channels = NULL;
+        user->batch = NULL;
+        user->id = msg->id;
+        bucket_init(&user->says, 0);
+        sh->users[msg->id] = user;
+    }
+    sh->addrs[msg->id] = msg->addr;
+    sh->caps[msg->id] = msg->caps;
+    return user;
+}
+
+void shard_sendv(Shard *sh, int id, struct iovec *iov, int iovcnt) {
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &sh->addrs[id];
+    hdr.msg_namelen = sizeof(struct sockaddr_in);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovcnt;
+    if (sendmsg(socket_fd, &hdr, MSG_DONTWAIT) < 0)
+        atomic_fetch_add_explicit(&sh->dropped, 1UL, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&sh->sent, 1UL, memory_order_relaxed);
+}
+
+void shard_send(Shard *sh, int id, void *buf, size_t len) {
+    struct iovec iov = { buf, len };
+    shard_sendv(sh, id, &iov, 1);
+}
+
+void shard_send_error(Shard *sh, int id, char *msg) {
+    struct text_error error_packet;
+
+    if (sh->caps[id] & CAP_V2) {
+        WireWriter w;
+        wire_writer_init(&w, sh->out, sizeof(sh->out));
+        (void)wire_put(&w, WIRE_TEXT, TXT_ERROR, msg, (size_t)(SAY_MAX - 1));
+        shard_send(sh, id, sh->out, wire_len(&w));
+        return;
+    }
+    memset(&error_packet, 0, sizeof(error_packet));
+    error_packet.txt_type = TXT_ERROR;
+    strncpy(error_packet.txt_error, msg, (SAY_MAX - 1));
+    shard_send(sh, id, &error_packet, sizeof(error_packet));
+}
+
+void shard_event_post(const ShardEvent *ev) {
+    while (mpsc_push(shard_events, ev, 1L) == 0L)
+        sched_yield();
+}
+
+// tells the dispatch thread a channel came or went, for the LIST cache
+void shard_event(int kind, const char *name) {
+    ShardEvent ev;
+
+    ev.kind = kind;
+    memcpy(ev.name, name, CHANNEL_MAX);
+    shard_event_post(&ev);
+}
+
+Channel *shard_channel_create(Shard *sh, const char *name) {
+    Channel *ch = malloc_channel(sh->channel_slab, name);
+    if (ch == NULL)
+        return NULL;
+    if (!hm_put(sh->channels, ch->name, ch, NULL)) {
+        free_channel(sh->channel_slab, ch);
+        return NULL;
+    }
+    shard_event(SHARD_CREATED, ch->name);
+    return ch;
+}
+
+void shard_channel_release_if_empty(Shard *sh, Channel *ch) {
+    if (ch->nmembers == 0L && strcmp(ch->name, DEFAULT_CHANNEL)) {
+        shard_event(SHARD_REMOVED, ch->name);
+        (void)hm_remove(sh->channels, ch->name, (void **)&ch);
+        printf("Removed the empty channel %s\n", ch->name);
+        free_channel(sh->channel_slab, ch);
+    }
+}
+
+void shard_join(Shard *sh, User *user, const ShardMsg *msg) {
+    Channel *ch = NULL;
+    Membership *m;
+
+    if (!hm_get(sh->channels, (char *)msg->channel, (void **)&ch)) {
+        if ((ch = shard_channel_create(sh, msg->channel)) == NULL) {
+            shard_send_error(sh, user->id, "Failed to create the channel.");
+            return;
+        }
+        printf("%s created the channel %s\n", user->username, msg->channel);
+    }
+    for (m = user->channels; m != NULL; m = m->next)
+        if (m->channel == ch)
+            break;
+    if (m == NULL) {
+        if ((m = (Membership *)slab_alloc(sh->membership_slab)) == NULL ||
+            !channel_add_member(ch, m, user->id)) {
+            if (m != NULL)
+                slab_free(sh->membership_slab, m);
+            shard_channel_release_if_empty(sh, ch);
+            shard_send_error(sh, user->id, "Failed to join the channel.");
+            return;
+        }
+        m->next = user->channels;
+        user->channels = m;
+    }
+    printf("%s joined the channel %s\n", user->username, msg->channel);
+}
+
+void shard_leave(Shard *sh, User *user, const ShardMsg *msg) {
+    Channel *ch;
+    Membership **pm;
+
+    if (!hm_get(sh->channels, (char *)msg->channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", msg->channel);
+        shard_send_error(sh, user->id, "Channel you are trying to delete do not exist.\n");
+        return;
+    }
+    for (pm = &user->channels; *pm != NULL; pm = &(*pm)->next) {
+        if ((*pm)->channel == ch) {
+            Membership *m = *pm;
+            *pm = m->next;
+            channel_remove_member(ch, m);
+            slab_free(sh->membership_slab, m);
+            printf("%s left the channel %s\n", user->username, msg->channel);
+            break;
+        }
+    }
+    shard_channel_release_if_empty(sh, ch);
+}
+
+// as server_fanout(), from the shard's columns and without batches or egress
+void shard_fanout(Shard *sh, Channel *ch, struct text_say *msg) {
+    struct mmsghdr msgs[FANOUT_BATCH];
+    struct iovec iov[2];
+    unsigned char v2[sizeof(struct text_say) + 8];
+    WireWriter w;
+    long i = 0L;
+
+    wire_writer_init(&w, v2, sizeof(v2));
+    (void)wire_put(&w, WIRE_TEXT, TXT_SAY, msg->txt_channel, (size_t)CHANNEL_MAX,
+                   msg->txt_username, (size_t)USERNAME_MAX, msg->txt_text, (size_t)SAY_MAX);
+    iov[0].iov_base = msg;
+    iov[0].iov_len = sizeof(*msg);
+    iov[1].iov_base = v2;
+    iov[1].iov_len = wire_len(&w);
+    while (i < ch->nmembers) {
+        int n = 0, r;
+        for (; i < ch->nmembers && n < FANOUT_BATCH; i++, n++) {
+            int id = ch->members[i];
+            memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+            msgs[n].msg_hdr.msg_name = &sh->addrs[id];
+            msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[n].msg_hdr.msg_iov = &iov[(sh->caps[id] & CAP_V2) ? 1 : 0];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        for (int sent = 0; sent < n; sent += r) {
+            if ((r = sendmmsg(socket_fd, &msgs[sent], n - sent, MSG_DONTWAIT)) <= 0) {
+                atomic_fetch_add_explicit(&sh->dropped, (unsigned long)(n - sent), memory_order_relaxed);
+                break;
+            }
+            atomic_fetch_add_explicit(&sh->sent, (unsigned long)r, memory_order_relaxed);
+        }
+    }
+}
+
+void shard_say(Shard *sh, User *user, const ShardMsg *msg) {
+    struct text_say msg_packet;
+    unsigned int now = monotonic_msec();
+    ShardEvent ev;
+    Channel *ch;
+
+    // the sender's bucket and notices are the dispatch thread's
+    ev.kind = SHARD_REFUSED;
+    ev.id = user->id;
+    memcpy(ev.name, msg->channel, CHANNEL_MAX);
+    memcpy(ev.username, user->username, USERNAME_MAX);
+    if (!hm_get(sh->channels, (char *)msg->channel, (void **)&ch)) {
+        ev.throttled = 0;
+        shard_event_post(&ev);
+        return;
+    }
+    bucket_refill(&ch->says, say_limits.channel_rate, say_limits.channel_burst, now);
+    if (!bucket_ready(&ch->says, say_limits.channel_rate)) {
+        ev.throttled = 1;
+        shard_event_post(&ev);
+        return;
+    }
+    if (say_limits.channel_rate > 0)
+        ch->says.tokens -= 1000;
+
+    memset(&msg_packet, 0, sizeof(msg_packet));
+    msg_packet.txt_type = TXT_SAY;
+    memcpy(msg_packet.txt_channel, msg->channel, CHANNEL_MAX);
+    memcpy(msg_packet.txt_username, user->username, USERNAME_MAX);
+    memcpy(msg_packet.txt_text, msg->text, SAY_MAX);
+
+    history_record(ch, msg_packet.txt_username, msg_packet.txt_text);
+    shard_fanout(sh, ch, &msg_packet);
+    // the sketches and the log have one writer, the dispatch thread
+    ev.kind = SHARD_SAID;
+    memcpy(ev.text, msg_packet.txt_text, SAY_MAX);
+    ev.recipients = ch->nmembers;
+    shard_event_post(&ev);
+
+    printf("[%s][%s]: \"%s\"\n", msg_packet.txt_channel, user->username, msg_packet.txt_text);
+}
+
+void shard_history(Shard *sh, User *user, const ShardMsg *msg) {
+    Channel *ch;
+    unsigned long next;
+    size_t len;
+
+    if (!hm_get(sh->channels, (char *)msg->channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", msg->channel);
+        shard_send_error(sh, user->id, "Channel does not exist.\n");
+        return;
+    }
+    for (next = history_oldest(ch); (len = history_encode(ch, &next, sh->caps[user->id], sh->out)) > 0; )
+        shard_send(sh, user->id, sh->out, len);
+    printf("%s read the history of channel %s\n", user->username, msg->channel);
+}
+
+// answers SHARD_WHO with the whole list, SHARD_WHO_PAGE with a page of it
+void shard_who(Shard *sh, User *user, const ShardMsg *msg) {
+    Channel *ch;
+    struct text_who *who;
+    struct text_who_page header;
+    struct iovec iov[2];
+    long start, n;
+
+    if (!hm_get(sh->channels, (char *)msg->channel, (void **)&ch)) {
+        printf("Channel named %s does not exist\n", msg->channel);
+        shard_send_error(sh, user->id, "Channel does not exist.\n");
+        return;
+    }
+    if ((who = channel_who(ch, sh->users)) == NULL) {
+        shard_send_error(sh, user->id, "Failed to list the channel.");
+        return;
+    }
+    if (msg->op == SHARD_WHO) {
+        if (sh->caps[user->id] & CAP_V2)
+            shard_send(sh, user->id, sh->out, encode_names_v2(sh->out, sizeof(sh->out), TXT_WHO, who->txt_nusernames, 0L, ch->name, who->txt_users[0].us_username, sizeof(struct user_info), who->txt_nusernames));
+        else
+            shard_send(sh, user->id, who, WHO_BYTES(who->txt_nusernames));
+        printf("%s listed all users on channel %s\n", user->username, msg->channel);
+        return;
+    }
+
+    n = page_span(msg->cursor, msg->limit, who->txt_nusernames, WHO_PAGE_MAX, &start);
+    header.txt_type = TXT_WHO_PAGE;
+    header.txt_total = who->txt_nusernames;
+    header.txt_cursor = (int)start;
+    header.txt_nusernames = (int)n;
+    memcpy(header.txt_channel, ch->name, CHANNEL_MAX);
+
+    if (sh->caps[user->id] & CAP_V2) {
+        shard_send(sh, user->id, sh->out, encode_names_v2(sh->out, sizeof(sh->out), TXT_WHO_PAGE, header.txt_total, start, ch->name, who->txt_users[start].us_username, sizeof(struct user_info), n));
+    } else {
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = &who->txt_users[start];
+        iov[1].iov_len = n * sizeof(struct user_info);
+        shard_sendv(sh, user->id, iov, 2);
+    }
+    printf("%s listed users %ld-%ld of %d on channel %s\n", user->username, start, start + n, header.txt_total, msg->channel);
+}
+
+// forgets a session that logged out, leaving every channel of this shard it was in
+void shard_drop_session(Shard *sh, int id) {
+    User *user;
+    Membership *m;
+
+    if (id >= sh->capacity || (user = sh->users[id]) == NULL)
+        return;
+    while ((m = user->channels) != NULL) {
+        user->channels = m->next;
+        channel_remove_member(m->channel, m);
+        shard_channel_release_if_empty(sh, m->channel);
+        slab_free(sh->membership_slab, m);
+    }
+    sh->users[id] = NULL;
+    slab_free(sh->user_slab, user);
+}
+
+void shard_handle(Shard *sh, const ShardMsg *msg) {
+    User *user;
+
+    if (msg->op == SHARD_DROP) {
+        shard_drop_session(sh, msg->id);
+        return;
+    }
+    if (msg->op == SHARD_REBIND) {
+        if (msg->id < sh->capacity && sh->users[msg->id] != NULL)
+            sh->addrs[msg->id] = msg->addr;
+        return;
+    }
+    if ((user = shard_session(sh, msg)) == NULL)
+        return;
+    switch (msg->op) {
+        case SHARD_JOIN: shard_join(sh, user, msg); break;
+        case SHARD_LEAVE: shard_leave(sh, user, msg); break;
+        case SHARD_SAY: shard_say(sh, user, msg); break;
+        case SHARD_HISTORY: shard_history(sh, user, msg); break;
+        default: shard_who(sh, user, msg); break;
+    }
+}
 
-User *malloc_user(const char *ip, const char *name, struct sockaddr_in *addr) {
+void *shard_main(void *arg) {
+    Shard *sh = (Shard *)arg;
+    ShardMsg msgs[SHARD_BATCH];
+    struct pollfd pfd = { sh->wake_fd, POLLIN, 0 };
+    uint64_t wakeups;
+    long i, n;
+
+    for (;;) {
+        if ((n = ring_pop(sh->inbox, msgs, SHARD_BATCH)) == 0L) {
+            // announce the sleep, then look again: see shard_post()
+            atomic_store(&sh->sleeping, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (ring_count(sh->inbox) == 0L && poll(&pfd, 1, -1) > 0)
+                (void)read(sh->wake_fd, &wakeups, sizeof(wakeups));
+            atomic_store(&sh->sleeping, 0);
+            continue;
+        }
+        for (i = 0L; i < n; i++)
+            shard_handle(sh, &msgs[i]);
+        atomic_fetch_add_explicit(&sh->done, (unsigned long)n, memory_order_release);
+        // pairs with the fence in server_poll(): either the handlers see the
+        // events or this thread sees them asleep
+        atomic_thread_fence(memory_order_seq_cst);
+        if (mpsc_count(shard_events) > 0L && atomic_load(&handlers_sleeping) &&
+            atomic_exchange(&handlers_sleeping, 0)) {
+            uint64_t one = 1;
+            (void)write(wake_fd, &one, sizeof(one));
+        }
+    }
+    return NULL;
+}
 
-    User *new_user = (User *)malloc(sizeof(User));
+// starts a thread with signals blocked, so they reach the main thread
+int thread_start(pthread_t *thread, void *(*fn)(void *), void *arg) {
+    sigset_t all, old;
+    int rc;
 
-    if (new_user != NULL) {
-        new_user->addr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-        new_user->ip_addr = (char *)malloc(strlen(ip) + 1);
-        new_user->username = (char *)malloc(strlen(name) + 1);
-        new_user->channels = ll_create();
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc == 0;
+}
 
-        *new_user->addr = *addr;
-        strcpy(new_user->ip_addr, ip);
-        strcpy(new_user->username, name);
+// returns 0 if successful, -1 if out of memory or threads
+int shards_create(void) {
+    Channel *default_ch;
+    int i;
+
+    if ((shards = calloc(shard_policy.shards, sizeof(Shard))) == NULL ||
+        (shard_events = mpsc_create(sizeof(ShardEvent), SHARD_SLOTS)) == NULL)
+        return -1;
+    for (i = 0; i < shard_policy.shards; i++) {
+        Shard *sh = &shards[i];
+        sh->inbox = ring_create(sizeof(ShardMsg), SHARD_SLOTS);
+        sh->wake_fd = eventfd(0, EFD_NONBLOCK);
+        sh->channels = hm_create(100L, 0.0f);
+        sh->user_slab = slab_create(sizeof(User), SLAB_CACHELINE, 0L);
+        sh->channel_slab = slab_create(sizeof(Channel), SLAB_CACHELINE, 0L);
+        sh->membership_slab = slab_create(sizeof(Membership), 0, 0L);
+        if (sh->inbox == NULL || sh->wake_fd < 0 || sh->channels == NULL ||
+            sh->user_slab == NULL || sh->channel_slab == NULL || sh->membership_slab == NULL)
+            return -1;
     }
-
-    return new_user;    
+    // the default channel lives on its shard like any other
+    if ((default_ch = shard_channel_create(&shards[shard_of(DEFAULT_CHANNEL)], DEFAULT_CHANNEL)) == NULL)
+        return -1;
+    shard_apply_events();
+    for (i = 0; i < shard_policy.shards; i++)
+        if (!thread_start(&shards[i].thread, shard_main, &shards[i]))
+            return -1;
+    return 0;
 }
 
-void free_user(User *user) {
-    free(user->addr);
-    free(user->ip_addr);
-    free(user->username);
-    ll_destroy(user->channels, free);
-    free(user);
+void server_shards_wait(void) {
+    for (int i = 0; i < shard_policy.shards && shards != NULL; i++)
+        while (atomic_load_explicit(&shards[i].done, memory_order_acquire) != shards[i].posted) {
+            shard_apply_events();
+            sched_yield();
+        }
+    shard_apply_events();
 }
 
-void server_send_error(struct sockaddr_in *addr, char *msg) {
-    struct text_error error_packet;
-    error_packet.txt_type = TXT_ERROR;
-    strncpy(error_packet.txt_error, msg, (SAY_MAX - 1));
-    sendto(socket_fd, &error_packet, sizeof(error_packet), 0, (struct sockaddr *)addr, sizeof(*addr));
+/*
+ * Decodes every message of a v2 datagram into its v1 request structure and
+ * hands it to the same handler a v1 datagram would reach.  A v2 login makes
+ * the session CAP_V2, whatever caps it lists.
+ */
+void server_dispatch_v2(const char *packet, size_t len, struct sockaddr_in *addr) {
+    union {
+        struct request_login_caps login;
+        struct request_join join;
+        struct request_leave leave;
+        struct request_say say;
+        struct request_who who;
+        struct request_list_page list_page;
+        struct request_who_page who_page;
+        struct request_list_prefix list_prefix;
+        struct request_history history;
+        struct request_resume resume;
+        struct {
+            struct request_channels header;
+            struct channel_info names[CHANNELS_MANY_MAX];
+        } many;
+    } req;
+    WireStr item;
+    WireReader r;
+    WireMsg m;
+
+    wire_reader_init(&r, packet, len);
+    while (wire_next(&r, WIRE_REQUEST, &m) == 1) {
+        if (!m.known)
+            continue;
+        memset(&req, 0, sizeof(req));
+        switch (m.type) {
+            case REQ_LOGIN:
+                req.login.req_type = REQ_LOGIN;
+                wire_str_copy(req.login.req_username, USERNAME_MAX, &m.str[0]);
+                req.login.req_caps = (int)m.num[0] | CAP_V2;
+                server_login_request((char *)&req, sizeof(req.login), addr);
+                break;
+            case REQ_LOGOUT:
+                server_logout_request(addr);
+                break;
+            case REQ_JOIN:
+                wire_str_copy(req.join.req_channel, CHANNEL_MAX, &m.str[0]);
+                server_join_request((char *)&req, addr);
+                break;
+            case REQ_LEAVE:
+                wire_str_copy(req.leave.req_channel, CHANNEL_MAX, &m.str[0]);
+                server_leave_request((char *)&req, addr);
+                break;
+            case REQ_SAY:
+                wire_str_copy(req.say.req_channel, CHANNEL_MAX, &m.str[0]);
+                wire_str_copy(req.say.req_text, SAY_MAX, &m.str[1]);
+                server_say_request((char *)&req, addr);
+                break;
+            case REQ_LIST:
+                server_list_request(addr);
+                break;
+            case REQ_WHO:
+                wire_str_copy(req.who.req_channel, CHANNEL_MAX, &m.str[0]);
+                server_who_request((char *)&req, addr);
+                break;
+            case REQ_LIST_PAGE:
+                req.list_page.req_cursor = (int)m.num[0];
+                req.list_page.req_limit = (int)m.num[1];
+                server_list_page_request((char *)&req, addr);
+                break;
+            case REQ_WHO_PAGE:
+                req.who_page.req_cursor = (int)m.num[0];
+                req.who_page.req_limit = (int)m.num[1];
+                wire_str_copy(req.who_page.req_channel, CHANNEL_MAX, &m.str[0]);
+                server_who_page_request((char *)&req, addr);
+                break;
+            case REQ_LIST_PREFIX:
+                req.list_prefix.req_cursor = (int)m.num[0];
+                req.list_prefix.req_limit = (int)m.num[1];
+                wire_str_copy(req.list_prefix.req_prefix, CHANNEL_MAX, &m.str[0]);
+                server_list_prefix_request((char *)&req, addr);
+                break;
+            case REQ_HISTORY:
+                wire_str_copy(req.history.req_channel, CHANNEL_MAX, &m.str[0]);
+                server_history_request((char *)&req, addr);
+                break;
+            case REQ_RESUME:
+                req.resume.req_token.tok_id = (int)m.num[0];
+                req.resume.req_token.tok_generation = (unsigned int)m.num[1];
+                req.resume.req_token.tok_mac = m.num[2];
+                server_resume_request((char *)&req, addr);
+                break;
+            case REQ_JOIN_MANY:
+            case REQ_LEAVE_MANY:
+                while (req.many.header.req_nchannels < CHANNELS_MANY_MAX && wire_next_item(&m, &item) == 1)
+                    wire_str_copy(req.many.names[req.many.header.req_nchannels++].ch_channel, CHANNEL_MAX, &item);
+                if (m.type == REQ_JOIN_MANY)
+                    server_join_many_request((char *)&req, sizeof(req.many), addr);
+                else
+                    server_leave_many_request((char *)&req, sizeof(req.many), addr);
+                break;
+            default:
+                break;
+        }
+    }
 }
 
-void server_login_request(char *packet, char *client_ip, struct sockaddr_in *addr) {
+// hands a reliable payload to its handler, padded as the receive thread pads a datagram
+void rel_deliver(const void *payload, size_t len, void *arg) {
+    char packet[sizeof(rel_gather)];
 
-    struct request_login *login_packet = (struct request_login *) packet;
-    char name[USERNAME_MAX];
-    strcpy(name, login_packet->req_username);
+    // an envelope inside an envelope is nothing a client sends
+    if (len > sizeof(packet) || rl_is_envelope(payload, len))
+        return;
+    memcpy(packet, payload, len);
+    if (len < sizeof(struct request_say))
+        memset(packet + len, 0, sizeof(struct request_say) - len);
+    server_dispatch(packet, len, (struct sockaddr_in *)arg);
+}
 
-    User *user = malloc_user(client_ip, name, addr);
-    if(user == NULL || !hm_put(users, client_ip, user, NULL)){
-        server_send_error(addr, "Failed to log into the server.");
-        if (user != NULL)
-            free_user(user);
+/*
+ * Takes in an envelope.  An address with no channel end gets a new one for
+ * it; whatever session the address has once its payloads are handled,
+ * perhaps one they logged in, keeps the channel end, and without a session
+ * it is dropped after acknowledging them.
+ */
+void server_reliable_request(char *packet, size_t len, struct sockaddr_in *addr) {
+    int id = am_get(users, addr);
+    Reliable *rl = (id >= 0) ? session_rel[id] : NULL;
+    RelPeer peer = { -1, addr };
+
+    if (rl == NULL && (rl = rl_create(RELIABLE_QUEUE)) == NULL)
+        return;
+    rel_delivering = rl;
+    rel_delivering_addr = addr;
+    (void)rl_receive(rl, packet, len, monotonic_usec(), rel_deliver, addr);
+    rel_delivering = NULL;
+    if ((id = am_get(users, addr)) >= 0 && session_rel[id] == NULL)
+        session_rel[id] = rl;
+    if (id >= 0 && session_rel[id] == rl) {
+        rel_mark_busy(id);
         return;
     }
-
-    printf("%s logged in to the chat\n", user->username);
-    return;
-    
+    rl_ack_now(rl, rel_output, &peer);
+    rl_destroy(rl);
 }
 
-void server_logout_request(char *client_ip) {
+void server_dispatch(char *packet, size_t len, struct sockaddr_in *addr) {
 
-    User *user;
-    if (!hm_remove(users, client_ip, (void **)&user))
+    if (rl_is_envelope(packet, len)) {
+        server_reliable_request(packet, len, addr);
+        return;
+    }
+    if (wire_is_v2(packet, len)) {
+        server_dispatch_v2(packet, len, addr);
         return;
+    }
+    switch (((struct request *) packet)->req_type) {
+        case REQ_LOGIN:
+            server_login_request(packet, len, addr);
+            break;
+        case REQ_LOGOUT:
+            server_logout_request(addr);
+            break;
+        case REQ_JOIN:
+            server_join_request(packet, addr);
+            break;
+        case REQ_LEAVE:
+            server_leave_request(packet, addr);
+            break;
+        case REQ_SAY:
+            server_say_request(packet, addr);
+            break;
+        case REQ_LIST:
+            server_list_request(addr);
+            break;
+        case REQ_WHO:
+            server_who_request(packet, addr);
+            break;
+        case REQ_LIST_PAGE:
+            server_list_page_request(packet, addr);
+            break;
+        case REQ_WHO_PAGE:
+            server_who_page_request(packet, addr);
+            break;
+        case REQ_LIST_PREFIX:
+            server_list_prefix_request(packet, addr);
+            break;
+        case REQ_HISTORY:
+            server_history_request(packet, addr);
+            break;
+        case REQ_RESUME:
+            server_resume_request(packet, addr);
+            break;
+        case REQ_JOIN_MANY:
+            server_join_many_request(packet, len, addr);
+            break;
+        case REQ_LEAVE_MANY:
+            server_leave_many_request(packet, len, addr);
+            break;
+        default:
+            break;
+    }
+}
 
-    printf("%s logged out\n", user->username);
+/*
+ * Ingress.  A receive thread does nothing but wait on the socket and move
+ * datagrams, with recvmmsg, into two lock-free rings: control, which is every
+ * request but a say, and bulk, which is says.  The handlers run on the main
+ * thread on the other side of the rings and always take queued control
+ * requests before queued says.  A say that has waited longer than the shed
+ * budget is dropped unhandled: under overload says are shed first, and the
+ * server spends its time on traffic that is still worth answering.  With
+ * priority off every request goes to the control ring in arrival order and
+ * nothing is shed.  A burst fills the rings instead of the socket buffer, so
+ * it is the rings' size, not SO_RCVBUF, that decides what the kernel drops.
+ */
+#define INGRESS_SLOTS 4096
+#define INGRESS_BATCH 64 /* datagrams per recvmmsg(), and per ring_pop() of control */
+#define SAY_BATCH 8 /* says per ring_pop(); control is looked for in between */
+#define PACKET_MAX (sizeof(struct rel_header) + PAGE_BYTES_MAX) /* a page-sized request in an envelope */
 
-    User *tmp;
-    LinkedList *u_list;
-    char *ch;
+struct ingress_policy ingress_policy = { 1, 50000LL };
+
+typedef struct {
+    long long arrival; /* monotonic usec */
+    struct sockaddr_in addr;
+    size_t len;
+    char data[PACKET_MAX];
+} Packet;
+
+Ring *control_ring = NULL, *bulk_ring = NULL;
+Packet *ingress_staging = NULL; /* INGRESS_BATCH datagrams, receive thread only */
+Packet *ingress_work = NULL; /* INGRESS_BATCH datagrams, handlers only */
+pthread_t receiver;
+int receiver_started = 0;
+int receiver_stop_fd = -1; /* eventfd that wakes the receive thread to stop */
+atomic_int receiver_stopping = 0;
+
+// returns 1 if a request of this datagram is a say, judging by its first one
+int packet_is_bulk(const char *data, size_t len) {
+    // an envelope goes by its payload, and one with none carries acknowledgements
+    if (rl_is_envelope(data, len))
+        return (data[1] & REL_DATA) &&
+               packet_is_bulk(data + sizeof(struct rel_header), len - sizeof(struct rel_header));
+    if (wire_is_v2(data, len)) {
+        WireReader r;
+        WireMsg m;
+        wire_reader_init(&r, data, len);
+        return wire_next(&r, WIRE_REQUEST, &m) == 1 && m.type == REQ_SAY;
+    }
+    return len >= sizeof(request_t) && ((struct request *) data)->req_type == REQ_SAY;
+}
 
-    while (ll_removeFirst(user->channels, (void **)&ch)) {
+// pushes packets [from, to) of the staging area; counts what does not fit
+void ingress_push(int bulk, int from, int to) {
+    long lost = (to - from) - ring_push(bulk ? bulk_ring : control_ring,
+                                        &ingress_staging[from], to - from);
+    if (lost > 0L)
+        __atomic_fetch_add(bulk ? &server_stats.says_shed : &server_stats.control_dropped,
+                           (unsigned long)lost, __ATOMIC_RELAXED);
+}
 
-        if (!hm_get(channels, ch, (void **)&u_list)) {
-            free(ch);
+void *receiver_main(void *arg UNUSED) {
+    struct mmsghdr msgs[INGRESS_BATCH];
+    struct iovec iov[INGRESS_BATCH];
+    struct pollfd pfd[2] = { { socket_fd, POLLIN, 0 }, { receiver_stop_fd, POLLIN, 0 } };
+    int i, n, run, bulk = 0;
+
+    while (!atomic_load(&receiver_stopping)) {
+        for (i = 0; i < INGRESS_BATCH; i++) {
+            iov[i].iov_base = ingress_staging[i].data;
+            iov[i].iov_len = PACKET_MAX;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &ingress_staging[i].addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // the socket is non-blocking for the senders' sake, so wait here
+        if ((n = recvmmsg(socket_fd, msgs, INGRESS_BATCH, MSG_DONTWAIT, NULL)) <= 0) {
+            (void)poll(pfd, 2, -1);
             continue;
         }
-
-        for (long i = 0L; i < ll_size(u_list); i++) {
-            (void)ll_get(u_list, i, (void **)&tmp);
-            if (strcmp(user->ip_addr, tmp->ip_addr) == 0) {
-                (void)ll_remove(u_list, i, (void **)&tmp);
+        long long now = monotonic_usec();
+        for (i = 0; i < n; i++) {
+            Packet *p = &ingress_staging[i];
+            p->arrival = now;
+            p->len = msgs[i].msg_len;
+            // the v1 handlers read whole structs, so a short datagram reads as zeroes
+            if (p->len < sizeof(struct request_say))
+                memset(p->data + p->len, 0, sizeof(struct request_say) - p->len);
+        }
+        // push runs of one class at a time, keeping arrival order within a class
+        for (run = 0, i = 0; i <= n; i++) {
+            int b = (i < n) && ingress_policy.priority &&
+                    packet_is_bulk(ingress_staging[i].data, ingress_staging[i].len);
+            if (i > run && (i == n || b != bulk)) {
+                ingress_push(bulk, run, i);
+                run = i;
             }
+            bulk = b;
         }
-
-        if (ll_isEmpty(u_list) && strcmp(ch, DEFAULT_CHANNEL)) {
-            (void)hm_remove(channels, ch, (void **)&u_list);
-            ll_destroy(u_list, NULL);
-            printf("Removed the empty channel %s\n", ch);
+        // pairs with the fence in server_poll(): either the handlers see the
+        // packets or this thread sees them asleep
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&handlers_sleeping, 0)) {
+            uint64_t one = 1;
+            (void)write(wake_fd, &one, sizeof(one));
         }
-        free(ch);
     }
-    free_user(user);
+    return NULL;
 }
 
-void server_join_request(char *packet, char *client_ip) {
-    
-    User *user, *tmp;
-    LinkedList *u_list = NULL;
-    int len;
-    long i;
-    char *channel_name = NULL;
-    struct request_join *join_packet = (struct request_join *) packet;
+// stops the receive thread between batches; server_poll() starts it again
+void receiver_stop(void) {
+    uint64_t one = 1, drained;
 
-    if (!hm_get(users, client_ip, (void **)&user))
+    if (!receiver_started)
         return;
+    atomic_store(&receiver_stopping, 1);
+    (void)write(receiver_stop_fd, &one, sizeof(one));
+    pthread_join(receiver, NULL);
+    (void)read(receiver_stop_fd, &drained, sizeof(drained));
+    atomic_store(&receiver_stopping, 0);
+    receiver_started = 0;
+}
 
-    if(strlen(join_packet->req_channel) > (CHANNEL_MAX - 1))
-        len = CHANNEL_MAX - 1;
-    else 
-        strlen(join_packet->req_channel);
-
-    channel_name = (char *)malloc(len + 1);
-    memcpy(channel_name, join_packet->req_channel, len);
-    channel_name[len] = '\0';
-
-    ll_add(user->channels, channel_name);
-
-    if (!hm_get(channels, channel_name, (void **)&u_list)) {
-        u_list = ll_create();
-        ll_add(u_list, user);
-        hm_put(channels, channel_name, u_list, NULL);
-        printf("%s created the channel %s\n", user->username, channel_name);
-    } else {
-        for (i = 0L; i < ll_size(u_list); i++) {
-            (void)ll_get(u_list, i, (void **)&tmp);
-            if (strcmp(user->ip_addr, tmp->ip_addr) == 0) {
-                printf("%s joined the channel %s\n", user->username, channel_name);
-                return;
+/*
+ * Handles all queued control requests, then says until control traffic
+ * turns up again.  Says are taken a few at a time, so a control request
+ * waits for at most the fan-out of SAY_BATCH says.
+ */
+void ingress_process(void) {
+    long i, n;
+
+    shard_apply_events();
+    while ((n = ring_pop(control_ring, ingress_work, INGRESS_BATCH)) > 0L)
+        for (i = 0L; i < n; i++)
+            server_dispatch(ingress_work[i].data, ingress_work[i].len, &ingress_work[i].addr);
+    while (ring_count(control_ring) == 0L &&
+           (n = ring_pop(bulk_ring, ingress_work, SAY_BATCH)) > 0L) {
+        shard_apply_events();
+        for (i = 0L; i < n; i++) {
+            Packet *p = &ingress_work[i];
+            if (monotonic_usec() - p->arrival > ingress_policy.shed_usec) {
+                __atomic_fetch_add(&server_stats.says_shed, 1UL, __ATOMIC_RELAXED);
+                continue;
             }
+            server_dispatch(p->data, p->len, &p->addr);
         }
-        ll_add(u_list, user);
-        printf("%s joined the channel %s\n", user->username, channel_name);
-        return;
     }
 }
 
-void server_leave_request(char *packet, char *client_ip) {
+void server_poll(void) {
+    struct timeval tv;
+    fd_set receiver_set, sender;
+    long long wait;
+    uint64_t wakeups;
+
+    if (!receiver_started) {
+        if (!thread_start(&receiver, receiver_main, NULL)) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        receiver_started = 1;
+    }
+    ingress_process();
+
+    // announce the sleep, then look again: the receive thread checks the flag
+    // after pushing, so a packet pushed in between is either seen or woken for
+    atomic_store(&handlers_sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    wait = (ring_count(control_ring) > 0L || ring_count(bulk_ring) > 0L ||
+            (shard_events != NULL && mpsc_count(shard_events) > 0L)) ? 0LL : batch_wait_usec();
+    if (nrel_busy > 0) {
+        long long rel_wait = rel_wait_usec();
+        if (rel_wait >= 0LL && (wait < 0LL || rel_wait < wait))
+            wait = rel_wait;
+    }
+    tv.tv_sec = (wait < 0) ? 300 : wait / 1000000;
+    tv.tv_usec = (wait < 0) ? 0 : wait % 1000000;
+
+    // with datagrams queued for sending, also wake up when the socket drains
+    FD_ZERO(&receiver_set);
+    FD_SET(wake_fd, &receiver_set);
+    FD_ZERO(&sender);
+    if (eg_pending(egress) > 0L)
+        FD_SET(socket_fd, &sender);
+    if (select(((wake_fd > socket_fd ? wake_fd : socket_fd) + 1), &receiver_set, &sender, NULL, &tv) > 0) {
+        if (FD_ISSET(socket_fd, &sender))
+            (void)eg_flush(egress);
+        if (FD_ISSET(wake_fd, &receiver_set))
+            (void)read(wake_fd, &wakeups, sizeof(wakeups));
+    }
+    atomic_store(&handlers_sleeping, 0);
+    ingress_process();
+    batch_flush_due();
+    rel_tick_due();
+    (void)ep_reclaim(snap_epochs);
+}
 
-    User *user, *tmp;
-    LinkedList *u_list;
-    long i;
-    char *ch;
-    char channel[CHANNEL_MAX];
-    struct request_leave *leave_packet = (struct request_leave *) packet;
+void server_fanout_wait(void) {
+    if (fanpool != NULL) {
+        fp_wait(fanpool);
+        // every job is done, so two steps free whatever was retired
+        (void)ep_reclaim(snap_epochs);
+        (void)ep_reclaim(snap_epochs);
+    }
+}
 
-    if (!hm_get(users, client_ip, (void **)&user))
-        return;
+void server_print_stats(FILE *out) {
+    // count what the shards have reported so far
+    shard_apply_events();
+    fprintf(out, "says throttled (session): %lu\n", server_stats.says_throttled_session);
+    fprintf(out, "says throttled (channel): %lu\n", server_stats.says_throttled_channel);
+    fprintf(out, "throttle notices sent:    %lu\n", server_stats.throttle_notices);
+    fprintf(out, "says shed:                %lu\n", server_stats.says_shed);
+    fprintf(out, "control requests dropped: %lu\n", server_stats.control_dropped);
+    fprintf(out, "sends queued:             %lu\n", eg_stats(egress)->queued);
+    fprintf(out, "sends dropped (behind):   %lu\n", eg_stats(egress)->droppedBehind);
+    fprintf(out, "sends dropped (full):     %lu\n", eg_stats(egress)->droppedFull);
+    fprintf(out, "sends dropped (logout):   %lu\n", eg_stats(egress)->droppedForgotten);
+    fprintf(out, "sends failed:             %lu\n", eg_stats(egress)->failed);
+    fprintf(out, "sends waiting:            %ld\n", eg_pending(egress));
+    if (fanpool != NULL) {
+        FanPoolStats fs = fp_stats(fanpool);
+        fprintf(out, "parallel fan-outs:        %lu\n", fs.jobs);
+        fprintf(out, "parallel sends:           %lu\n", fs.sent);
+        fprintf(out, "parallel sends dropped:   %lu\n", fs.dropped);
+        fprintf(out, "parallel sends failed:    %lu\n", fs.failed);
+        EpochStats es = ep_stats(snap_epochs);
+        fprintf(out, "member snapshots retired: %lu (%lu freed)\n", es.retired, es.reclaimed);
+    }
+    for (int i = 0; i < shard_policy.shards && shards != NULL; i++)
+        fprintf(out, "shard %-3d handled %lu, sent %lu, dropped %lu\n", i,
+                atomic_load(&shards[i].done), atomic_load(&shards[i].sent), atomic_load(&shards[i].dropped));
+    if (saylog != NULL) {
+        SayLogStats ls = sl_stats(saylog);
+        fprintf(out, "says logged:              %lu (%lu lost)\n", ls.appended, ls.failed);
+        fprintf(out, "says synced:              %lu in %lu syncs, longest %lld us, %lu segments\n",
+                ls.synced, ls.syncs, ls.syncMaxUsec, ls.segments);
+    }
+    ReliableStats rs, total;
+    long nrel = 0L;
+    memset(&total, 0, sizeof(total));
+    for (int id = 0; id < session_next; id++) {
+        if (session_rel[id] == NULL)
+            continue;
+        rs = rl_stats(session_rel[id]);
+        total.sent += rs.sent;
+        total.retransmitted += rs.retransmitted;
+        total.abandoned += rs.abandoned;
+        total.refused += rs.refused;
+        total.delivered += rs.delivered;
+        total.duplicates += rs.duplicates;
+        total.srttUsec += rs.srttUsec;
+        nrel++;
+    }
+    if (nrel > 0L) {
+        fprintf(out, "reliable sessions:        %ld (%d busy), mean srtt %lld us\n", nrel, nrel_busy,
+                total.srttUsec / nrel);
+        fprintf(out, "reliable sent:            %lu (%lu resent, %lu given up, %lu refused)\n",
+                total.sent, total.retransmitted, total.abandoned, total.refused);
+        fprintf(out, "reliable received:        %lu (%lu duplicates)\n", total.delivered, total.duplicates);
+    }
+    hot_print(out);
+    fflush(out);
+}
 
-    memset(channel, 0, sizeof(channel));
-    strncpy(channel, leave_packet->req_channel, (CHANNEL_MAX - 1));
+/*
+ * State snapshots.  The sessions and channels are written to one flat file
+ * that restore maps and copies from without parsing: a fixed header, then
+ * sections at 64-byte aligned offsets from the start of the file, each a
+ * plain array indexed by session id or channel number:
+ *
+ *   addrs     struct sockaddr_in per id      session_addrs[] as it is
+ *   caps      byte per id                    session_caps[] as it is
+ *   live      byte per id                    1 if logged in, 0 if free
+ *   names     USERNAME_MAX per id
+ *   channels  SnapChannel per channel        name, member count and the
+ *                                            offset of its members
+ *   members   int per membership             each channel's members[]
+ *   gens      unsigned int per id            session_gens[] as it is
+ *
+ * Ids keep their values, so the columns go back with one memcpy() each and
+ * the members arrays need no translation.  The file is written by a forked
+ * child every snapshot_policy.interval seconds, which sees the state as it
+ * was at the fork without holding up the loop, and synchronously on SIGTERM;
+ * either way it goes to a temporary file renamed over the old one, so a
+ * crash mid-write leaves the previous snapshot.  The format is that of the
+ * host that wrote it.  Channels on shards are not snapshotted.  Version 2
+ * added the resumption token key to the header and the gens section; a
+ * version 1 file still restores, and its sessions' tokens start over.
+ */
+#define SNAP_MAGIC "DUCKSNAP"
+#define SNAP_VERSION 2
+#define SNAP_V1_HEADER offsetof(SnapHeader, token_key)
+#define SNAP_ALIGN(n) (((n) + 63UL) & ~63UL)
 
-    if (!hm_get(channels, channel, (void **)&u_list)) {
-        printf("Channel named %s does not exist\n", leave_packet->req_channel);
-        server_send_error(user->addr, "Channel you are trying to delete do not exist.\n");
-        return;
-    }
+struct snapshot_policy snapshot_policy = { NULL, 60 };
 
-    // unsubsribing user from this channel
-    for (i = 0L; i < ll_size(user->channels); i++) {
-        (void)ll_get(user->channels, i, (void **)&ch);
-        if (strcmp(channel, ch) == 0) {
-            ll_remove(user->channels, i, (void **)&ch);
-            free(ch);
-            printf("%s left the channel %s\n", user->username, channel);
-            break;
-        }
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t file_bytes;
+    int64_t nsessions; /* ids 0 .. nsessions-1 */
+    int64_t nlive;
+    int64_t nchannels;
+    int64_t nmembers;
+    uint64_t addrs, caps, live, names, channels, members; /* section offsets */
+    uint64_t token_key[2]; /* from version 2 */
+    uint64_t gens;
+} SnapHeader;
+
+typedef struct {
+    char name[CHANNEL_MAX];
+    int64_t nmembers;
+    uint64_t members; /* offset of its first member */
+} SnapChannel;
+
+pid_t snap_writer = 0; /* forked writer still running, or 0 */
+long long snap_due = 0LL; /* monotonic usec of the next periodic snapshot */
+unsigned char snap_chunk[65536]; /* staging for derived sections; no malloc() in the writer */
+
+// writes all of buf, returns 1 if successful
+int snap_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+            return 0;
+        p += n;
+        len -= (size_t)n;
     }
+    return 1;
+}
 
-    for (i = 0L; i < ll_size(u_list); i++) {
-        (void)ll_get(u_list, i, (void **)&tmp);
-        if (strcmp(user->ip_addr, tmp->ip_addr) == 0) {
-            (void)ll_remove(u_list, i, (void **)&tmp);
-            break;
+// pads the file out to `offset', returns 1 if successful
+int snap_seek(int fd, uint64_t *at, uint64_t offset) {
+    static const char zeros[64];
+    int ok = snap_write(fd, zeros, offset - *at);
+    *at = offset;
+    return ok;
+}
+
+int snap_write_state(int fd) {
+    SnapHeader h;
+    uint64_t at = 0;
+    long i, n = list_cache->txt_nchannels, k;
+    Channel *ch;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.header_bytes = sizeof(h);
+    h.nsessions = session_next;
+    h.nlive = session_next - nfree_ids;
+    h.nchannels = n;
+    for (i = 0L; i < n; i++)
+        if (hm_get(channels, list_cache->txt_channels[i].ch_channel, (void **)&ch))
+            h.nmembers += ch->nmembers;
+    h.addrs = SNAP_ALIGN(sizeof(h));
+    h.caps = SNAP_ALIGN(h.addrs + h.nsessions * sizeof(struct sockaddr_in));
+    h.live = SNAP_ALIGN(h.caps + h.nsessions);
+    h.names = SNAP_ALIGN(h.live + h.nsessions);
+    h.channels = SNAP_ALIGN(h.names + h.nsessions * USERNAME_MAX);
+    h.members = SNAP_ALIGN(h.channels + h.nchannels * sizeof(SnapChannel));
+    h.gens = SNAP_ALIGN(h.members + h.nmembers * sizeof(int));
+    h.file_bytes = h.gens + h.nsessions * sizeof(unsigned int);
+    memcpy(h.token_key, token_key, sizeof(token_key));
+
+    if (!snap_write(fd, &h, sizeof(h)))
+        return 0;
+    at = sizeof(h);
+    if (!snap_seek(fd, &at, h.addrs) || !snap_write(fd, session_addrs, h.nsessions * sizeof(struct sockaddr_in)))
+        return 0;
+    at += h.nsessions * sizeof(struct sockaddr_in);
+    if (!snap_seek(fd, &at, h.caps) || !snap_write(fd, session_caps, h.nsessions))
+        return 0;
+    at += h.nsessions;
+    if (!snap_seek(fd, &at, h.live))
+        return 0;
+    for (i = 0L; i < h.nsessions; i += k) {
+        k = (h.nsessions - i < (long)sizeof(snap_chunk)) ? h.nsessions - i : (long)sizeof(snap_chunk);
+        for (long j = 0L; j < k; j++)
+            snap_chunk[j] = (session_users[i + j] != NULL);
+        if (!snap_write(fd, snap_chunk, k))
+            return 0;
+    }
+    at += h.nsessions;
+    if (!snap_seek(fd, &at, h.names))
+        return 0;
+    for (i = 0L; i < h.nsessions; i += k) {
+        k = (h.nsessions - i < (long)(sizeof(snap_chunk) / USERNAME_MAX)) ? h.nsessions - i : (long)(sizeof(snap_chunk) / USERNAME_MAX);
+        memset(snap_chunk, 0, k * USERNAME_MAX);
+        for (long j = 0L; j < k; j++)
+            if (session_users[i + j] != NULL)
+                memcpy(&snap_chunk[j * USERNAME_MAX], session_users[i + j]->username, USERNAME_MAX);
+        if (!snap_write(fd, snap_chunk, k * USERNAME_MAX))
+            return 0;
+    }
+    at += h.nsessions * USERNAME_MAX;
+    if (!snap_seek(fd, &at, h.channels))
+        return 0;
+    uint64_t members = h.members;
+    for (i = 0L; i < n; i += k) {
+        SnapChannel *rec = (SnapChannel *)snap_chunk;
+        k = (n - i < (long)(sizeof(snap_chunk) / sizeof(*rec))) ? n - i : (long)(sizeof(snap_chunk) / sizeof(*rec));
+        memset(rec, 0, k * sizeof(*rec));
+        for (long j = 0L; j < k; j++) {
+            memcpy(rec[j].name, list_cache->txt_channels[i + j].ch_channel, CHANNEL_MAX);
+            if (hm_get(channels, rec[j].name, (void **)&ch))
+                rec[j].nmembers = ch->nmembers;
+            rec[j].members = members;
+            members += rec[j].nmembers * sizeof(int);
         }
+        if (!snap_write(fd, rec, k * sizeof(*rec)))
+            return 0;
     }
+    at += n * sizeof(SnapChannel);
+    if (!snap_seek(fd, &at, h.members))
+        return 0;
+    for (i = 0L; i < n; i++)
+        if (hm_get(channels, list_cache->txt_channels[i].ch_channel, (void **)&ch) &&
+            !snap_write(fd, ch->members, ch->nmembers * sizeof(int)))
+            return 0;
+    at += h.nmembers * sizeof(int);
+    return snap_seek(fd, &at, h.gens) && snap_write(fd, session_gens, h.nsessions * sizeof(unsigned int));
+}
 
-    if (ll_isEmpty(u_list) && strcmp(channel, DEFAULT_CHANNEL)) {
-        (void)hm_remove(channels, channel, (void **)&u_list);
-        ll_destroy(u_list, NULL);
-        printf("Removed the empty channel %s\n", channel);
+int server_save_state(const char *path) {
+    static char tmp[4096];
+    int fd, ok;
+
+    if (shards != NULL || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+    ok = snap_write_state(fd) && fsync(fd) == 0;
+    if (close(fd) < 0 || !ok || rename(tmp, path) < 0) {
+        (void)unlink(tmp);
+        return -1;
     }
-
-    return;
+    return 0;
 }
 
-void server_say_request(char *packet, char *client_ip) {
-    
-    User *user;
-    long len;
-    if (!hm_get(users, client_ip, (void **)&user))
-        return;
+void server_snapshot_due(void) {
+    int status;
 
-    struct request_say *say_packet = (struct request_say *) packet;
-    struct text_say msg_packet;
-    
-    LinkedList *ch_users;
-    if (!hm_get(channels, say_packet->req_channel, (void **)&ch_users))
+    if (snap_writer > 0 && waitpid(snap_writer, &status, WNOHANG) == snap_writer) {
+        snap_writer = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            printf("Saved state to %s\n", snapshot_policy.path);
+        else
+            fprintf(stderr, "Failed to save state to %s\n", snapshot_policy.path);
+    }
+    if (snapshot_policy.path == NULL || snapshot_policy.interval <= 0 || shards != NULL ||
+        snap_writer > 0 || monotonic_usec() < snap_due)
         return;
+    snap_due = monotonic_usec() + snapshot_policy.interval * 1000000LL;
+    if ((snap_writer = fork()) == 0)
+        _exit(server_save_state(snapshot_policy.path) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    if (snap_writer < 0)
+        snap_writer = 0;
+}
 
-    User **listeners;
-    listeners = (User **)ll_toArray(ch_users, &len);
-
-    msg_packet.txt_type = TXT_SAY;
-    strncpy(msg_packet.txt_channel, say_packet->req_channel, (CHANNEL_MAX - 1));
-    strncpy(msg_packet.txt_username, user->username, (USERNAME_MAX - 1));
-    strncpy(msg_packet.txt_text, say_packet->req_text, (SAY_MAX - 1));
-
-    for (long i = 0L; i < len; i++)
-        sendto(socket_fd, &msg_packet, sizeof(msg_packet), 0, (struct sockaddr *)listeners[i]->addr, sizeof(*listeners[i]->addr));
-
-    printf("[%s][%s]: \"%s\"\n", msg_packet.txt_channel, user->username, msg_packet.txt_text);
+void server_snapshot_finish(void) {
+    int status;
 
-    free(listeners);
+    if (snap_writer > 0)
+        (void)waitpid(snap_writer, &status, 0);
+    snap_writer = 0;
 }
 
-void server_list_request(char *client_ip) {
-
-    User *user;
-    if (!hm_get(users, client_ip, (void **)&user))
-        return;
+// returns 1 if [offset, offset + len) lies within the file
+int snap_within(const SnapHeader *h, uint64_t offset, uint64_t len) {
+    return offset <= h->file_bytes && len <= h->file_bytes - offset;
+}
 
-    size_t nbytes;
-    long len = 0L;
-    char **channel_list = NULL;
-    struct text_list *list_packet = NULL;
+/*
+ * Loads the `size' bytes of snapshot at `base' into freshly initialised
+ * state; `from' names it in the log.  Returns the sessions restored, or -1.
+ */
+long snap_restore(const char *base, size_t size, const char *from) {
+    long long start = monotonic_usec();
+    SnapHeader h;
+    const SnapChannel *rec;
+    AddrMap *index;
+    unsigned int stamp;
+    long i, nlive = 0L;
+
+    if (shards != NULL || session_next > 0 || size < SNAP_V1_HEADER)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(&h, base, (size < sizeof(h)) ? size : sizeof(h));
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) ||
+        !((h.version == 1 && h.header_bytes == SNAP_V1_HEADER) ||
+          (h.version == SNAP_VERSION && h.header_bytes == sizeof(h))) || h.file_bytes != (uint64_t)size ||
+        h.nsessions < 0 || h.nsessions > INT_MAX || h.nchannels < 0 || h.nmembers < 0 ||
+        (uint64_t)h.nchannels > h.file_bytes || (uint64_t)h.nmembers > h.file_bytes ||
+        !snap_within(&h, h.addrs, h.nsessions * sizeof(struct sockaddr_in)) ||
+        !snap_within(&h, h.caps, h.nsessions) || !snap_within(&h, h.live, h.nsessions) ||
+        !snap_within(&h, h.names, h.nsessions * USERNAME_MAX) ||
+        !snap_within(&h, h.channels, h.nchannels * sizeof(SnapChannel)) ||
+        !snap_within(&h, h.members, h.nmembers * sizeof(int)) ||
+        (h.version > 1 && !snap_within(&h, h.gens, h.nsessions * sizeof(unsigned int))))
+        return -1;
+    rec = (const SnapChannel *)(base + h.channels);
+    for (i = 0L; i < h.nchannels; i++)
+        if (rec[i].nmembers < 0 || (uint64_t)rec[i].nmembers > h.file_bytes || rec[i].members < h.members ||
+            !snap_within(&h, rec[i].members, rec[i].nmembers * sizeof(int)))
+            return -1;
+
+    // sessions: the columns as they were, then a record and an index entry
+    // per live id, in id order so the records come off the slab in order
+    if (!session_reserve((int)h.nsessions))
+        return -1;
+    memcpy(session_addrs, base + h.addrs, h.nsessions * sizeof(struct sockaddr_in));
+    memcpy(session_caps, base + h.caps, h.nsessions);
+    if (h.version > 1) {
+        memcpy(session_gens, base + h.gens, h.nsessions * sizeof(unsigned int));
+        memcpy(token_key, h.token_key, sizeof(token_key));
+    }
+    if ((index = am_create(2 * h.nlive, &session_addrs)) == NULL)
+        return -1;
+    am_destroy(users);
+    users = index;
+    stamp = monotonic_msec();
+    for (i = 0L; i < h.nsessions; i++) {
+        User *user = NULL;
+        if (i + PREFETCH_AHEAD < h.nsessions)
+            am_prefetch(users, &session_addrs[i + PREFETCH_AHEAD]);
+        session_users[i] = NULL;
+        session_rel[i] = NULL;
+        session_busy[i] = 0;
+        if (base[h.live + i] && am_get(users, &session_addrs[i]) < 0 &&
+            (user = (User *)slab_alloc(user_slab)) != NULL) {
+            memcpy(user->username, base + h.names + i * USERNAME_MAX, USERNAME_MAX);
+            user->username[USERNAME_MAX - 1] = '\0';
+            user->channels = NULL;
+            user->batch = NULL;
+            user->id = (int)i;
+            user->says.tokens = say_limits.session_burst * 1000;
+            user->says.stamp = stamp;
+            user->notice_stamp = stamp - THROTTLE_NOTICE_MS;
+            session_users[i] = user;
+            if (!am_put(users, (int)i)) {
+                session_users[i] = NULL;
+                slab_free(user_slab, user);
+                user = NULL;
+            }
+        }
+        if (user == NULL)
+            free_ids[nfree_ids++] = (int)i;
+        else
+            nlive++;
+    }
+    session_next = (int)h.nsessions;
 
+    // channels: each members[] as it was, with a membership node per entry
+    for (i = 0L; i < h.nchannels; i++) {
+        const int *ids = (const int *)(base + rec[i].members);
+        char name[CHANNEL_MAX];
+        Channel *ch = NULL;
 
-    channel_list = hm_keyArray(channels, &len);
+        memcpy(name, rec[i].name, CHANNEL_MAX);
+        name[CHANNEL_MAX - 1] = '\0';
+        if (!hm_get(channels, name, (void **)&ch) && (ch = channel_create(name)) == NULL)
+            continue;
+        if (!channel_reserve(ch, ch->nmembers + rec[i].nmembers)) {
+            channel_release_if_empty(ch);
+            continue;
+        }
+        for (long j = 0L; j < rec[i].nmembers; j++) {
+            Membership *m;
+            User *user;
+            // the members are scattered over the user records
+            if (j + PREFETCH_AHEAD < rec[i].nmembers && (unsigned)ids[j + PREFETCH_AHEAD] < (unsigned)h.nsessions &&
+                session_users[ids[j + PREFETCH_AHEAD]] != NULL)
+                __builtin_prefetch(session_users[ids[j + PREFETCH_AHEAD]], 1);
+            if (ids[j] < 0 || ids[j] >= h.nsessions || (user = session_users[ids[j]]) == NULL ||
+                (m = (Membership *)slab_alloc(membership_slab)) == NULL)
+                continue;
+            (void)channel_add_member(ch, m, ids[j]);
+            m->next = user->channels;
+            user->channels = m;
+        }
+        channel_release_if_empty(ch);
+    }
+    printf("Restored %ld sessions and %ld channels from %s in %.1f ms\n", nlive,
+           (long)list_cache->txt_nchannels, from, (monotonic_usec() - start) / 1000.0);
+    return nlive;
+}
 
-    nbytes = sizeof(struct text_list) + (sizeof(struct channel_info) * len);
-    list_packet = malloc(nbytes);
-    list_packet->txt_type = TXT_LIST;
-    list_packet->txt_nchannels = (int)len;
+long server_restore_state(const char *path) {
+    struct stat st;
+    void *base;
+    long n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    n = snap_restore(base, st.st_size, path);
+    munmap(base, st.st_size);
+    return n;
+}
 
-    for (long i = 0L; i < len; i++)
-        strncpy(list_packet->txt_channels[i].ch_channel, channel_list[i], (CHANNEL_MAX - 1));
+/*
+ * Binary upgrades.  On SIGUSR2 the server runs its binary again, as named by
+ * argv[0] so that a build installed over it is what starts, with one end of
+ * a Unix stream socket as fd UPGRADE_FD and named in UPGRADE_ENV.  The old
+ * process stops taking datagrams off the UDP socket, handles those it has
+ * taken and sends what it owes, then passes the socket itself across with
+ * SCM_RIGHTS and streams its sessions and channels in the snapshot format.
+ * The new process restores them before it reads a datagram and then
+ * acknowledges, and only then does the old one exit.  Datagrams arriving in
+ * between wait in the socket's receive buffer, which both processes share,
+ * so sessions, memberships and queued requests all survive the upgrade.  If
+ * the new process fails before acknowledging, the old one carries on.  Say
+ * budgets start full again, and channels on shards cannot be handed over.
+ */
+#define UPGRADE_ENV "DUCKCHAT_UPGRADE_FD"
+#define UPGRADE_FD 3
+#define UPGRADE_TIMEOUT_MS 10000 /* for the new process to acknowledge */
+#define DRAIN_TIMEOUT_MS 1000 /* for the egress queue to reach the socket */
+
+// reads all of buf, returns 1 if successful
+int snap_read(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
 
-    sendto(socket_fd, list_packet, nbytes, 0, (struct sockaddr *)user->addr, sizeof(*user->addr));
-    printf("%s listed available channels on server\n", user->username);
+// sends socket_fd over the channel, returns 1 if successful
+int upgrade_send_socket(int chan) {
+    char tag = 'S';
+    struct iovec iov = { &tag, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *c;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &socket_fd, sizeof(int));
+    return sendmsg(chan, &msg, MSG_NOSIGNAL) == 1;
+}
 
-    free(channel_list);
-    free(list_packet);
-    return;
+int server_adopt_socket(int chan) {
+    char tag;
+    struct iovec iov = { &tag, 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(chan, &msg, MSG_CMSG_CLOEXEC) != 1 || tag != 'S' ||
+        (c = CMSG_FIRSTHDR(&msg)) == NULL || c->cmsg_level != SOL_SOCKET ||
+        c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
 }
 
-void server_who_request(const char *packet, char *client_ip) {
+long server_adopt_state(int chan) {
+    SnapHeader h;
+    char *buf;
+    unsigned char ack = 1;
+    long n = -1L;
+
+    // an older server sends a shorter header; snap_restore() checks the rest
+    if (!snap_read(chan, &h, SNAP_V1_HEADER) || memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) ||
+        h.file_bytes < SNAP_V1_HEADER || (buf = malloc(h.file_bytes)) == NULL)
+        return -1;
+    memcpy(buf, &h, SNAP_V1_HEADER);
+    if (snap_read(chan, buf + SNAP_V1_HEADER, h.file_bytes - SNAP_V1_HEADER))
+        n = snap_restore(buf, h.file_bytes, "the old process");
+    free(buf);
+    if (n >= 0L && send(chan, &ack, 1, MSG_NOSIGNAL) != 1)
+        n = -1L;
+    close(chan);
+    return n;
+}
 
-    User *user, **user_list = NULL;
-    if (!hm_get(users, client_ip, (void **)&user))
-        return;
+// waits for the new process to acknowledge, returns 1 if it did
+int upgrade_acked(int chan) {
+    struct pollfd pfd = { chan, POLLIN, 0 };
+    unsigned char ack = 0;
 
-    LinkedList *users;
-    size_t nbytes;
-    long len = 0L;
-    struct text_who *send_packet = NULL;
-    struct request_who *who_packet = (struct request_who *) packet;
+    return poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1 && read(chan, &ack, 1) == 1 && ack == 1;
+}
 
-    if (!hm_get(channels, who_packet->req_channel, (void **)&users)) {
-        printf("Channel named %s does not exist\n", send_packet->txt_channel);
-        server_send_error(user->addr, "Channel does not exist.\n");
-        return;
+int server_upgrade(char *const argv[]) {
+    extern char **environ;
+    static char entry[sizeof(UPGRADE_ENV) + 16];
+    long long start, deadline;
+    char **envp;
+    int pair[2], n, i, status;
+    pid_t pid;
+
+    if (shards != NULL)
+        return -1;
+    start = monotonic_usec();
+
+    // take nothing more off the socket, and settle everything taken
+    receiver_stop();
+    while (ring_count(control_ring) > 0L || ring_count(bulk_ring) > 0L)
+        ingress_process();
+    while (ndirty_batches > 0)
+        batch_flush(session_users[dirty_batches[0]->id]);
+    server_fanout_wait();
+    deadline = monotonic_usec() + DRAIN_TIMEOUT_MS * 1000LL;
+    while (eg_pending(egress) > 0L && monotonic_usec() < deadline) {
+        struct pollfd pfd = { socket_fd, POLLOUT, 0 };
+        (void)poll(&pfd, 1, 10);
+        (void)eg_flush(egress);
+    }
+    server_snapshot_finish();
+    // the new process appends after the last say synced here
+    server_saylog_sync();
+
+    // the child may not allocate between fork() and exec, so build its
+    // environment first
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    if ((envp = malloc((n + 2) * sizeof(char *))) == NULL)
+        return -1;
+    for (n = 0, i = 0; environ[i] != NULL; i++)
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0)
+            envp[n++] = environ[i];
+    snprintf(entry, sizeof(entry), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+    envp[n++] = entry;
+    envp[n] = NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        free(envp);
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) == 0) {
+        // the new process gets stdio and the channel, nothing else
+        if (pair[1] == UPGRADE_FD)
+            (void)fcntl(UPGRADE_FD, F_SETFD, 0);
+        else if (dup2(pair[1], UPGRADE_FD) < 0)
+            _exit(127);
+        (void)close_range(UPGRADE_FD + 1, ~0U, 0);
+        execvpe(argv[0], argv, envp);
+        _exit(127);
     }
+    free(envp);
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        return -1;
+    }
+    if (upgrade_send_socket(pair[0]) && snap_write_state(pair[0]) && upgrade_acked(pair[0])) {
+        close(pair[0]);
+        printf("Handed over to process %d after %.1f ms\n", (int)pid, (monotonic_usec() - start) / 1000.0);
+        return 0;
+    }
+    close(pair[0]);
+    kill(pid, SIGKILL);
+    (void)waitpid(pid, &status, 0);
+    return -1;
+}
 
-    user_list = (User **)ll_toArray(users, &len);
+int server_init_state(void) {
+
+    Channel *default_ch;
+
+    // a full socket buffer must never stall the loop: see egress.h
+    if (fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+    egress = eg_create(socket_fd, EGRESS_SLOTS, EGRESS_PER_SESSION);
+    if ((snap_epochs = ep_create()) == NULL)
+        return -1;
+    // a restored snapshot brings its own key, so its tokens stay good
+    if (getrandom(token_key, sizeof(token_key), 0) != (ssize_t)sizeof(token_key))
+        return -1;
+    say_counts = cms_create(HOT_WIDTH, HOT_DEPTH);
+    send_counts = cms_create(HOT_WIDTH, HOT_DEPTH);
+    hot_by_says = topk_create(HOT_K, CHANNEL_MAX - 1);
+    hot_by_sends = topk_create(HOT_K, CHANNEL_MAX - 1);
+    if (say_counts == NULL || send_counts == NULL || hot_by_says == NULL || hot_by_sends == NULL)
+        return -1;
+    hot_window_start = monotonic_msec();
+    for (history_depth = (history_policy.depth > 0) ? 1UL : 0UL; history_depth > 0UL &&
+         history_depth < (unsigned long)history_policy.depth; history_depth *= 2)
+        ;
+    if (fanout_policy.threads > 0) {
+        // the workers inherit the mask, which leaves signals to the main thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        fanpool = fp_create(socket_fd, fanout_policy.threads, FANOUT_CHUNK);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (fanpool == NULL)
+            return -1;
+    }
+    if (saylog_policy.dir != NULL) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        saylog = sl_open(saylog_policy.dir, (size_t)saylog_policy.segment_bytes, saylog_policy.sync_ms);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (saylog == NULL) {
+            fprintf(stderr, "Could not open the say log in %s\n", saylog_policy.dir);
+            return -1;
+        }
+    }
+    users = am_create(0L, &session_addrs);
+    channels = hm_create(100L, 0.0f);
+    user_slab = slab_create(sizeof(User), SLAB_CACHELINE, 0L);
+    channel_slab = slab_create(sizeof(Channel), SLAB_CACHELINE, 0L);
+    membership_slab = slab_create(sizeof(Membership), 0, 0L);
+    batch_slab = slab_create(sizeof(Batch), SLAB_CACHELINE, 64L);
+    if (egress == NULL || users == NULL || channels == NULL || user_slab == NULL ||
+        channel_slab == NULL || membership_slab == NULL || batch_slab == NULL)
+        return -1;
+
+    list_capacity = 16L;
+    if ((list_cache = calloc(1, LIST_BYTES(list_capacity))) == NULL)
+        return -1;
+    list_cache->txt_type = TXT_LIST;
+    list_cache->txt_nchannels = 0;
+
+    control_ring = ring_create(sizeof(Packet), INGRESS_SLOTS);
+    bulk_ring = ring_create(sizeof(Packet), INGRESS_SLOTS);
+    ingress_staging = malloc(INGRESS_BATCH * sizeof(Packet));
+    ingress_work = malloc(INGRESS_BATCH * sizeof(Packet));
+    if (control_ring == NULL || bulk_ring == NULL || ingress_staging == NULL ||
+        ingress_work == NULL || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+        (receiver_stop_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        return -1;
+
+    if (shard_policy.shards > 0)
+        return shards_create();
+    if ((default_ch = channel_create(DEFAULT_CHANNEL)) == NULL)
+        return -1;
+    return 0;
+}
 
-    nbytes = sizeof(struct text_who) + (sizeof(struct user_info) * len);
-    send_packet = malloc(nbytes);
-    send_packet->txt_type = TXT_WHO;
-    send_packet->txt_nusernames = (int)len;
-    strncpy(send_packet->txt_channel, who_packet->req_channel, (CHANNEL_MAX - 1));
 
-    for (long i = 0L; i < len; i++)
-        strncpy(send_packet->txt_users[i].us_username, user_list[i]->username, (USERNAME_MAX - 1));
+#ifndef SERVER_NO_MAIN
+volatile sig_atomic_t stats_requested = 0;
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
 
-    sendto(socket_fd, send_packet, nbytes, 0, (struct sockaddr *)user->addr, sizeof(*user->addr));
-    printf("%s listed all users on channel %s", user->username, who_packet->req_channel);
+void on_sigusr1(int sig UNUSED) {
+    stats_requested = 1;
+}
 
-    free(user_list);
-    free(send_packet);
-    return;
+void on_sigterm(int sig UNUSED) {
+    stop_requested = 1;
 }
 
+void on_sigusr2(int sig UNUSED) {
+    upgrade_requested = 1;
+}
 
 // Server Driver Code
 int main(int argc, char *argv[]) {
 
-    if (argc != 3) {
-        printf("Usage: ./server domain_name port_number\n");
+    char **args = argv; /* for server_upgrade() */
+    char *handoff = getenv(UPGRADE_ENV);
+    int opt, chan = -1;
+
+    // say limits, as says per second and burst size (0 disables a bucket),
+    // then -f for plain arrival-order ingress and the say shed budget, then
+    // the fan-out pool size (0 for none) and the channel size that uses it,
+    // then the number of channel shards (0 for none), then the state snapshot
+    // file and the seconds between snapshots, then the says kept per channel,
+    // then the say log directory and the milliseconds between its syncs,
+    // then the name prefix of channels whose says are sent reliably
+    while ((opt = getopt(argc, argv, "r:b:R:B:fd:t:T:S:p:i:H:L:F:Y:")) != -1) {
+        switch (opt) {
+            case 'r': say_limits.session_rate = atoi(optarg); break;
+            case 'b': say_limits.session_burst = atoi(optarg); break;
+            case 'R': say_limits.channel_rate = atoi(optarg); break;
+            case 'B': say_limits.channel_burst = atoi(optarg); break;
+            case 'f': ingress_policy.priority = 0; break;
+            case 'd': ingress_policy.shed_usec = atoll(optarg); break;
+            case 't': fanout_policy.threads = atoi(optarg); break;
+            case 'T': fanout_policy.threshold = atol(optarg); break;
+            case 'S': shard_policy.shards = atoi(optarg); break;
+            case 'p': snapshot_policy.path = optarg; break;
+            case 'i': snapshot_policy.interval = atoi(optarg); break;
+            case 'H': history_policy.depth = atoi(optarg); break;
+            case 'L': saylog_policy.dir = optarg; break;
+            case 'F': saylog_policy.sync_ms = atoi(optarg); break;
+            case 'Y': reliable_policy.prefix = optarg; break;
+            default: argc = 0; break;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: ./server [-r session_says_per_sec] [-b session_burst] [-R channel_says_per_sec] [-B channel_burst] [-f] [-d shed_usec] [-t fanout_threads] [-T fanout_threshold] [-S channel_shards] [-p snapshot_file] [-i snapshot_secs] [-H history_says] [-L say_log_dir] [-F say_log_sync_ms] [-Y reliable_channel_prefix] domain_name port_number\n");
         exit(EXIT_FAILURE);
     }
-
-    LinkedList *default_ll;
-
-    struct timeval tv;
-    tv.tv_sec = 300;
-    tv.tv_usec = 100000;
-
-    socklen_t addr_len = sizeof(client);
-    fd_set receiver;
-    char buffer[1024], client_ip[64];
-    struct text *packet_type;
+    argv += optind - 1;
 
     server.sin_family = AF_INET;
     server.sin_port = htons(atoi(argv[2]));
     memcpy((char *)&server.sin_addr, (char *)gethostbyname(argv[1])->h_addr_list[0], gethostbyname(argv[1])->h_length);
 
-    if ((socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
-        printf("Failed to create a socket.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (bind(socket_fd, (struct sockaddr *)&server, sizeof(server)) < 0){
-        printf("Failed bind.\n");
-        exit(EXIT_FAILURE);
+    // started by server_upgrade(): the socket and the state come from the old process
+    if (handoff != NULL) {
+        chan = atoi(handoff);
+        unsetenv(UPGRADE_ENV);
+        if ((socket_fd = server_adopt_socket(chan)) < 0) {
+            printf("Failed to take over the socket.\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if ((socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+            printf("Failed to create a socket.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (bind(socket_fd, (struct sockaddr *)&server, sizeof(server)) < 0){
+            printf("Failed bind.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    users = hm_create(100L, 0.0f);
-    channels = hm_create(100L, 0.0f);
-    default_ll = ll_create();
-
-    if(users == NULL || channels == NULL || default_ll == NULL || !hm_put(channels, DEFAULT_CHANNEL, default_ll, NULL)){
+    if (server_init_state() < 0) {
         printf("Memory allocation failed\n");
         exit(EXIT_FAILURE);
     }
+    if (chan >= 0) {
+        if (server_adopt_state(chan) < 0) {
+            printf("Failed to take over the state.\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (snapshot_policy.path != NULL && access(snapshot_policy.path, F_OK) == 0 &&
+               server_restore_state(snapshot_policy.path) < 0) {
+        fprintf(stderr, "Could not restore state from %s; starting empty\n", snapshot_policy.path);
+    }
+    signal(SIGUSR1, on_sigusr1);
+    signal(SIGUSR2, on_sigusr2);
+    signal(SIGTERM, on_sigterm);
+    signal(SIGPIPE, SIG_IGN);
 
 
     while (1) {
 
-        FD_ZERO(&receiver);
-        FD_SET(socket_fd, &receiver);
-        select((socket_fd + 1), &receiver, NULL, NULL, &tv);
-    
-        memset(buffer, 0, sizeof(buffer));
-        if (recvfrom(socket_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client, &addr_len) < 0)
-            continue;
-        sprintf(client_ip, "%s:%d", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-        packet_type = (struct text *) buffer;
-        switch (packet_type->txt_type) {
-            case REQ_LOGIN:
-                server_login_request(buffer, client_ip, &client);
-                break;
-            case REQ_LOGOUT:
-                server_logout_request(client_ip);
-                break;
-            case REQ_JOIN:
-                server_join_request(buffer, client_ip);
-                break;
-            case REQ_LEAVE:
-                server_leave_request(buffer, client_ip);
-                break;
-            case REQ_SAY:
-                server_say_request(buffer, client_ip);
-                break;
-            case REQ_LIST:
-                server_list_request(client_ip);
-                break;
-            case REQ_WHO:
-                server_who_request(buffer, client_ip);
-                break;
-            default:
-                break;
+        if (stats_requested) {
+            stats_requested = 0;
+            server_print_stats(stderr);
+        }
+        if (stop_requested) {
+            server_snapshot_finish();
+            if (snapshot_policy.path != NULL && server_save_state(snapshot_policy.path) < 0)
+                fprintf(stderr, "Failed to save state to %s\n", snapshot_policy.path);
+            if (saylog != NULL) {
+                // with the says the shards have admitted so far
+                server_shards_wait();
+                sl_close(saylog);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (server_upgrade(args) == 0)
+                exit(EXIT_SUCCESS);
+            fprintf(stderr, "Upgrade failed; carrying on\n");
         }
+
+        server_poll();
+        server_snapshot_due();
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,165 @@
+#ifndef SERVER_H
+#define SERVER_H
+/*
+ * server.h
+ *
+ * Request handlers and state set-up of the DuckChat server.  server.c is
+ * normally linked with its own main(); building it with -DSERVER_NO_MAIN
+ * leaves main() out so the benchmarks can drive the real handlers.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+extern int socket_fd;
+
+/* Say admission: rates are says per second and bursts are says; a rate of
+ * 0 disables that bucket.  Read when a session or channel is created. */
+struct say_limits {
+    int session_rate;
+    int session_burst;
+    int channel_rate;
+    int channel_burst;
+};
+extern struct say_limits say_limits;
+
+/* Ingress scheduling: with priority set, requests other than says are
+ * handled first and a say queued longer than shed_usec is dropped; with it
+ * clear, requests are handled in arrival order. */
+struct ingress_policy {
+    int priority;
+    long long shed_usec;
+};
+extern struct ingress_policy ingress_policy;
+
+/* Fan-out: says to channels of `threshold' members or more are sent by a
+ * pool of `threads' workers (none if 0).  Read by server_init_state(). */
+struct fanout_policy {
+    int threads;
+    long threshold;
+};
+extern struct fanout_policy fanout_policy;
+
+/* Waits until the fan-out pool has sent everything handed to it. */
+void server_fanout_wait(void);
+
+/* History: each channel keeps its last `depth' says (rounded up to a power
+ * of two; 0 keeps none) for REQ_HISTORY.  Read by server_init_state(). */
+struct history_policy {
+    int depth;
+};
+extern struct history_policy history_policy;
+
+/* Say log: with `dir' set, every say admitted is appended to a log of
+ * segment files of `segment_bytes' there (see saylog.h), synced every
+ * `sync_ms' milliseconds.  Read by server_init_state(). */
+struct saylog_policy {
+    const char *dir;
+    int sync_ms;
+    long segment_bytes;
+};
+extern struct saylog_policy saylog_policy;
+
+/* Waits until every say logged so far is synced to the say log. */
+void server_saylog_sync(void);
+
+/* Reliable delivery: a session that sends an envelope (see reliable.h)
+ * gets every reply reliably, and says in channels whose names start with
+ * `prefix' (none if NULL) too; elsewhere says stay best-effort.  Read when
+ * a channel is created.  Shards send everything best-effort. */
+struct reliable_policy {
+    const char *prefix;
+};
+extern struct reliable_policy reliable_policy;
+
+/* Channel sharding: each channel is owned by one of `shards' threads,
+ * chosen by hashing its name, which handles every join, leave, say and WHO
+ * for it; 0 keeps channels on the dispatch thread.  Read by
+ * server_init_state(). */
+struct shard_policy {
+    int shards;
+};
+extern struct shard_policy shard_policy;
+
+/* Waits until every shard has handled everything passed to it. */
+void server_shards_wait(void);
+
+/* State snapshots: with `path' set, the sessions and channels are saved
+ * there every `interval' seconds (never if 0) by server_snapshot_due(). */
+struct snapshot_policy {
+    const char *path;
+    int interval;
+};
+extern struct snapshot_policy snapshot_policy;
+
+/* Writes the sessions and channels to `path', replacing it atomically.
+ * Returns 0 on success, -1 on I/O errors or with channels on shards. */
+int server_save_state(const char *path);
+/* Loads a snapshot into freshly initialised state.  Returns the number of
+ * sessions restored, or -1 if the file is missing, invalid or incompatible. */
+long server_restore_state(const char *path);
+/* Starts a periodic snapshot in a child process if one is due, and reaps
+ * the last one; server_snapshot_finish() waits for it. */
+void server_snapshot_due(void);
+void server_snapshot_finish(void);
+
+/* Starts argv[0] as the replacement server and hands it the socket and
+ * the sessions and channels (SIGUSR2 in the server).  Returns 0 once the new
+ * process has taken over, when the caller should exit; -1 if it did not,
+ * when the caller carries on serving. */
+int server_upgrade(char *const argv[]);
+/* In the replacement, read the socket and then the state from the channel
+ * server_upgrade() opened; server_adopt_state() acknowledges and closes it.
+ * Return the socket or the number of sessions, or -1 on failure. */
+int server_adopt_socket(int chan);
+long server_adopt_state(int chan);
+
+/* Event counters, printed by server_print_stats() (SIGUSR1 in the server). */
+struct server_stats {
+    unsigned long says_throttled_session;
+    unsigned long says_throttled_channel;
+    unsigned long throttle_notices;
+    unsigned long says_shed; /* past the shed budget or with the queue full */
+    unsigned long control_dropped; /* control queue full */
+};
+extern struct server_stats server_stats;
+
+void server_print_stats(FILE *out);
+
+/* Allocates the session and channel tables and the default channel.
+ * Returns 0 on success, -1 if memory allocation failed. */
+int server_init_state(void);
+
+/* Waits for datagrams (or the next batch deadline), drains the socket into
+ * the ingress queues and handles what the ingress policy allows. */
+void server_poll(void);
+
+/* Hands a received datagram of either encoding to its request handler. */
+void server_dispatch(char *packet, size_t len, struct sockaddr_in *addr);
+
+/* `len' is the datagram length, which tells a plain login from one that
+ * also announces capabilities. */
+void server_login_request(char *packet, size_t len, struct sockaddr_in *addr);
+void server_logout_request(struct sockaddr_in *addr);
+void server_join_request(char *packet, struct sockaddr_in *addr);
+void server_leave_request(char *packet, struct sockaddr_in *addr);
+void server_say_request(char *packet, struct sockaddr_in *addr);
+void server_list_request(struct sockaddr_in *addr);
+void server_who_request(const char *packet, struct sockaddr_in *addr);
+void server_list_page_request(const char *packet, struct sockaddr_in *addr);
+void server_who_page_request(const char *packet, struct sockaddr_in *addr);
+void server_list_prefix_request(const char *packet, struct sockaddr_in *addr);
+void server_history_request(const char *packet, struct sockaddr_in *addr);
+void server_resume_request(const char *packet, struct sockaddr_in *addr);
+/* `len' bounds the channels named, as for a login. */
+void server_join_many_request(const char *packet, size_t len, struct sockaddr_in *addr);
+void server_leave_many_request(const char *packet, size_t len, struct sockaddr_in *addr);
+
+/* Returns how long main may wait for a packet before batch_flush_due() has
+ * work to do, in microseconds, or -1 if no batch is pending. */
+long long batch_wait_usec(void);
+/* Sends every pending TXT_BATCH whose flush deadline has passed. */
+void batch_flush_due(void);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * sketch.c
+ *
+ * implementation of the count-min sketch and the top-k
+ *
+ * one 64-bit hash of a key picks its counter in every row by double
+ * hashing; the top-k's index is open-addressed with linear probing and
+ * backward-shift deletion, so it needs no tombstones
+ */
+
+#include "sketch.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct count_min {
+    unsigned long mask;		/* width - 1 */
+    int depth;
+    unsigned long *counters;	/* depth rows of width */
+};
+
+struct top_k {
+    int k;
+    int n;			/* entries in use, 0 .. n-1 */
+    size_t keyMax;
+    char *keys;			/* entry i at i * (keyMax + 1) */
+    unsigned long *counts;
+    unsigned long long *hashes;
+    int *heap;			/* entries, a min-heap on count */
+    int *pos;			/* heap position of each entry */
+    int *index;			/* entry + 1 per slot, 0 if empty */
+    unsigned long slotMask;
+};
+
+static unsigned long roundUp(long n) {
+    unsigned long p = 1UL;
+
+    while (p < (unsigned long)n)
+        p <<= 1;
+    return p;
+}
+
+static size_t keyLen(const char *key, size_t len, size_t max) {
+    return strnlen(key, (len < max) ? len : max);
+}
+
+/*
+ * local function: FNV-1a over the key, finished with a 64-bit mixer so the
+ * high and low halves are both usable
+ */
+static unsigned long long hashKey(const char *key, size_t len) {
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+CountMin *cms_create(long width, int depth) {
+    CountMin *cms = (CountMin *)malloc(sizeof(CountMin));
+
+    if (cms != NULL) {
+        cms->mask = roundUp(width) - 1;
+        cms->depth = (depth > 0) ? depth : 1;
+        cms->counters = (unsigned long *)calloc((cms->mask + 1) * cms->depth, sizeof(unsigned long));
+        if (cms->counters == NULL) {
+            free(cms);
+            return NULL;
+        }
+    }
+    return cms;
+}
+
+void cms_destroy(CountMin *cms) {
+    free(cms->counters);
+    free(cms);
+}
+
+unsigned long cms_add(CountMin *cms, const char *key, size_t len, unsigned long weight) {
+    unsigned long long h = hashKey(key, strnlen(key, len));
+    unsigned long h1 = (unsigned long)(h & 0xffffffffULL), h2 = (unsigned long)(h >> 32) | 1UL;
+    unsigned long est = ~0UL;
+    int i;
+
+    for (i = 0; i < cms->depth; i++) {
+        unsigned long *c = &cms->counters[i * (cms->mask + 1) + ((h1 + i * h2) & cms->mask)];
+        *c += weight;
+        if (*c < est)
+            est = *c;
+    }
+    return est;
+}
+
+unsigned long cms_estimate(CountMin *cms, const char *key, size_t len) {
+    unsigned long long h = hashKey(key, strnlen(key, len));
+    unsigned long h1 = (unsigned long)(h & 0xffffffffULL), h2 = (unsigned long)(h >> 32) | 1UL;
+    unsigned long est = ~0UL;
+    int i;
+
+    for (i = 0; i < cms->depth; i++) {
+        unsigned long c = cms->counters[i * (cms->mask + 1) + ((h1 + i * h2) & cms->mask)];
+        if (c < est)
+            est = c;
+    }
+    return est;
+}
+
+void cms_clear(CountMin *cms) {
+    memset(cms->counters, 0, (cms->mask + 1) * cms->depth * sizeof(unsigned long));
+}
+
+TopK *topk_create(int k, size_t keyMax) {
+    TopK *tk = (TopK *)malloc(sizeof(TopK));
+
+    if (tk == NULL)
+        return NULL;
+    tk->k = (k > 0) ? k : 1;
+    tk->n = 0;
+    tk->keyMax = keyMax;
+    tk->slotMask = roundUp(4L * tk->k) - 1;
+    tk->keys = (char *)malloc(tk->k * (keyMax + 1));
+    tk->counts = (unsigned long *)malloc(tk->k * sizeof(unsigned long));
+    tk->hashes = (unsigned long long *)malloc(tk->k * sizeof(unsigned long long));
+    tk->heap = (int *)malloc(tk->k * sizeof(int));
+    tk->pos = (int *)malloc(tk->k * sizeof(int));
+    tk->index = (int *)calloc(tk->slotMask + 1, sizeof(int));
+    if (tk->keys == NULL || tk->counts == NULL || tk->hashes == NULL ||
+        tk->heap == NULL || tk->pos == NULL || tk->index == NULL) {
+        topk_destroy(tk);
+        return NULL;
+    }
+    return tk;
+}
+
+void topk_destroy(TopK *tk) {
+    free(tk->keys);
+    free(tk->counts);
+    free(tk->hashes);
+    free(tk->heap);
+    free(tk->pos);
+    free(tk->index);
+    free(tk);
+}
+
+static char *entryKey(TopK *tk, int e) {
+    return tk->keys + e * (tk->keyMax + 1);
+}
+
+/*
+ * local function that returns the index slot of the key, or of the empty
+ * slot where it would go; `*entry' is the entry found, or -1
+ */
+static unsigned long findSlot(TopK *tk, const char *key, size_t len, unsigned long long h, int *entry) {
+    unsigned long i = (unsigned long)h & tk->slotMask;
+
+    for (; tk->index[i] != 0; i = (i + 1) & tk->slotMask) {
+        int e = tk->index[i] - 1;
+        char *k = entryKey(tk, e);
+        if (tk->hashes[e] == h && strlen(k) == len && memcmp(k, key, len) == 0) {
+            *entry = e;
+            return i;
+        }
+    }
+    *entry = -1;
+    return i;
+}
+
+/*
+ * local function that removes the entry from the index, shifting back any
+ * entry of the probe run that would otherwise become unreachable
+ */
+static void unindex(TopK *tk, int e) {
+    unsigned long i = (unsigned long)tk->hashes[e] & tk->slotMask, j;
+
+    while (tk->index[i] != e + 1)
+        i = (i + 1) & tk->slotMask;
+    tk->index[i] = 0;
+    for (j = (i + 1) & tk->slotMask; tk->index[j] != 0; j = (j + 1) & tk->slotMask) {
+        unsigned long home = (unsigned long)tk->hashes[tk->index[j] - 1] & tk->slotMask;
+        /* move it unless its home lies cyclically in (i, j] */
+        if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) {
+            tk->index[i] = tk->index[j];
+            tk->index[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void swap(TopK *tk, int a, int b) {
+    int t = tk->heap[a];
+
+    tk->heap[a] = tk->heap[b];
+    tk->heap[b] = t;
+    tk->pos[tk->heap[a]] = a;
+    tk->pos[tk->heap[b]] = b;
+}
+
+static void siftUp(TopK *tk, int p) {
+    while (p > 0 && tk->counts[tk->heap[(p - 1) / 2]] > tk->counts[tk->heap[p]]) {
+        swap(tk, p, (p - 1) / 2);
+        p = (p - 1) / 2;
+    }
+}
+
+static void siftDown(TopK *tk, int p) {
+    for (;;) {
+        int c = 2 * p + 1;
+        if (c >= tk->n)
+            break;
+        if (c + 1 < tk->n && tk->counts[tk->heap[c + 1]] < tk->counts[tk->heap[c]])
+            c++;
+        if (tk->counts[tk->heap[p]] <= tk->counts[tk->heap[c]])
+            break;
+        swap(tk, p, c);
+        p = c;
+    }
+}
+
+void topk_offer(TopK *tk, const char *key, size_t len, unsigned long count) {
+    size_t n = keyLen(key, len, tk->keyMax);
+    unsigned long long h = hashKey(key, n);
+    unsigned long slot;
+    int e;
+
+    slot = findSlot(tk, key, n, h, &e);
+    if (e >= 0) {
+        tk->counts[e] = count;
+        siftUp(tk, tk->pos[e]);
+        siftDown(tk, tk->pos[e]);
+        return;
+    }
+    if (tk->n < tk->k) {
+        e = tk->n++;
+        tk->heap[e] = e;
+        tk->pos[e] = e;
+    } else if (count > tk->counts[tk->heap[0]]) {
+        int absent;
+        e = tk->heap[0];
+        unindex(tk, e);
+        slot = findSlot(tk, key, n, h, &absent);
+    } else {
+        return;
+    }
+    memcpy(entryKey(tk, e), key, n);
+    entryKey(tk, e)[n] = '\0';
+    tk->hashes[e] = h;
+    tk->counts[e] = count;
+    tk->index[slot] = e + 1;
+    siftUp(tk, tk->pos[e]);
+    siftDown(tk, tk->pos[e]);
+}
+
+static int byCountDesc(const void *a, const void *b) {
+    unsigned long x = ((const TopKEntry *)a)->count, y = ((const TopKEntry *)b)->count;
+
+    return (x < y) - (x > y);
+}
+
+int topk_list(TopK *tk, TopKEntry *out) {
+    int i;
+
+    for (i = 0; i < tk->n; i++) {
+        out[i].key = entryKey(tk, i);
+        out[i].count = tk->counts[i];
+    }
+    qsort(out, tk->n, sizeof(TopKEntry), byCountDesc);
+    return tk->n;
+}
+
+void topk_clear(TopK *tk) {
+    tk->n = 0;
+    memset(tk->index, 0, (tk->slotMask + 1) * sizeof(int));
+}
@@ -0,0 +1,92 @@
+#ifndef _SKETCH_H_
+#define _SKETCH_H_
+
+/*
+ * interface definition for fixed-memory frequency estimation of string keys
+ *
+ * CountMin is a count-min sketch: `depth' rows of `width' counters, one
+ * counter per row picked by hashing the key; adding a weight adds it to the
+ * key's counter in every row, and the estimate is the smallest of them.  An
+ * estimate is never below the true total and exceeds it by at most
+ * e/width of everything added, with probability 1 - exp(-depth).
+ *
+ * TopK keeps the `k' keys with the largest estimates offered to it, with
+ * the estimate each last had: a min-heap on the estimate plus a small hash
+ * index from key to heap slot, so an offer costs O(log k) for a fixed k,
+ * whatever the number of distinct keys
+ *
+ * keys are compared and hashed up to their first NUL or `len' bytes
+ */
+
+#include <stddef.h>
+
+typedef struct count_min CountMin;	/* opaque type definitions */
+typedef struct top_k TopK;
+
+typedef struct {
+    const char *key;		/* NUL-terminated copy, owned by the TopK */
+    unsigned long count;
+} TopKEntry;
+
+/*
+ * creates a sketch of `depth' rows of `width' counters (width is rounded
+ * up to a power of two)
+ *
+ * returns a pointer to the sketch, or NULL if there are malloc() errors
+ */
+CountMin *cms_create(long width, int depth);
+
+/*
+ * destroys the sketch
+ */
+void cms_destroy(CountMin *cms);
+
+/*
+ * adds `weight' to the key's counters
+ *
+ * returns the key's estimate after the addition
+ */
+unsigned long cms_add(CountMin *cms, const char *key, size_t len, unsigned long weight);
+
+/*
+ * returns the key's estimate
+ */
+unsigned long cms_estimate(CountMin *cms, const char *key, size_t len);
+
+/*
+ * sets every counter to zero
+ */
+void cms_clear(CountMin *cms);
+
+/*
+ * creates a top-k of `k' keys of up to `keyMax' bytes
+ *
+ * returns a pointer to the top-k, or NULL if there are malloc() errors
+ */
+TopK *topk_create(int k, size_t keyMax);
+
+/*
+ * destroys the top-k
+ */
+void topk_destroy(TopK *tk);
+
+/*
+ * tells the top-k that the key's estimate is now `count'; the key enters
+ * if there is room or `count' beats the smallest kept estimate
+ */
+void topk_offer(TopK *tk, const char *key, size_t len, unsigned long count);
+
+/*
+ * fills `out' (room for k entries) with the kept keys, largest first; the
+ * keys stay valid until the next offer or clear
+ *
+ * returns the number of entries
+ */
+int topk_list(TopK *tk, TopKEntry *out);
+
+/*
+ * forgets every key
+ */
+void topk_clear(TopK *tk);
+
+#endif /* _SKETCH_H_ */
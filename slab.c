@@ -0,0 +1,118 @@
+/*
+ * slab.c
+ *
+ * implementation of the fixed-size object allocator; see slab.h
+ */
+
+#include "slab.h"
+#include <stdlib.h>
+
+#define DEFAULT_PER_PAGE 1024
+
+typedef struct freeobj {
+    struct freeobj *next;
+} FreeObj;
+
+typedef struct page {
+    struct page *next;
+} Page;
+
+struct slab {
+    size_t size;		/* object stride, rounded up to the alignment */
+    size_t align;
+    size_t header;		/* bytes reserved at the front of each page */
+    long perPage;
+    long inUse;
+    long npages;
+    FreeObj *freel;
+    Page *pages;
+};
+
+Slab *slab_create(size_t size, size_t align, long perPage) {
+    Slab *slab;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if ((align & (align - 1)) != 0)
+        return NULL;
+    if (size < sizeof(FreeObj))
+        size = sizeof(FreeObj);
+    slab = (Slab *)malloc(sizeof(Slab));
+    if (slab != NULL) {
+        slab->size = (size + align - 1) & ~(align - 1);
+        slab->align = align;
+        slab->header = (sizeof(Page) + align - 1) & ~(align - 1);
+        slab->perPage = (perPage > 0L) ? perPage : DEFAULT_PER_PAGE;
+        slab->inUse = 0L;
+        slab->npages = 0L;
+        slab->freel = NULL;
+        slab->pages = NULL;
+    }
+    return slab;
+}
+
+void slab_destroy(Slab *slab) {
+    Page *p, *q;
+
+    for (p = slab->pages; p != NULL; p = q) {
+        q = p->next;
+        free(p);
+    }
+    free(slab);
+}
+
+/*
+ * local function that adds one page of objects to the free list
+ *
+ * returns 1 if successful, 0 if not (allocation failure)
+ */
+static int grow(Slab *slab) {
+    void *mem;
+    Page *page;
+    char *obj;
+    long i;
+
+    if (posix_memalign(&mem, slab->align,
+                       slab->header + slab->perPage * slab->size) != 0)
+        return 0;
+    page = (Page *)mem;
+    page->next = slab->pages;
+    slab->pages = page;
+    slab->npages++;
+    /* thread the free list in address order so fresh objects are handed
+     * out sequentially */
+    obj = (char *)mem + slab->header + (slab->perPage - 1) * slab->size;
+    for (i = 0L; i < slab->perPage; i++, obj -= slab->size) {
+        FreeObj *f = (FreeObj *)obj;
+        f->next = slab->freel;
+        slab->freel = f;
+    }
+    return 1;
+}
+
+void *slab_alloc(Slab *slab) {
+    FreeObj *f;
+
+    if (slab->freel == NULL && !grow(slab))
+        return NULL;
+    f = slab->freel;
+    slab->freel = f->next;
+    slab->inUse++;
+    return (void *)f;
+}
+
+void slab_free(Slab *slab, void *object) {
+    FreeObj *f = (FreeObj *)object;
+
+    f->next = slab->freel;
+    slab->freel = f;
+    slab->inUse--;
+}
+
+long slab_inUse(Slab *slab) {
+    return slab->inUse;
+}
+
+size_t slab_footprint(Slab *slab) {
+    return slab->npages * (slab->header + slab->perPage * slab->size);
+}
@@ -0,0 +1,62 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * interface definition for a fixed-size object allocator
+ *
+ * objects of one size are carved out of large pages obtained from the heap;
+ * freed objects go onto a free list threaded through the objects themselves
+ * and are handed out again before any new page is requested, so a workload
+ * that allocates and frees objects of this size costs one list operation per
+ * call and never fragments the general heap
+ *
+ * pages are only returned to the heap by slab_destroy()
+ */
+
+#include <stddef.h>
+
+typedef struct slab Slab;		/* opaque type definition */
+
+#define SLAB_CACHELINE 64
+
+/*
+ * create a slab for objects of `size' bytes, each aligned on `align' bytes
+ * (a power of two; 0 means pointer alignment); every page holds `perPage'
+ * objects (0 means a default of 1024)
+ *
+ * with align == SLAB_CACHELINE and size a multiple of it, no two objects
+ * share a cache line
+ *
+ * returns a pointer to the slab, or NULL if there are malloc() errors
+ */
+Slab *slab_create(size_t size, size_t align, long perPage);
+
+/*
+ * destroys the slab, returning every page to the heap; any objects still
+ * allocated from it become invalid
+ */
+void slab_destroy(Slab *slab);
+
+/*
+ * returns a pointer to an uninitialized object, or NULL if a new page was
+ * needed and could not be allocated
+ */
+void *slab_alloc(Slab *slab);
+
+/*
+ * returns `object', previously obtained from slab_alloc() on the same slab,
+ * to the slab's free list
+ */
+void slab_free(Slab *slab, void *object);
+
+/*
+ * returns the number of objects currently allocated from the slab
+ */
+long slab_inUse(Slab *slab);
+
+/*
+ * returns the number of bytes of heap held by the slab's pages
+ */
+size_t slab_footprint(Slab *slab);
+
+#endif /* _SLAB_H_ */
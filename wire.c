@@ -0,0 +1,269 @@
+/*
+ * wire.c
+ *
+ * implementation of the v2 wire encoding; see wire.h
+ */
+
+#include "wire.h"
+#include "duckchat.h"
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ * field signatures: 'n' integer, 's' string, '*' the names of a list (as
+ * many as its count, the last integer, says)
+ */
+static const char *schema(int dir, int type) {
+    if (dir == WIRE_REQUEST) {
+        switch (type) {
+            case REQ_LOGIN:       return "sn";
+            case REQ_LOGOUT:      return "";
+            case REQ_JOIN:        return "s";
+            case REQ_LEAVE:       return "s";
+            case REQ_SAY:         return "ss";
+            case REQ_LIST:        return "";
+            case REQ_WHO:         return "s";
+            case REQ_KEEP_ALIVE:  return "";
+            case REQ_LIST_PAGE:   return "nn";
+            case REQ_WHO_PAGE:    return "nns";
+            case REQ_LIST_PREFIX: return "nns";
+            case REQ_HISTORY:     return "s";
+            case REQ_RESUME:      return "nnn";
+            case REQ_JOIN_MANY:
+            case REQ_LEAVE_MANY:  return "n*";
+        }
+    } else {
+        switch (type) {
+            case TXT_SAY:         return "sss";
+            case TXT_ERROR:       return "s";
+            case TXT_TOKEN:       return "nnn";
+            case TXT_LIST:
+            case TXT_LIST_PAGE:   return "nnn*";
+            case TXT_WHO:
+            case TXT_WHO_PAGE:    return "nnns*";
+        }
+    }
+    return NULL;
+}
+
+/*
+ * local routines for varints (unsigned LEB128)
+ */
+static size_t varintSize(unsigned long v) {
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static int getVarint(WireReader *r, unsigned long *v) {
+    unsigned long x = 0UL;
+    int shift = 0;
+
+    while (r->p < r->end && shift < 64) {
+        unsigned char b = *r->p++;
+        x |= (unsigned long)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = x;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static void putVarint(WireWriter *w, unsigned long v) {
+    while (v >= 0x80) {
+        *w->p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *w->p++ = (unsigned char)v;
+}
+
+static int getStr(WireReader *r, WireStr *s) {
+    unsigned long len;
+
+    if (!getVarint(r, &len) || len > (unsigned long)(r->end - r->p))
+        return 0;
+    s->ptr = (const char *)r->p;
+    s->len = len;
+    r->p += len;
+    return 1;
+}
+
+static void putStr(WireWriter *w, const char *s, size_t len) {
+    putVarint(w, len);
+    memcpy(w->p, s, len);
+    w->p += len;
+}
+
+int wire_is_v2(const void *buf, size_t len) {
+    return len > 0 && *(const unsigned char *)buf == WIRE_MAGIC;
+}
+
+void wire_reader_init(WireReader *r, const void *buf, size_t len) {
+    r->p = (const unsigned char *)buf;
+    r->end = r->p + len;
+    if (wire_is_v2(buf, len))
+        r->p++;
+}
+
+int wire_next(WireReader *r, int dir, WireMsg *msg) {
+    unsigned long type, len;
+    WireReader body;
+    const char *sig;
+    int ns = 0, nn = 0;
+
+    if (r->p == r->end)
+        return 0;
+    if (!getVarint(r, &type) || !getVarint(r, &len) ||
+        len > (unsigned long)(r->end - r->p))
+        return -1;
+    body.p = r->p;
+    body.end = r->p + len;
+    r->p += len;
+
+    msg->type = (int)type;
+    msg->known = 0;
+    msg->items.p = msg->items.end = body.end;
+    if ((sig = schema(dir, (int)type)) == NULL)
+        return 1;	/* unknown types are skipped by their length */
+    for (; *sig != '\0'; sig++) {
+        if (*sig == 'n') {
+            if (!getVarint(&body, &msg->num[nn++]))
+                return -1;
+        } else if (*sig == 's') {
+            if (!getStr(&body, &msg->str[ns++]))
+                return -1;
+        } else {
+            msg->items = body;
+        }
+    }
+    msg->known = 1;
+    return 1;
+}
+
+int wire_next_item(WireMsg *msg, WireStr *item) {
+    if (msg->items.p == msg->items.end)
+        return 0;
+    return getStr(&msg->items, item) ? 1 : -1;
+}
+
+void wire_str_copy(char *dst, size_t cap, const WireStr *s) {
+    size_t n = (s->len < cap - 1) ? s->len : cap - 1;
+
+    memcpy(dst, s->ptr, n);
+    memset(dst + n, 0, cap - n);
+}
+
+void wire_writer_init(WireWriter *w, void *buf, size_t cap) {
+    w->buf = w->p = (unsigned char *)buf;
+    w->end = w->buf + cap;
+    if (cap > 0)
+        *w->p++ = WIRE_MAGIC;
+}
+
+size_t wire_len(WireWriter *w) {
+    return (size_t)(w->p - w->buf);
+}
+
+/*
+ * local function that checks there is room for a message of `type' with a
+ * body of `body' bytes, and writes its header
+ */
+static int putHeader(WireWriter *w, int type, size_t body) {
+    size_t total = varintSize(type) + varintSize(body) + body;
+
+    if (total > (size_t)(w->end - w->p))
+        return 0;
+    putVarint(w, type);
+    putVarint(w, body);
+    return 1;
+}
+
+int wire_put(WireWriter *w, int dir, int type, ...) {
+    const char *sig = schema(dir, type), *c;
+    unsigned long nums[3];
+    const char *strs[3];
+    size_t lens[3], body = 0;
+    int nn = 0, ns = 0;
+    va_list ap;
+
+    if (sig == NULL || strchr(sig, '*') != NULL)
+        return 0;
+    va_start(ap, type);
+    for (c = sig; *c != '\0'; c++) {
+        if (*c == 'n') {
+            nums[nn] = va_arg(ap, unsigned long);
+            body += varintSize(nums[nn++]);
+        } else {
+            strs[ns] = va_arg(ap, const char *);
+            lens[ns] = strnlen(strs[ns], va_arg(ap, size_t));
+            body += varintSize(lens[ns]) + lens[ns];
+            ns++;
+        }
+    }
+    va_end(ap);
+
+    if (!putHeader(w, type, body))
+        return 0;
+    nn = ns = 0;
+    for (c = sig; *c != '\0'; c++) {
+        if (*c == 'n') {
+            putVarint(w, nums[nn++]);
+        } else {
+            putStr(w, strs[ns], lens[ns]);
+            ns++;
+        }
+    }
+    return 1;
+}
+
+int wire_put_list(WireWriter *w, int type, unsigned long total,
+                  unsigned long cursor, const char *channel,
+                  const char *names, size_t stride, unsigned long n) {
+    int who = (type == TXT_WHO || type == TXT_WHO_PAGE);
+    size_t body, clen = 0;
+    unsigned long i;
+
+    body = varintSize(total) + varintSize(cursor) + varintSize(n);
+    if (who) {
+        clen = strnlen(channel, CHANNEL_MAX);
+        body += varintSize(clen) + clen;
+    }
+    for (i = 0UL; i < n; i++) {
+        size_t len = strnlen(names + i * stride, stride);
+        body += varintSize(len) + len;
+    }
+
+    if (!putHeader(w, type, body))
+        return 0;
+    putVarint(w, total);
+    putVarint(w, cursor);
+    putVarint(w, n);
+    if (who)
+        putStr(w, channel, clen);
+    for (i = 0UL; i < n; i++)
+        putStr(w, names + i * stride, strnlen(names + i * stride, stride));
+    return 1;
+}
+
+int wire_put_names(WireWriter *w, int type, const char *names, size_t stride, unsigned long n) {
+    size_t body = varintSize(n);
+    unsigned long i;
+
+    for (i = 0UL; i < n; i++) {
+        size_t len = strnlen(names + i * stride, stride);
+        body += varintSize(len) + len;
+    }
+
+    if (!putHeader(w, type, body))
+        return 0;
+    putVarint(w, n);
+    for (i = 0UL; i < n; i++)
+        putStr(w, names + i * stride, strnlen(names + i * stride, stride));
+    return 1;
+}
@@ -0,0 +1,149 @@
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+/*
+ * interface definition for the compact (v2) DuckChat wire encoding
+ *
+ * the v1 structures in duckchat.h are fixed-width: every say is 132 bytes
+ * whatever it holds.  A v2 datagram is the byte WIRE_MAGIC followed by one
+ * or more messages, each
+ *
+ *     varint type, varint body length, body
+ *
+ * where the body is the message's fields in order, integers as unsigned
+ * LEB128 varints and strings as a varint length followed by that many bytes
+ * (no terminator, no padding).  The fields of each type are
+ *
+ *   REQ_LOGIN                          username caps
+ *   REQ_LOGOUT, REQ_LIST, REQ_KEEP_ALIVE  (none)
+ *   REQ_JOIN, REQ_LEAVE, REQ_WHO,      channel
+ *   REQ_HISTORY
+ *   REQ_SAY                            channel text
+ *   REQ_LIST_PAGE                      cursor limit
+ *   REQ_WHO_PAGE                       cursor limit channel
+ *   REQ_LIST_PREFIX                    cursor limit prefix
+ *   REQ_RESUME, TXT_TOKEN              id generation mac
+ *   REQ_JOIN_MANY, REQ_LEAVE_MANY      count channel...
+ *   TXT_SAY                            channel username text
+ *   TXT_ERROR                          error
+ *   TXT_LIST, TXT_LIST_PAGE            total cursor count name...
+ *   TXT_WHO, TXT_WHO_PAGE              total cursor count channel username...
+ *
+ * where caps, cursor, limit, total, count, id, generation and mac are
+ * integers and the rest are strings; a list reply, or a bulk join or
+ * leave, carries `count' names after its other fields.
+ *
+ * v1 datagrams start with the low byte of a small type code, so the two
+ * encodings can be told apart from the first byte.  A batch of says in v2
+ * is simply several TXT_SAY messages in one datagram.
+ *
+ * the reader never copies: strings come back as pointer and length into
+ * the datagram; the writer encodes straight into the caller's buffer
+ */
+
+#include <stddef.h>
+
+#define WIRE_MAGIC 0xD2
+
+/* direction of a message; request and text type codes overlap */
+#define WIRE_REQUEST 0
+#define WIRE_TEXT 1
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} WireStr;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} WireReader;
+
+typedef struct {
+    int type;
+    int known;			/* 0 if the type has no schema; fields unset */
+    unsigned long num[3];	/* integer fields, in order */
+    WireStr str[3];		/* string fields, in order */
+    WireReader items;		/* the repeated names of a list reply */
+} WireMsg;
+
+typedef struct {
+    unsigned char *buf;
+    unsigned char *p;
+    unsigned char *end;
+} WireWriter;
+
+/*
+ * returns 1 if the datagram is v2-encoded, 0 if not
+ */
+int wire_is_v2(const void *buf, size_t len);
+
+/*
+ * prepares to read the messages of a v2 datagram
+ */
+void wire_reader_init(WireReader *r, const void *buf, size_t len);
+
+/*
+ * parses the next message travelling in direction `dir'
+ *
+ * returns 1 if a message was parsed, 0 at the end of the datagram, -1 if the
+ * rest of the datagram is malformed
+ */
+int wire_next(WireReader *r, int dir, WireMsg *msg);
+
+/*
+ * returns the next name of a list reply in `*item'
+ *
+ * returns 1 if successful, 0 if there are no more, -1 if malformed
+ */
+int wire_next_item(WireMsg *msg, WireStr *item);
+
+/*
+ * copies a string field into the fixed-size, NUL-terminated `dst' of `cap'
+ * bytes, truncating it if need be
+ */
+void wire_str_copy(char *dst, size_t cap, const WireStr *s);
+
+/*
+ * starts a v2 datagram in `buf' of `cap' bytes (writes WIRE_MAGIC)
+ */
+void wire_writer_init(WireWriter *w, void *buf, size_t cap);
+
+/*
+ * returns the number of bytes written so far
+ */
+size_t wire_len(WireWriter *w);
+
+/*
+ * appends one message of `type' travelling in direction `dir'; the
+ * variable arguments are its fields in schema order: an unsigned long per
+ * integer, and a `const char *' followed by a size_t bound per string (the
+ * string ends at its first NUL or at the bound, whichever comes first)
+ *
+ * not for list replies or bulk joins and leaves, see wire_put_list() and
+ * wire_put_names()
+ *
+ * returns 1 if successful, 0 if the message does not fit or has no schema
+ */
+int wire_put(WireWriter *w, int dir, int type, ...);
+
+/*
+ * appends a TXT_LIST, TXT_LIST_PAGE, TXT_WHO or TXT_WHO_PAGE message; the
+ * `n' names are read from `names', `stride' bytes apart, each ending at its
+ * first NUL or at `stride' bytes; `channel' is ignored for LIST types
+ *
+ * returns 1 if successful, 0 if the message does not fit
+ */
+int wire_put_list(WireWriter *w, int type, unsigned long total,
+                  unsigned long cursor, const char *channel,
+                  const char *names, size_t stride, unsigned long n);
+
+/*
+ * appends a REQ_JOIN_MANY or REQ_LEAVE_MANY message; the `n' channel names
+ * are read from `names' as for wire_put_list()
+ *
+ * returns 1 if successful, 0 if the message does not fit
+ */
+int wire_put_names(WireWriter *w, int type, const char *names, size_t stride, unsigned long n);
+
+#endif /* _WIRE_H_ */